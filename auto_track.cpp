@@ -1,4 +1,7 @@
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
 #include <QFileDialog>
 #include <QStringListModel>
 #include <QMessageBox>
@@ -167,6 +170,25 @@ std::string run_auto_track(
             targets += ", ";
     }
 
+    // register subjects with existing fib files ahead of tracking, a few at a time
+    {
+        std::vector<std::string> fib_list;
+        ImageModel src;
+        src.voxel.method_id = 4; // GQI
+        src.voxel.param[0] = length_ratio;
+        src.voxel.ti.init(8); // odf order of 8
+        for(const auto& file : file_list)
+        {
+            if(QString(file.c_str()).endsWith("fib.gz"))
+                fib_list.push_back(file);
+            else
+            if(!overwrite && std::filesystem::exists(file+src.get_file_ext()))
+                fib_list.push_back(file+src.get_file_ext());
+        }
+        if(fib_list.size() > 1)
+            normalize_cohort(fib_list,0,std::min<unsigned int>(4,std::max<unsigned int>(1,std::thread::hardware_concurrency()/8)));
+    }
+
     std::vector<std::string> names;
     for(size_t i = 0;i < file_list.size() && !prog_aborted();++i)
     {
@@ -214,7 +236,7 @@ std::string run_auto_track(
                 std::string mapping_file_name(fib_file_name);
                 mapping_file_name += ".";
                 mapping_file_name += QFileInfo(fa_template_list[0].c_str()).baseName().toLower().toStdString();
-                mapping_file_name += ".inv.mapping.gz";
+                mapping_file_name += ".warp.gz";
                 if(std::filesystem::exists(mapping_file_name))
                     QFile::remove(mapping_file_name.c_str());
             }
@@ -232,7 +254,7 @@ std::string run_auto_track(
 
         // fiber tracking on fib file
         std::shared_ptr<fib_data> handle(new fib_data);
-        bool fib_loaded = false;
+        std::vector<size_t> pending_bundles;
         for(size_t j = 0;j < track_id.size() && !prog_aborted();++j)
         {
             std::string track_name = fib.tractography_name_list[track_id[j]];
@@ -248,7 +270,6 @@ std::string run_auto_track(
             std::string trk_file_name = output_path + "/" + fib_base+"."+track_name+".tt.gz";
             std::string template_trk_file_name = output_path + "/T_" + fib_base+"."+track_name+".tt.gz";
             std::string stat_file_name = output_path + "/" + fib_base+"."+track_name+".stat.txt";
-            std::string report_file_name = dir+"/"+track_name+".report.txt";
 
             stat_files[j].push_back(stat_file_name);
 
@@ -271,134 +292,208 @@ std::string run_auto_track(
                 std::cout << "skip " << track_name << std::endl;
                 continue;
             }
+            pending_bundles.push_back(j);
+        }
+        if(pending_bundles.empty() || prog_aborted())
+            continue;
 
-            {
-                std::shared_ptr<file_holder> stat_file,trk_file;
-                if(export_stat && !has_stat_file)
-                    stat_file = std::make_shared<file_holder>(stat_file_name);
-                if(export_trk && !has_trk_file)
-                    trk_file = std::make_shared<file_holder>(trk_file_name);
+        {
+            prog_init p("loading ",std::filesystem::path(fib_file_name).filename().string().c_str());
+            if(!handle->load_from_file(fib_file_name.c_str()))
+               return fib_file_name + ": Not human data. Check image resolution.";
+        }
+        if(handle->template_id != 0)
+        {
+            std::cout << "Not adult human data. Enforce registration." << std::endl;
+            handle->set_template_id(0);
+        }
+        // warp the atlas and read the fiber data once for all bundles
+        if(!handle->load_track_atlas())
+            return handle->error_msg + " at " + fib_file_name;
+        std::shared_ptr<tracking_data> trk(new tracking_data);
+        trk->read(handle);
+
+        std::mutex report_mutex,export_mutex;
+        auto track_bundle = [&](size_t j,unsigned int thread_count) -> std::string
+        {
+            std::string track_name = fib.tractography_name_list[track_id[j]];
+            std::string output_path = dir + "/" + track_name;
+            std::string fib_base = QFileInfo(fib_file_name.c_str()).baseName().toStdString();
+            std::string no_result_file_name = output_path + "/" + fib_base+"."+track_name+".no_result.txt";
+            std::string trk_file_name = output_path + "/" + fib_base+"."+track_name+".tt.gz";
+            std::string template_trk_file_name = output_path + "/T_" + fib_base+"."+track_name+".tt.gz";
+            std::string stat_file_name = output_path + "/" + fib_base+"."+track_name+".stat.txt";
+            bool has_stat_file = std::filesystem::exists(stat_file_name);
+            bool has_trk_file = std::filesystem::exists(trk_file_name) &&
+                    (!export_template_trk || std::filesystem::exists(template_trk_file_name));
+
+            std::shared_ptr<file_holder> stat_file,trk_file;
+            if(export_stat && !has_stat_file)
+                stat_file = std::make_shared<file_holder>(stat_file_name);
+            if(export_trk && !has_trk_file)
+                trk_file = std::make_shared<file_holder>(trk_file_name);
 
-                if (!fib_loaded)
+            TractModel tract_model(handle);
+            if(!overwrite && has_trk_file)
+                tract_model.load_from_file(trk_file_name.c_str());
+
+            // each iteration increases tolerance
+            for(size_t tracking_iteration = 0;tracking_iteration < tolerance.size() &&
+                                              !tract_model.get_visible_track_count();++tracking_iteration)
+            {
+                float cur_tolerance = tolerance[tracking_iteration];
+                std::mutex finished_mutex;
+                std::condition_variable finished_cv;
+                ThreadData thread(handle);
                 {
-                    prog_init p("loading ",std::filesystem::path(fib_file_name).filename().string().c_str());
-                    if(!handle->load_from_file(fib_file_name.c_str()))
-                       return fib_file_name + ": Not human data. Check image resolution.";
-                    fib_loaded = true;
+                    thread.param.tip_iteration = uint8_t(tip);
+                    thread.param.check_ending = !QString(track_name.c_str()).contains("Cingulum");
+                    thread.param.stop_by_tract = 1;
+                    if(!thread.roi_mgr->setAtlas(track_id[j],cur_tolerance/handle->vs[0]))
+                        return handle->error_msg + " at " + fib_file_name;
+                    thread.param.termination_count = uint32_t(track_voxel_ratio*thread.roi_mgr->seeds.size());
+                    thread.param.max_seed_count = thread.param.termination_count*5000; //yield rate easy:1/100 hard:1/5000
+                    // terminate if yield rate is very low, likely quality problem
+                    thread.min_yield_seed_count = 100000;
+                    thread.min_yield = 1.0f/100000.0f;
+                    // report
+                    thread.roi_mgr->report += " The track-to-voxel ratio was set to ";
+                    thread.roi_mgr->report += QString::number(double(track_voxel_ratio),'g',1).toStdString();
+                    thread.roi_mgr->report += ".";
                 }
-                if(handle->template_id != 0)
+                thread.on_finished = [&]()
                 {
-                    std::cout << "Not adult human data. Enforce registration." << std::endl;
-                    handle->set_template_id(0);
-                }
+                    std::lock_guard<std::mutex> lock(finished_mutex);
+                    finished_cv.notify_all();
+                };
 
-                TractModel tract_model(handle);
-                if(!overwrite && has_trk_file)
-                    tract_model.load_from_file(trk_file_name.c_str());
+                // run tracking
+                thread.run(trk,thread_count,false);
+                std::string report = tract_model.report + thread.report.str();
+                report += " Shape analysis (Yeh, Neuroimage, 2020) was conducted to derive shape metrics for tractography.";
+                if(reports[j].empty())
+                    reports[j] = report;
 
-                // each iteration increases tolerance
-                for(size_t tracking_iteration = 0;tracking_iteration < tolerance.size() &&
-                                                  !tract_model.get_visible_track_count();++tracking_iteration)
                 {
-                    float cur_tolerance = tolerance[tracking_iteration];
-                    ThreadData thread(handle);
+                    std::string temp_report = report;
+                    auto iter = temp_report.find(track_name);
+                    temp_report.replace(iter,track_name.length(),targets);
+                    // remove "A seeding region was placed at xxxxx"
+                    iter = temp_report.find("A seeding region was placed at ");
+                    temp_report.replace(iter+31,track_name.length(),
+                            "the track region indicates by tractography atlas");
+
+
+                    // remove "A total of xxxxx tracts were calculated."
+                    iter = temp_report.find("tracts were calculated.");
+                    auto iter2 = temp_report.find_first_of("A total of ",iter-20);
+                    temp_report.replace(iter2,iter-iter2+23,"");
+                    std::lock_guard<std::mutex> lock(report_mutex);
+                    auto_track_report = temp_report;
+                }
+                while(!thread.is_ended() && !prog_aborted())
+                {
                     {
-                        prog_init p("preparing tracking ",track_name.c_str());
-                        thread.param.tip_iteration = uint8_t(tip);
-                        thread.param.check_ending = !QString(track_name.c_str()).contains("Cingulum");
-                        thread.param.stop_by_tract = 1;
-                        if(!thread.roi_mgr->setAtlas(track_id[j],cur_tolerance/handle->vs[0]))
-                            return handle->error_msg + " at " + fib_file_name;
-                        thread.param.termination_count = uint32_t(track_voxel_ratio*thread.roi_mgr->seeds.size());
-                        thread.param.max_seed_count = thread.param.termination_count*5000; //yield rate easy:1/100 hard:1/5000
-                        // report
-                        thread.roi_mgr->report += " The track-to-voxel ratio was set to ";
-                        thread.roi_mgr->report += QString::number(double(track_voxel_ratio),'g',1).toStdString();
-                        thread.roi_mgr->report += ".";
+                        std::unique_lock<std::mutex> lock(finished_mutex);
+                        finished_cv.wait_for(lock,std::chrono::seconds(2),[&](){return thread.is_ended();});
                     }
+                    thread.fetchTracks(&tract_model);
+                }
+                if(prog_aborted())
+                    return std::string();
+                thread.end_thread();
+                std::cout << track_name << " " << thread.get_yield_report();
+                thread.fetchTracks(&tract_model);
+                thread.apply_tip(&tract_model);
+
+                if(thread.low_yield || tract_model.get_visible_track_count() == 0)
+                {
+                    tract_model.clear();
+                    continue;
+                }
 
-                    // run tracking
-                    prog_init p("tracking ",track_name.c_str());
-                    thread.run(std::thread::hardware_concurrency(),false);
-                    std::string report = tract_model.report + thread.report.str();
-                    report += " Shape analysis (Yeh, Neuroimage, 2020) was conducted to derive shape metrics for tractography.";
-                    if(reports[j].empty())
-                        reports[j] = report;
+                tract_model.delete_repeated(1.0f);
 
-                    {
-                        std::string temp_report = report;
-                        auto iter = temp_report.find(track_name);
-                        temp_report.replace(iter,track_name.length(),targets);
-                        // remove "A seeding region was placed at xxxxx"
-                        iter = temp_report.find("A seeding region was placed at ");
-                        temp_report.replace(iter+31,track_name.length(),
-                                "the track region indicates by tractography atlas");
-
-
-                        // remove "A total of xxxxx tracts were calculated."
-                        iter = temp_report.find("tracts were calculated.");
-                        auto iter2 = temp_report.find_first_of("A total of ",iter-20);
-                        temp_report.replace(iter2,iter-iter2+23,"");
-                        auto_track_report = temp_report;
-                    }
-                    bool no_result = false;
-                    const unsigned int low_yield_threshold = 100000;
-                    while(!thread.is_ended() && !prog_aborted())
-                    {
-                        check_prog(thread.get_total_tract_count(),
-                                   thread.param.termination_count);
-                        thread.fetchTracks(&tract_model);
-                        std::this_thread::sleep_for(std::chrono::seconds(2));
-                        // terminate if yield rate is very low, likely quality problem
-                        if(thread.get_total_seed_count() > low_yield_threshold &&
-                           thread.get_total_tract_count() < thread.get_total_seed_count()/low_yield_threshold)
-                        {
-                            no_result = true;
-                            thread.end_thread();
-                            break;
-                        }
-                    }
-                    if(prog_aborted())
-                        return std::string();
-                    thread.fetchTracks(&tract_model);
-                    thread.apply_tip(&tract_model);
+                if(export_trk)
+                {
+                    tract_model.report = report;
+                    if(!tract_model.save_tracts_to_file(trk_file_name.c_str()))
+                        return std::string("fail to save tractography file:")+trk_file_name;
+                    std::lock_guard<std::mutex> lock(export_mutex);
+                    if(export_template_trk &&
+                       !tract_model.save_tracts_in_template_space(handle,template_trk_file_name.c_str()))
+                            return std::string("fail to save template tractography file:")+trk_file_name;
+                }
+                break;
+            }
 
-                    if(no_result || tract_model.get_visible_track_count() == 0)
-                    {
-                        tract_model.clear();
-                        continue;
-                    }
+            if(tract_model.get_visible_track_count() == 0)
+            {
+                std::ofstream out(no_result_file_name.c_str());
+                return std::string();
+            }
 
-                    tract_model.delete_repeated(1.0f);
+            if(export_stat &&
+               (overwrite || !std::filesystem::exists(stat_file_name) || !std::filesystem::file_size(stat_file_name)))
+            {
+                std::lock_guard<std::mutex> lock(export_mutex);
+                std::cout << "saving " << stat_file_name << std::endl;
+                std::ofstream out_stat(stat_file_name.c_str());
+                std::string result;
+                tract_model.get_quantitative_info(handle,result);
+                out_stat << result;
+            }
+            return std::string();
+        };
 
-                    if(export_trk)
+        // track several bundles at once; a bundle that finishes hands its threads to the next one in the queue
+        {
+            unsigned int bundle_count = std::min<unsigned int>(uint32_t(pending_bundles.size()),
+                                        std::max<unsigned int>(1,std::thread::hardware_concurrency()/4));
+            unsigned int bundle_thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency()/bundle_count);
+            std::vector<std::string> bundle_error(pending_bundles.size());
+            std::atomic<size_t> next_bundle(0);
+            size_t finished_bundle = 0;
+            std::mutex finished_mutex;
+            std::condition_variable finished_cv;
+            std::vector<std::thread> bundle_threads;
+            for(unsigned int b = 0;b < bundle_count;++b)
+                bundle_threads.push_back(std::thread([&]()
+                {
+                    for(size_t k = next_bundle++;k < pending_bundles.size();k = next_bundle++)
                     {
-                        tract_model.report = report;
-                        if(!tract_model.save_tracts_to_file(trk_file_name.c_str()))
-                            return std::string("fail to save tractography file:")+trk_file_name;
-                        if(export_template_trk &&
-                           !tract_model.save_tracts_in_template_space(handle,template_trk_file_name.c_str()))
-                                return std::string("fail to save template tractography file:")+trk_file_name;
+                        if(!prog_aborted())
+                        {
+                            std::cout << "tracking " << fib.tractography_name_list[track_id[pending_bundles[k]]] << std::endl;
+                            bundle_error[k] = track_bundle(pending_bundles[k],bundle_thread_count);
+                        }
+                        std::lock_guard<std::mutex> lock(finished_mutex);
+                        ++finished_bundle;
+                        finished_cv.notify_all();
                     }
-                    break;
-                }
-
-                if(tract_model.get_visible_track_count() == 0)
-                {
-                    std::ofstream out(no_result_file_name.c_str());
-                    continue;
-                }
-
-                if(export_stat &&
-                   (overwrite || !std::filesystem::exists(stat_file_name) || !std::filesystem::file_size(stat_file_name)))
+                }));
+            {
+                prog_init p("tracking ",cur_file_base_name.c_str());
+                while(true)
                 {
-                    std::cout << "saving " << stat_file_name << std::endl;
-                    std::ofstream out_stat(stat_file_name.c_str());
-                    std::string result;
-                    tract_model.get_quantitative_info(handle,result);
-                    out_stat << result;
+                    size_t finished;
+                    {
+                        std::unique_lock<std::mutex> lock(finished_mutex);
+                        finished_cv.wait_for(lock,std::chrono::milliseconds(500));
+                        finished = finished_bundle;
+                    }
+                    if(finished >= pending_bundles.size())
+                        break;
+                    check_prog(uint32_t(finished),uint32_t(pending_bundles.size()));
                 }
             }
+            for(auto& t : bundle_threads)
+                t.join();
+            if(prog_aborted())
+                return std::string();
+            for(const auto& error : bundle_error)
+                if(!error.empty())
+                    return error;
         }
     }
 
@@ -581,7 +676,7 @@ void auto_track::on_run_clicked()
 
 void auto_track::on_interpolation_currentIndexChanged(int)
 {
-    QMessageBox::information(this,"DSI Studio","You may need to remove existing *.fib.gz and *.mapping.gz files to take effect");
+    QMessageBox::information(this,"DSI Studio","You may need to remove existing *.fib.gz and *.warp.gz files to take effect");
 
 }
 
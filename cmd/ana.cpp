@@ -99,6 +99,8 @@ void get_filenames_from(const std::string param,std::vector<std::string>& filena
 }
 
 int trk_post(std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_model,std::string tract_file_name,bool output_track);
+int trk_post_out_of_core(std::shared_ptr<fib_data> handle,TractFileView& view,std::shared_ptr<RoiMgr> roi_mgr,
+                         std::string tract_file_name,bool output_track);
 std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name);
 
 
@@ -242,6 +244,30 @@ int ana(void)
         return 0;
     }
 
+    // tracts are read in chunks from a memory-mapped or chunked file instead of loaded
+    if(po.get("out_of_core",0))
+    {
+        if(tract_files.size() != 1)
+        {
+            std::cout << "ERROR: out-of-core processing takes one tract file" << std::endl;
+            return 1;
+        }
+        TractFileView view;
+        if(!view.open(tract_files[0].c_str(),handle->vs))
+        {
+            std::cout << "ERROR: " << view.error_msg << std::endl;
+            return 1;
+        }
+        std::cout << tract_files[0] << " opened out of core with " << view.size() << " tracts" << std::endl;
+        std::shared_ptr<RoiMgr> roi_mgr(new RoiMgr(handle));
+        if(!load_roi(handle,roi_mgr))
+            return 1;
+        if(po.has("output") && QFileInfo(output.c_str()).isDir())
+            return trk_post_out_of_core(handle,view,roi_mgr,output + "/" + QFileInfo(tract_files[0].c_str()).baseName().toStdString(),false);
+        if(po.has("output"))
+            return trk_post_out_of_core(handle,view,roi_mgr,output,true);
+        return trk_post_out_of_core(handle,view,roi_mgr,tract_files[0],false);
+    }
 
     if(QString(output.c_str()).endsWith(".trk.gz") ||
        QString(output.c_str()).endsWith(".tt.gz"))
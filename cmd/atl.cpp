@@ -192,25 +192,18 @@ int atl(void)
             // Extracting metrics
             std::cout << "extracting index:" << index_name[i] << std::endl;
             data->handle->db.index_name = index_name[i];
+            std::vector<std::string> subject_names(name_list.size());
             for (unsigned int index = 0;index < name_list.size();++index)
-            {
-                std::cout << "reading " << name_list[index] << std::endl;
-                if(!data->handle->db.add_subject_file(name_list[index],
-                    QFileInfo(name_list[index].c_str()).baseName().toStdString()))
-                {
-                    std::cout << "ERROR loading subject fib files:" << data->handle->error_msg << std::endl;
-                    return 1;
-                }
-            }
+                subject_names[index] = QFileInfo(name_list[index].c_str()).baseName().toStdString();
             // Output
             std::string output = dir;
             output += "/";
             output += "connectometry.";
             output += index_name[i];
             output += ".db.fib.gz";
-            if(!data->handle->db.save_subject_data(output.c_str()))
+            if(!data->handle->db.add_subject_files(name_list,subject_names,output.c_str()))
             {
-                std::cout << "ERROR saving the db file:" << data->handle->error_msg << std::endl;
+                std::cout << "ERROR creating the db file:" << data->handle->error_msg << std::endl;
                 return 1;
             }
             std::cout << "connectometry db created:" << output << std::endl;
@@ -14,9 +14,11 @@
 std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name);
 bool trk2tt(const char* trk_file,const char* tt_file);
 bool tt2trk(const char* tt_file,const char* trk_file);
+bool tt2tt(const char* tt_file,const char* new_tt_file);
 int exp(void)
 {
     std::string file_name = po.get("source");
+    TractModel::save_chunked_tt = po.get("chunked_tt",0);
     if(QString(file_name.c_str()).endsWith(".trk.gz"))
     {
         std::string output_name = po.get("output");
@@ -52,6 +54,19 @@ int exp(void)
                 return 1;
             }
         }
+        if(QString(output_name.c_str()).endsWith(".tt.gz"))
+        {
+            if(tt2tt(file_name.c_str(),output_name.c_str()))
+            {
+                std::cout << "file converted." << std::endl;
+                return 0;
+            }
+            else
+            {
+                std::cout << "Cannot write to file:" << output_name << std::endl;
+                return 1;
+            }
+        }
         std::cout << "unsupported file format" << std::endl;
         return 1;
     }
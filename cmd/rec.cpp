@@ -21,6 +21,7 @@ bool is_dsi_half_sphere(const std::vector<unsigned int>& shell);
 bool is_dsi(const std::vector<unsigned int>& shell);
 bool need_scheme_balance(const std::vector<unsigned int>& shell);
 bool get_src(std::string filename,ImageModel& src2,std::string& error_msg);
+// used by auto_track; rec runs the correction as a cached step instead
 bool correct_phase_distortion(ImageModel& src)
 {
     if(po.has("other_src"))
@@ -48,18 +49,29 @@ int rec(void)
         return 1;
     }
     std::cout << "src loaded" <<std::endl;
-    if(!correct_phase_distortion(src))
-        return 1;
-    if (po.has("cmd"))
     {
-        QStringList cmd_list = QString(po.get("cmd").c_str()).split("+");
-        for(int i = 0;i < cmd_list.size();++i)
+        std::vector<std::string> step_list;
+        if(po.has("other_src"))
         {
-            QStringList run_list = QString(cmd_list[i]).split("=");
-            std::cout << "run " << cmd_list[i].toStdString() << std::endl;
-            if(!src.command(run_list[0].toStdString(),
-                                run_list.count() > 1 ? run_list[1].toStdString():std::string()))
-                return 1;
+            std::cout << "phase correction with " << po.get("other_src") << std::endl;
+            step_list.push_back(std::string("[Step T2][Edit][Correct Phase Distortion]=") + po.get("other_src"));
+        }
+        if (po.has("cmd"))
+        {
+            QStringList cmd_list = QString(po.get("cmd").c_str()).split("+");
+            for(int i = 0;i < cmd_list.size();++i)
+            {
+                std::cout << "run " << cmd_list[i].toStdString() << std::endl;
+                step_list.push_back(cmd_list[i].toStdString());
+            }
+        }
+        // with --step_cache=<dir>, repeated reconstructions of the same SRC reuse the preprocessed DWI
+        if(po.has("step_cache"))
+            src.step_cache_dir = po.get("step_cache");
+        if(!src.run_steps(step_list))
+        {
+            std::cout << "ERROR:" << src.error_msg << std::endl;
+            return 1;
         }
     }
 
@@ -10,6 +10,8 @@ QStringList search_files(QString dir,QString filter);
 bool load_bval(const char* file_name,std::vector<double>& bval);
 bool load_bvec(const char* file_name,std::vector<double>& b_table);
 bool parse_dwi(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec,
+                 tipl::geometry<3>& geo,std::function<bool(unsigned int,tipl::image<unsigned short,3>&)>& read_volume);
 int src(void)
 {
     std::string source = po.get("source");
@@ -50,6 +52,19 @@ int src(void)
         return 1;
     }
 
+    // a single 4D NIFTI file is streamed volume by volume into the SRC file
+    // unless the b-table needs to be sorted, which requires all volumes in memory.
+    tipl::geometry<3> geo;
+    std::function<bool(unsigned int,tipl::image<unsigned short,3>&)> read_volume;
+    if(file_list.size() == 1 && (ext == ".nii" || ext == "i.gz") && !po.get<int>("sort_b_table",0))
+    {
+        if(!load_4d_nii(source.c_str(),dwi_files,false,geo,read_volume))
+        {
+            std::cout << "ERROR loading dwi file:" << src_error_msg << std::endl;
+            return 1;
+        }
+    }
+    else
     if(!parse_dwi(file_list,dwi_files))
     {
         std::cout << "ERROR loading dwi file:" << src_error_msg << std::endl;
@@ -151,7 +166,10 @@ int src(void)
             output = file_list.front().toStdString() + ".src.gz";
     }
     std::cout << "output src to " << output << std::endl;
-    if(!DwiHeader::output_src(output.c_str(),dwi_files,
+    if(read_volume ?
+       !DwiHeader::output_src(output.c_str(),dwi_files,geo,
+                          po.get<int>("up_sampling",0),read_volume) :
+       !DwiHeader::output_src(output.c_str(),dwi_files,
                           po.get<int>("up_sampling",0),
                           po.get<int>("sort_b_table",0)))
     {
@@ -82,6 +82,38 @@ bool get_t1t2_nifti(std::shared_ptr<fib_data> handle,
     std::cout << "T1T2 voxel size: " << nifti_vs << std::endl;
     return true;
 }
+// output space of --export=tdi, tdi2, tdi3, tdi4 (upsampled) or the --t1t2 image
+void get_tdi_space(std::shared_ptr<fib_data> handle,const std::string& cmd,
+                   tipl::geometry<3>& dim,tipl::vector<3,float>& vs,tipl::matrix<4,4,float>& tr)
+{
+    tr.identity();
+    dim = handle->dim;
+    vs = handle->vs;
+
+    // t1t2
+    if(!get_t1t2_nifti(handle,dim,vs,tr))
+    {
+        unsigned int ratio = 1;
+        if(QString(cmd.c_str()).startsWith("tdi2"))
+            ratio = 2;
+        if(QString(cmd.c_str()).startsWith("tdi3"))
+            ratio = 3;
+        if(QString(cmd.c_str()).startsWith("tdi4"))
+            ratio = 4;
+
+        if(ratio != 1)
+        {
+            tr[0] = tr[5] = tr[10] = ratio;
+            dim = tipl::geometry<3>(handle->dim[0]*ratio,
+                                    handle->dim[1]*ratio,
+                                    handle->dim[2]*ratio);
+            vs /= float(ratio);
+            std::cout << "Output TDI with dimension scaled by " << ratio << std::endl;
+            std::cout << "dimension: " << dim << std::endl;
+            std::cout << "voxel size: " << vs << std::endl;
+        }
+    }
+}
 void export_track_info(std::shared_ptr<fib_data> handle,
                        std::string file_name,
                        std::shared_ptr<TractModel> tract_model)
@@ -162,33 +194,7 @@ void export_track_info(std::shared_ptr<fib_data> handle,
             tipl::matrix<4,4,float> tr;
             tipl::geometry<3> dim;
             tipl::vector<3,float> vs;
-            tr.identity();
-            dim = handle->dim;
-            vs = handle->vs;
-
-            // t1t2
-            if(!get_t1t2_nifti(handle,dim,vs,tr))
-            {
-                unsigned int ratio = 1;
-                if(QString(cmd.c_str()).startsWith("tdi2"))
-                    ratio = 2;
-                if(QString(cmd.c_str()).startsWith("tdi3"))
-                    ratio = 3;
-                if(QString(cmd.c_str()).startsWith("tdi4"))
-                    ratio = 4;
-
-                if(ratio != 1)
-                {
-                    tr[0] = tr[5] = tr[10] = ratio;
-                    dim = tipl::geometry<3>(handle->dim[0]*ratio,
-                                            handle->dim[1]*ratio,
-                                            handle->dim[2]*ratio);
-                    vs /= float(ratio);
-                    std::cout << "Output TDI with dimension scaled by " << ratio << std::endl;
-                    std::cout << "dimension: " << dim << std::endl;
-                    std::cout << "voxel size: " << vs << std::endl;
-                }
-            }
+            get_tdi_space(handle,cmd,dim,vs,tr);
             std::vector<std::shared_ptr<TractModel> > tract;
             tract.push_back(tract_model);
             std::cout << "export TDI to " << file_name_stat;
@@ -258,18 +264,39 @@ bool load_nii(std::shared_ptr<fib_data> handle,
               std::vector<std::shared_ptr<ROIRegion> >& regions,
               std::vector<std::string>& names);
 
+void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
+                             std::string output_name,
+                             std::function<TractModel*(void)> next_chunk,
+                             TractModel* all_tracts = nullptr);
 void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
                              std::string output_name,
                              std::shared_ptr<TractModel> tract_model)
+{
+    bool fetched = false;
+    get_connectivity_matrix(handle,output_name,[&](void)->TractModel*
+    {
+        if(fetched)
+            return nullptr;
+        fetched = true;
+        return tract_model.get();
+    },tract_model.get());
+}
+// tracts are supplied by next_chunk, which returns nullptr after the last chunk.
+// all_tracts is needed only by the per-pair track export (--connectivity_value=trk)
+void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
+                             std::string output_name,
+                             std::function<TractModel*(void)> next_chunk,
+                             TractModel* all_tracts)
 {
     QStringList connectivity_list = QString(po.get("connectivity").c_str()).split(",");
     QStringList connectivity_type_list = QString(po.get("connectivity_type","end").c_str()).split(",");
     QStringList connectivity_value_list = QString(po.get("connectivity_value","count").c_str()).split(",");
+    std::vector<std::shared_ptr<ConnectivityMatrix> > matrices;
     for(int i = 0;i < connectivity_list.size();++i)
     {
         std::string roi_file_name = connectivity_list[i].toStdString();
         std::cout << "loading " << roi_file_name << std::endl;
-        ConnectivityMatrix data;
+        auto data = std::make_shared<ConnectivityMatrix>();
 
         // specify atlas name (e.g. --connectivity=AAL2)
         if(!QString(roi_file_name.c_str()).contains("."))
@@ -277,7 +304,7 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
             std::vector<std::shared_ptr<atlas> > atlas_list;
             if(!load_atlas_from_list(handle,roi_file_name,atlas_list))
                 return;
-            data.set_atlas(atlas_list[0],handle->get_mni_mapping());
+            data->set_atlas(atlas_list[0],handle);
         }
         else
         // specify atlas file (e.g. --connectivity=subject_file.nii.gz)
@@ -310,10 +337,10 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
                         return;
                     }
                     regions.push_back(region);
-                    data.region_name.push_back(QFileInfo(line.c_str()).baseName().toStdString());
+                    data->region_name.push_back(QFileInfo(line.c_str()).baseName().toStdString());
                 }
-                data.set_regions(handle->dim,regions);
-                std::cout << "a total of " << data.region_count << " regions are loaded." << std::endl;
+                data->set_regions(handle->dim,regions);
+                std::cout << "a total of " << data->region_count << " regions are loaded." << std::endl;
             }
             else
             {
@@ -322,32 +349,80 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
                 std::vector<std::string> names;
                 if(!load_nii(handle,roi_file_name,regions,names))
                     return;
-                data.region_name = names;
-                data.set_regions(handle->dim,regions);
+                data->region_name = names;
+                data->set_regions(handle->dim,regions);
             }
         }
+        matrices.push_back(data);
+    }
+
+    float t = po.get("connectivity_threshold",0.001f);
+    bool use_end = false,use_pass = false;
+    for(int j = 0;j < connectivity_type_list.size();++j)
+        if(connectivity_type_list[j].toLower() == QString("end"))
+            use_end = true;
+        else
+            use_pass = true;
+    std::vector<std::string> value_types;
+    bool export_trk = false;
+    for(int k = 0;k < connectivity_value_list.size();++k)
+        if(connectivity_value_list[k] == "trk")
+            export_trk = true;
+        else
+            value_types.push_back(connectivity_value_list[k].toStdString());
 
-        float t = po.get("connectivity_threshold",0.001f);
+    // tracks are exported per region pair in addition to the matrices
+    if(export_trk)
+    {
+        if(!all_tracts)
+            std::cout << "exporting tracks between each region pair requires tracts in memory. skipped." << std::endl;
+        else
+        for(size_t i = 0;i < matrices.size();++i)
+            for(int j = 0;j < connectivity_type_list.size();++j)
+            {
+                bool use_end_only = connectivity_type_list[j].toLower() == QString("end");
+                std::string connectivity_roi = connectivity_list[int(i)].toStdString();
+                // name the files like the matrices so that region sets and end/pass do not overwrite each other
+                std::string trk_file_prefix(output_name);
+                trk_file_prefix += ".";
+                trk_file_prefix += (std::filesystem::exists(connectivity_roi)) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
+                trk_file_prefix += use_end_only ? ".end.":".pass.";
+                std::cout << "export tracks " << (use_end_only ? "ending":"passing") << " between each region pair of "
+                          << connectivity_roi << " to " << trk_file_prefix << "*.tt.gz" << std::endl;
+                if(!matrices[i]->calculate(handle,*all_tracts,"trk",use_end_only,t,trk_file_prefix))
+                {
+                    std::cout << "connectivity calculation error:" << matrices[i]->error_msg << std::endl;
+                    return;
+                }
+            }
+        if(value_types.empty())
+            return;
+    }
+
+    std::cout << "calculate connectivity matrices of " << matrices.size() << " region set(s) in one pass" << std::endl;
+    std::string error_msg;
+    if(!ConnectivityMatrix::calculate_all(handle,next_chunk,matrices,value_types,use_end,use_pass,t,error_msg))
+    {
+        std::cout << "connectivity calculation error:" << error_msg << std::endl;
+        return;
+    }
+
+    for(size_t i = 0;i < matrices.size();++i)
+    {
+        auto& data = *matrices[i];
+        std::string connectivity_roi = connectivity_list[int(i)].toStdString();
+        if(data.overlap_ratio > 0.5f)
+        {
+            std::cout << "the ROIs have a large overlapping area (ratio: "
+                      << data.overlap_ratio << "). The network measure calculated may not be reliable" << std::endl;
+        }
         for(int j = 0;j < connectivity_type_list.size();++j)
-        for(int k = 0;k < connectivity_value_list.size();++k)
+        for(size_t k = 0;k < value_types.size();++k)
         {
-            std::string connectivity_roi = roi_file_name;
-            std::string connectivity_value = connectivity_value_list[k].toStdString();
+            std::string connectivity_value = value_types[k];
             bool use_end_only = connectivity_type_list[j].toLower() == QString("end");
-            std::cout << "count tracks by " << (use_end_only ? "ending":"passing") << std::endl;
-            std::cout << "calculate matrix using " << connectivity_value << std::endl;
-            if(!data.calculate(handle,*(tract_model.get()),connectivity_value,use_end_only,t))
-            {
-                std::cout << "connectivity calculation error:" << data.error_msg << std::endl;
-                return;
-            }
-            if(data.overlap_ratio > 0.5f)
-            {
-                std::cout << "the ROIs have a large overlapping area (ratio: "
-                          << data.overlap_ratio << "). The network measure calculated may not be reliable" << std::endl;
-            }
-            if(connectivity_value == "trk")
-                return;
+            if(!data.set_matrix_value(connectivity_value,use_end_only))
+                continue;
             std::string file_name_stat(output_name);
             file_name_stat += ".";
             file_name_stat += (std::filesystem::exists(connectivity_roi)) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
@@ -423,18 +498,16 @@ bool load_region(std::shared_ptr<fib_data> handle,
             std::cout << "ERROR: please assign region name of an atlas." << std::endl;
             return false;
         }
-        const tipl::image<tipl::vector<3,float>,3 >& mapping = handle->get_mni_mapping();
         std::cout << "loading " << region_name << " from " << file_name << " atlas" << std::endl;
-        tipl::vector<3> null;
         std::vector<tipl::vector<3,short> > cur_region;
         for(unsigned int i = 0;i < handle->atlas_list.size();++i)
             if(handle->atlas_list[i]->name == file_name)
                 for (unsigned int label_index = 0; label_index < handle->atlas_list[i]->get_list().size(); ++label_index)
                     if(handle->atlas_list[i]->get_list()[label_index] == region_name)
                 {
-                    for (tipl::pixel_index<3>index(mapping.geometry());index < mapping.size();++index)
-                        if(mapping[index.index()] != null && handle->atlas_list[i]->is_labeled_as(mapping[index.index()],label_index))
-                            cur_region.push_back(tipl::vector<3,short>(index.begin()));
+                    std::vector<tipl::vector<3,short> > points;
+                    handle->get_atlas_roi(handle->atlas_list[i],label_index,points);
+                    cur_region.insert(cur_region.end(),points.begin(),points.end());
                 }
         roi.add_points(cur_region,false);
     }
@@ -515,7 +588,7 @@ int trk_post(std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_
         in >> method >> count >> detail >> name;
         std::cout << "cluster method: " << method << std::endl;
         std::cout << "cluster count: " << count << std::endl;
-        std::cout << "cluster resolution (if method is 0) : " << detail << " mm" << std::endl;
+        std::cout << "cluster resolution (if method is 0 or 3) : " << detail << std::endl;
         std::cout << "run clustering." << std::endl;
         tract_model->run_clustering(uint8_t(method),uint32_t(count),detail);
         std::ofstream out(tract_file_name + "." + name);
@@ -538,6 +611,147 @@ int trk_post(std::shared_ptr<fib_data> handle,std::shared_ptr<TractModel> tract_
     return 0;
 }
 
+void get_density_map(const std::vector<const std::vector<float>*>& tracts,
+                     tipl::image<unsigned int,3>& mapping,
+                     const tipl::matrix<4,4,float>& transformation,bool endpoint);
+void get_direction_map(const std::vector<const std::vector<float>*>& tracts,
+                       const std::vector<float>& weights,
+                       std::vector<tipl::vector<3> >& map_rgb,
+                       const tipl::geometry<3>& geo,
+                       const tipl::matrix<4,4,float>& transformation,bool endpoint);
+void direction_map_to_rgb(const std::vector<tipl::vector<3> >& map_rgb,tipl::image<tipl::rgb,3>& mapping);
+
+// trk_post for tracts that do not fit in memory: the tracts in view are read in chunks,
+// filtered by roi_mgr, and then written, mapped to TDI, and added to connectivity in one pass
+int trk_post_out_of_core(std::shared_ptr<fib_data> handle,TractFileView& view,std::shared_ptr<RoiMgr> roi_mgr,
+                         std::string tract_file_name,bool output_track)
+{
+    const char* in_memory_options[] = {"ref","cluster","end_point"};
+    for(auto option : in_memory_options)
+        if(po.has(option))
+            std::cout << "--" << option << " needs all tracts in memory and is ignored" << std::endl;
+
+    TractStreamWriter writer;
+    if(output_track && !writer.open(tract_file_name,handle->dim,handle->vs,view.report,view.parameter_id))
+    {
+        std::cout << "ERROR: cannot save tracks as " << tract_file_name
+                  << ". Out-of-core output supports .tt.gz, .trk, .trk.gz, and .tck files." << std::endl;
+        return 1;
+    }
+
+    // allow adding other slices for connectivity and statistics
+    if(!check_other_slices(handle))
+        return 1;
+
+    struct tdi_output{
+        std::string file_name;
+        tipl::geometry<3> dim;
+        tipl::vector<3,float> vs;
+        tipl::matrix<4,4,float> tr;
+        bool color = false,end = false;
+        tipl::image<unsigned int,3> count;
+        std::vector<tipl::vector<3> > dir;
+    };
+    std::vector<tdi_output> tdi;
+    if(po.has("export"))
+    {
+        std::istringstream in(po.get("export"));
+        std::string cmd;
+        while(std::getline(in,cmd,','))
+        {
+            if(!QString(cmd.c_str()).startsWith("tdi"))
+            {
+                std::cout << "--export=" << cmd << " needs all tracts in memory and is ignored" << std::endl;
+                continue;
+            }
+            tdi_output out;
+            out.file_name = tract_file_name + "." + cmd + ".nii.gz";
+            out.color = QString(cmd.c_str()).endsWith("color");
+            out.end = QString(cmd.c_str()).endsWith("end");
+            get_tdi_space(handle,cmd,out.dim,out.vs,out.tr);
+            if(!out.color)
+                out.count.resize(out.dim);
+            tdi.push_back(std::move(out));
+        }
+    }
+
+    size_t chunk_size = size_t(std::max<int>(1,po.get("chunk_size",100000)));
+    size_t from = 0,kept = 0;
+    bool failed = false;
+    std::shared_ptr<TractModel> chunk_model;
+    prog_init p("processing ",std::filesystem::path(tract_file_name).filename().string().c_str());
+    auto next_chunk = [&](void)->TractModel*
+    {
+        if(failed || from >= view.size() || !check_prog(from,view.size()))
+            return nullptr;
+        std::vector<std::vector<float> > tracts;
+        if(!view.read(from,chunk_size,tracts))
+        {
+            std::cout << "ERROR: cannot read tracts from " << from << std::endl;
+            failed = true;
+            return nullptr;
+        }
+        from += chunk_size;
+        chunk_model = std::make_shared<TractModel>(handle);
+        chunk_model->add_tracts(tracts);
+        chunk_model->filter_by_roi(roi_mgr);
+        kept += chunk_model->get_visible_track_count();
+
+        std::vector<const std::vector<float>*> tract_ptr;
+        for(const auto& t : chunk_model->get_tracts())
+            tract_ptr.push_back(&t);
+        for(auto& each : tdi)
+            if(each.color)
+                get_direction_map(tract_ptr,std::vector<float>(),each.dir,each.dim,each.tr,each.end);
+            else
+                get_density_map(tract_ptr,each.count,each.tr,each.end);
+        if(output_track)
+        {
+            auto output_tracts = chunk_model->get_tracts();
+            writer.push(output_tracts);
+        }
+        return chunk_model.get();
+    };
+
+    if(po.has("connectivity"))
+    {
+        if(QString(po.get("connectivity_value","count").c_str()).split(",").contains("trk"))
+            std::cout << "--connectivity_value=trk needs all tracts in memory and is ignored" << std::endl;
+        else
+            get_connectivity_matrix(handle,tract_file_name,next_chunk);
+    }
+    // process the remaining chunks, or all of them without connectivity
+    while(next_chunk())
+        ;
+    if(failed || prog_aborted())
+        return 1;
+    std::cout << kept << " of " << view.size() << " tracts are selected." << std::endl;
+
+    if(output_track && !writer.close())
+    {
+        std::cout << "ERROR: failed writing " << tract_file_name << std::endl;
+        return 1;
+    }
+    for(auto& each : tdi)
+    {
+        std::cout << "export TDI to " << each.file_name << std::endl;
+        bool result = false;
+        tipl::matrix<4,4,float> trans(handle->trans_to_mni*each.tr);
+        if(each.color)
+        {
+            tipl::image<tipl::rgb,3> I(each.dim);
+            if(each.dir.size() == I.size())
+                direction_map_to_rgb(each.dir,I);
+            result = gz_nifti::save_to_file(each.file_name.c_str(),I,each.vs,trans);
+        }
+        else
+            result = gz_nifti::save_to_file(each.file_name.c_str(),each.count,each.vs,trans);
+        if(!result)
+            std::cout << "ERROR: failed to save file. Please check write permission." << std::endl;
+    }
+    return 0;
+}
+
 bool load_roi(std::shared_ptr<fib_data> handle,std::shared_ptr<RoiMgr> roi_mgr)
 {
     const int total_count = 18;
@@ -561,7 +775,7 @@ bool load_roi(std::shared_ptr<fib_data> handle,std::shared_ptr<RoiMgr> roi_mgr)
             }
             region_name += roi_list[0].toStdString();
         }
-        roi_mgr->setRegions(roi.get_region_voxels_raw(),roi.resolution_ratio,type[index],region_name.c_str());
+        roi_mgr->setRegions(roi,type[index],region_name.c_str());
     }
     if(po.has("track_id"))
     {
@@ -594,6 +808,47 @@ bool load_roi(std::shared_ptr<fib_data> handle,std::shared_ptr<RoiMgr> roi_mgr)
     return true;
 }
 
+// tracks again with uniform seeding and compares it with the adaptive run in tract_model:
+// yield and speed of both, and how well the adaptive density matches the uniform one
+// with and without the importance weights
+std::string compare_seed_plan(ThreadData& tracking_thread,std::shared_ptr<TractModel> tract_model,unsigned int thread_count)
+{
+    double adaptive_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-tracking_thread.start_time).count();
+    unsigned int adaptive_seed_count = tracking_thread.get_total_seed_count();
+    auto uniform_model = std::make_shared<TractModel>(tract_model->geo,tract_model->vs,tract_model->trans_to_mni);
+    std::cout << "tracking again with uniform seeding for comparison" << std::endl;
+    tracking_thread.param.center_seed = 0;
+    tracking_thread.run(thread_count,true);
+    tracking_thread.fetchTracks(uniform_model.get());
+    tracking_thread.param.center_seed = 2;
+    double uniform_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-tracking_thread.start_time).count();
+    unsigned int uniform_seed_count = tracking_thread.get_total_seed_count();
+
+    tipl::matrix<4,4,float> tr;
+    tr.identity();
+    tipl::image<float,3> uniform_density(tract_model->geo),weighted_density(tract_model->geo);
+    tipl::image<unsigned int,3> unweighted_count(tract_model->geo);
+    TractModel::get_density_map({uniform_model},uniform_density,tr,false);
+    TractModel::get_density_map({tract_model},weighted_density,tr,false);
+    TractModel::get_density_map({tract_model},unweighted_count,tr,false);
+    tipl::image<float,3> unweighted_density(unweighted_count);
+
+    std::ostringstream out;
+    auto output = [&](const char* name,size_t tract_count,unsigned int seed_count,double seconds)
+    {
+        out << name << " seeding: seeds: " << seed_count << " tracts: " << tract_count
+            << " yield: " << (seed_count ? double(tract_count)/double(seed_count) : 0.0)
+            << " tracts per second: " << (seconds > 0.0 ? double(tract_count)/seconds : 0.0) << std::endl;
+    };
+    output("uniform",uniform_model->get_visible_track_count(),uniform_seed_count,uniform_seconds);
+    output("adaptive",tract_model->get_visible_track_count(),adaptive_seed_count,adaptive_seconds);
+    out << "density correlation with uniform seeding: weighted: "
+        << tipl::correlation(weighted_density.begin(),weighted_density.end(),uniform_density.begin())
+        << " unweighted: "
+        << tipl::correlation(unweighted_density.begin(),unweighted_density.end(),uniform_density.begin()) << std::endl;
+    return out.str();
+}
+
 int trk(std::shared_ptr<fib_data> handle);
 int trk(void)
 {
@@ -766,17 +1021,114 @@ int trk(std::shared_ptr<fib_data> handle)
     }
 
 
+    tracking_thread.min_yield_seed_count = po.get("min_yield_seed_count",uint32_t(0));
+    tracking_thread.min_yield = po.get("min_yield",0.0f);
+    tracking_thread.seed_reweight = po.get("seed_reweight",0.0f);
+    TractModel::save_chunked_tt = po.get("chunked_tt",0);
+
+    std::string tract_file_name = po.get("source")+".tt.gz";
+    bool output_track = true;
+    if (po.has("output"))
+    {
+        std::string output = po.get("output");
+        if(output == "no_file")
+            output_track = false;
+        else
+        if(QFileInfo(output.c_str()).isDir())
+            tract_file_name = output+"/"+QFileInfo(po.get("source").c_str()).baseName().toStdString() + ".tt.gz";
+        else
+            tract_file_name = output;
+    }
+
+    // write tracts to file while tracking, if nothing afterward needs them in memory
+    if(po.get("stream",0) && output_track && TractStreamWriter::supported(tract_file_name))
+    {
+        const char* in_memory_options[] = {"refine","delete_repeat","trim","ref","cluster","end_point","connectivity","export"};
+        bool need_tracts = tracking_thread.param.tip_iteration;
+        for(auto option : in_memory_options)
+            if(po.has(option))
+                need_tracts = true;
+        if(need_tracts)
+            std::cout << "--stream is ignored because the requested post-processing needs all tracts in memory" << std::endl;
+        else
+        if(tracking_thread.param.center_seed == 2)
+        {
+            need_tracts = true;
+            std::cout << "--stream is ignored because adaptive seeding keeps the tract weights in memory" << std::endl;
+        }
+        else
+        {
+            std::mutex finished_mutex;
+            std::condition_variable finished_cv;
+            tracking_thread.on_finished = [&]()
+            {
+                std::lock_guard<std::mutex> lock(finished_mutex);
+                finished_cv.notify_all();
+            };
+            tracking_thread.max_track_buffer = 65536;
+            std::cout << "start tracking." << std::endl;
+            tracking_thread.run(uint32_t(po.get("thread_count",int(std::thread::hardware_concurrency()))),false);
+            tract_model->report += tracking_thread.report.str();
+            TractStreamWriter writer;
+            if(!writer.open(tract_file_name,handle->dim,handle->vs,tract_model->report,tracking_thread.param.get_code()))
+            {
+                std::cout << "ERROR: cannot save tracks as " << tract_file_name
+                          << ". Please check write permission, directory, and disk space." << std::endl;
+                return 1;
+            }
+            std::cout << "streaming tracks to " << tract_file_name << std::endl;
+            while(true)
+            {
+                bool ended = tracking_thread.is_ended();
+                std::vector<std::vector<float> > tracts;
+                if(tracking_thread.fetchTracks(tracts))
+                    writer.push(tracts);
+                if(ended)
+                    break;
+                std::unique_lock<std::mutex> lock(finished_mutex);
+                finished_cv.wait_for(lock,std::chrono::milliseconds(100),[&](){return tracking_thread.is_ended();});
+            }
+            tracking_thread.end_thread();
+            if(!writer.close())
+            {
+                std::cout << "ERROR: failed writing " << tract_file_name << std::endl;
+                return 1;
+            }
+            std::cout << "finished tracking." << std::endl;
+            std::cout << tracking_thread.get_yield_report(po.get("verbose",0));
+            std::cout << writer.get_count() << " tracts are generated using " << tracking_thread.get_total_seed_count() << " seeds."<< std::endl;
+            if(po.has("report"))
+            {
+                std::ofstream out(po.get("report").c_str());
+                out << tract_model->report << std::endl;
+                out << tracking_thread.get_yield_report(true);
+            }
+            return 0;
+        }
+    }
+
     std::cout << "start tracking." << std::endl;
     tracking_thread.run(uint32_t(po.get("thread_count",int(std::thread::hardware_concurrency()))),true);
     tract_model->report += tracking_thread.report.str();
 
     tracking_thread.fetchTracks(tract_model.get());
     std::cout << "finished tracking." << std::endl;
+    std::cout << tracking_thread.get_yield_report(po.get("verbose",0));
+    std::string yield_report = tracking_thread.get_yield_report(true);
+
+    std::string seed_plan_comparison;
+    if(tracking_thread.param.center_seed == 2 && po.get("compare_seed_plan",0))
+    {
+        seed_plan_comparison = compare_seed_plan(tracking_thread,tract_model,
+                                                 uint32_t(po.get("thread_count",int(std::thread::hardware_concurrency()))));
+        std::cout << seed_plan_comparison;
+    }
 
     if(po.has("report"))
     {
         std::ofstream out(po.get("report").c_str());
-        out << tract_model->report;
+        out << tract_model->report << std::endl;
+        out << yield_report << seed_plan_comparison;
     }
 
     if(tract_model->get_visible_track_count() && po.has("refine") && (po.get("refine",1) >= 1))
@@ -831,19 +1183,5 @@ int trk(std::shared_ptr<fib_data> handle)
             tract_model->trim();
     }
 
-    std::string tract_file_name = po.get("source")+".tt.gz";
-    bool output_track = true;
-    if (po.has("output"))
-    {
-        std::string output = po.get("output");
-        if(output == "no_file")
-            output_track = false;
-        else
-        if(QFileInfo(output.c_str()).isDir())
-            tract_file_name = output+"/"+QFileInfo(po.get("source").c_str()).baseName().toStdString() + ".tt.gz";
-        else
-            tract_file_name = output;
-    }
-
     return trk_post(handle,tract_model,tract_file_name,output_track);
 }
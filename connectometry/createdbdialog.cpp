@@ -280,22 +280,21 @@ void CreateDBDialog::on_create_data_base_clicked()
 
         data->handle->db.index_name = ui->index_of_interest->currentText().toStdString();
 
+        std::vector<std::string> file_names(group.count()),subject_names(group.count());
         for (unsigned int index = 0;index < group.count();++index)
         {
-            prog_init p(QFileInfo(group[index]).baseName().toStdString().c_str());
-            if(!data->handle->db.add_subject_file(group[index].toStdString(),get_file_name(group[index]).toStdString()))
-            {
+            file_names[index] = group[index].toStdString();
+            subject_names[index] = get_file_name(group[index]).toStdString();
+        }
+        begin_prog("loading subject fib files");
+        if(!data->handle->db.add_subject_files(file_names,subject_names,
+                                               ui->output_file_name->text().toStdString().c_str()))
+        {
+            if(!prog_aborted())
                 QMessageBox::information(this,"error in loading subject fib files",data->handle->error_msg.c_str(),0);
-                raise(); // for Mac
-                return;
-            }
-            if(prog_aborted())
-            {
-                raise(); // for Mac
-                return;
-            }
+            raise(); // for Mac
+            return;
         }
-        data->handle->db.save_subject_data(ui->output_file_name->text().toStdString().c_str());
         QMessageBox::information(this,"completed","Connectometry database created",0);
     }
     else
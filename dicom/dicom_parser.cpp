@@ -2,6 +2,15 @@
 #include <QProgressDialog>
 #include <QFileDialog>
 #include <QSettings>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QTemporaryFile>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <set>
 #include "dicom_parser.h"
 #include "ui_dicom_parser.h"
 #include "tipl/tipl.hpp"
@@ -286,69 +295,32 @@ bool find_bval_bvec(const char* file_name,QString& bval,QString& bvec)
     return QFileInfo(bval).exists() && QFileInfo(bvec).exists();
 }
 
-bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec)
+// if the imaging value is larger than 16-bit integer, then scale it.
+static float get_dwi_scale(float max_value)
 {
-    tipl::vector<3,float> vs;
-    std::vector<tipl::image<float,3> > dwi_data;
+    float scale = 1.0f;
+    if(max_value > float(std::numeric_limits<unsigned short>::max()-1))
+        scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
+    if(max_value < 256.0f)
     {
-        gz_nifti nii;
-        nii.input_stream->buffer_all = true;
-        if(!nii.load_from_file(file_name))
-        {
-            src_error_msg = nii.error;
-            return false;
-        }
-        if(nii.dim(4) <= 1)
-        {
-            src_error_msg = "not a 4D nifti file";
-            return false;
-        }
-        dwi_data.resize(nii.dim(4));
-        nii.get_voxel_size(vs);
-        // check data range
-        for(unsigned int index = 0;index < nii.dim(4);++index)
-        {
-            tipl::image<float,3> data;
-            if(!nii.toLPS(data,false))
-                break;
-            std::replace_if(data.begin(),data.end(),[](float v){return std::isnan(v) || std::isinf(v) || v < 0.0f;},0.0f);
-            dwi_data[index].swap(data);
-        }
-        if(prog_aborted())
-        {
-            src_error_msg = "Aborted by user.";
-            return false;
-        }
+        std::cout << "The maximum singal is only " << max_value << std::endl;
+        while(max_value*scale < std::numeric_limits<unsigned short>::max())
+            scale*=32;
+        if(scale != 1.0f)
+            std::cout << "scaling the image by " << scale << std::endl;
     }
+    return scale;
+}
 
+static void clean_dwi_volume(tipl::image<float,3>& data)
+{
+    std::replace_if(data.begin(),data.end(),[](float v){return std::isnan(v) || std::isinf(v) || v < 0.0f;},0.0f);
+}
 
-    // if the imaging value is larger than 16-bit integer, then scale it.
-    {
-        float max_value = 0.0f;
-        for(unsigned int index = 0;index < dwi_data.size();++index)
-            max_value = std::max<float>(max_value,*std::max_element(dwi_data[index].begin(),dwi_data[index].end()));
-        if(max_value > float(std::numeric_limits<unsigned short>::max()-1))
-        {
-            float scale = float(std::numeric_limits<unsigned short>::max()-1)/max_value;
-            tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                tipl::multiply_constant(dwi_data[index],scale);
-            });
-        }
-        if(max_value < 256.0f)
-        {
-            std::cout << "The maximum singal is only " << max_value << std::endl;
-            float scale = 1.0f;
-            while(max_value*scale < std::numeric_limits<unsigned short>::max())
-                scale*=32;
-            if(scale != 1.0f)
-            {
-                std::cout << "scaling the image by " << scale << std::endl;
-                tipl::par_for(dwi_data.size(),[&](unsigned int index){
-                    tipl::multiply_constant(dwi_data[index],scale);
-                });
-            }
-        }
-    }
+// create one DwiHeader per volume with b-table, grad_dev and mask but without image data
+static bool load_4d_nii_info(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec,
+                             unsigned int dwi_count,const tipl::vector<3,float>& vs)
+{
     tipl::image<float,4> grad_dev;
     if(QFileInfo(QFileInfo(file_name).absolutePath() + "/grad_dev.nii.gz").exists())
     {
@@ -388,10 +360,10 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
                 src_error_msg += bvec_name.toStdString();
                 return false;
             }
-            if(!bval_name.isEmpty() && dwi_data.size() != bvals.size())
+            if(!bval_name.isEmpty() && dwi_count != bvals.size())
             {
                 std::ostringstream out;
-                out << "bval number does not match DWI: " << dwi_data.size()
+                out << "bval number does not match DWI: " << dwi_count
                           << " DWI in the nifti file, but " << bvals.size()
                           << " in " << bval_name.toStdString() << std::endl;
                 src_error_msg = out.str();
@@ -412,12 +384,9 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
         }
     }
 
-    for(unsigned int index = 0;index < dwi_data.size();++index)
+    for(unsigned int index = 0;index < dwi_count;++index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        tipl::image<float,3> data;
-        data.swap(dwi_data[index]);
-        new_file->image = data;
         new_file->file_name = file_name;
         new_file->file_name += ":";
         new_file->file_name += std::to_string(index);
@@ -444,6 +413,137 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
     return true;
 }
 
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec)
+{
+    tipl::vector<3,float> vs;
+    std::vector<tipl::image<float,3> > dwi_data;
+    {
+        gz_nifti nii;
+        nii.input_stream->buffer_all = true;
+        if(!nii.load_from_file(file_name))
+        {
+            src_error_msg = nii.error;
+            return false;
+        }
+        if(nii.dim(4) <= 1)
+        {
+            src_error_msg = "not a 4D nifti file";
+            return false;
+        }
+        dwi_data.resize(nii.dim(4));
+        nii.get_voxel_size(vs);
+        // check data range
+        for(unsigned int index = 0;index < nii.dim(4);++index)
+        {
+            tipl::image<float,3> data;
+            if(!nii.toLPS(data,false))
+                break;
+            clean_dwi_volume(data);
+            dwi_data[index].swap(data);
+        }
+        if(prog_aborted())
+        {
+            src_error_msg = "Aborted by user.";
+            return false;
+        }
+    }
+
+    {
+        float max_value = 0.0f;
+        for(unsigned int index = 0;index < dwi_data.size();++index)
+            max_value = std::max<float>(max_value,*std::max_element(dwi_data[index].begin(),dwi_data[index].end()));
+        float scale = get_dwi_scale(max_value);
+        if(scale != 1.0f)
+            tipl::par_for(dwi_data.size(),[&](unsigned int index){
+                tipl::multiply_constant(dwi_data[index],scale);
+            });
+    }
+
+    size_t first = dwi_files.size();
+    if(!load_4d_nii_info(file_name,dwi_files,need_bvalbvec,uint32_t(dwi_data.size()),vs))
+        return false;
+    for(unsigned int index = 0;index < dwi_data.size();++index)
+    {
+        tipl::image<float,3> data;
+        data.swap(dwi_data[index]);
+        dwi_files[first+index]->image = data;
+    }
+    return true;
+}
+
+// Streaming version: the volumes are decompressed once, here, to get the value range and
+// are spilled to a scratch file that read_volume reads back one at a time.
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec,
+                 tipl::geometry<3>& geo,std::function<bool(unsigned int,tipl::image<unsigned short,3>&)>& read_volume)
+{
+    tipl::vector<3,float> vs;
+    unsigned int dwi_count = 0;
+    float max_value = 0.0f;
+    auto scratch = std::make_shared<QTemporaryFile>();
+    if(!scratch->open())
+    {
+        src_error_msg = "cannot create a temporary file";
+        return false;
+    }
+    {
+        gz_nifti nii;
+        if(!nii.load_from_file(file_name))
+        {
+            src_error_msg = nii.error;
+            return false;
+        }
+        if(nii.dim(4) <= 1)
+        {
+            src_error_msg = "not a 4D nifti file";
+            return false;
+        }
+        dwi_count = nii.dim(4);
+        nii.get_voxel_size(vs);
+        begin_prog("checking data range");
+        for(unsigned int index = 0;check_prog(index,dwi_count);++index)
+        {
+            tipl::image<float,3> data;
+            if(!nii.toLPS(data,false))
+            {
+                src_error_msg = "cannot read DWI volume ";
+                src_error_msg += std::to_string(index);
+                return false;
+            }
+            clean_dwi_volume(data);
+            geo = data.geometry();
+            max_value = std::max<float>(max_value,*std::max_element(data.begin(),data.end()));
+            qint64 bytes = qint64(data.size()*sizeof(float));
+            if(scratch->write(reinterpret_cast<const char*>(&*data.begin()),bytes) != bytes)
+            {
+                src_error_msg = "cannot write to the temporary file";
+                return false;
+            }
+        }
+        if(prog_aborted())
+        {
+            src_error_msg = "Aborted by user.";
+            return false;
+        }
+    }
+    if(!load_4d_nii_info(file_name,dwi_files,need_bvalbvec,dwi_count,vs))
+        return false;
+
+    float scale = get_dwi_scale(max_value);
+    read_volume = [scratch,geo,scale](unsigned int index,tipl::image<unsigned short,3>& I)
+    {
+        tipl::image<float,3> data(geo);
+        qint64 bytes = qint64(data.size()*sizeof(float));
+        if(!scratch->seek(qint64(index)*bytes) ||
+           scratch->read(reinterpret_cast<char*>(&*data.begin()),bytes) != bytes)
+            return false;
+        if(scale != 1.0f)
+            tipl::multiply_constant(data,scale);
+        I = data;
+        return true;
+    };
+    return true;
+}
+
 bool load_4d_2dseq(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     tipl::io::bruker_2dseq bruker_header;
@@ -556,6 +656,124 @@ bool load_4d_2dseq(const char* file_name,std::vector<std::shared_ptr<DwiHeader>
     return true;
 }
 
+// runs fun(i) in parallel batches so that the progress bar is updated and can abort
+template<typename fun_type>
+bool par_for_prog(size_t n,fun_type&& fun)
+{
+    const size_t batch_size = 256;
+    for(size_t from = 0;from < n;from += batch_size)
+    {
+        if(!check_prog(from,n))
+            return false;
+        tipl::par_for(std::min(batch_size,n-from),[&](size_t i){fun(from+i);});
+    }
+    check_prog(n,n);
+    return true;
+}
+
+struct dicom_header_info{
+    float slice_location = 0.0f;
+    float bvalue = 0.0f;
+    tipl::vector<3,float> bvec;
+};
+// the header cache of a folder is kept in the application cache directory under
+// a hash of the folder path, so that nothing is written into the DICOM folders
+std::string get_dicom_header_cache_name(const std::string& dir)
+{
+    QString cache_dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/dicom_header_cache";
+    QDir().mkpath(cache_dir);
+    return (cache_dir + "/" +
+            QCryptographicHash::hash(QByteArray::fromStdString(dir),QCryptographicHash::Md5).toHex() + ".txt").toStdString();
+}
+// Reads the headers of all files in parallel without decoding the images.
+// The results are cached per folder and reused for files whose size and
+// modification time are unchanged.
+bool scan_dicom_headers(const QStringList& file_list,std::vector<dicom_header_info>& info)
+{
+    size_t n = size_t(file_list.size());
+    info.clear();
+    info.resize(n);
+    std::vector<std::string> dir(n),name(n),stamp(n);
+    tipl::par_for(n,[&](size_t i)
+    {
+        QFileInfo file(file_list[int(i)]);
+        dir[i] = file.absolutePath().toStdString();
+        name[i] = file.fileName().toStdString();
+        stamp[i] = std::to_string(file.size()) + "_" + std::to_string(file.lastModified().toSecsSinceEpoch());
+    });
+
+    // folder -> file name -> (stamp, header)
+    std::map<std::string,std::map<std::string,std::pair<std::string,dicom_header_info> > > cache;
+    for(size_t i = 0;i < n;++i)
+    {
+        if(cache.count(dir[i]))
+            continue;
+        auto& dir_cache = cache[dir[i]];
+        std::ifstream in(get_dicom_header_cache_name(dir[i]));
+        std::string line;
+        while(std::getline(in,line))
+        {
+            std::istringstream line_in(line);
+            std::string file_name,file_stamp;
+            dicom_header_info h;
+            if(std::getline(line_in,file_name,'\t') && line_in >> file_stamp >> h.slice_location >> h.bvalue >> h.bvec[0] >> h.bvec[1] >> h.bvec[2])
+                dir_cache[file_name] = std::make_pair(file_stamp,h);
+        }
+    }
+
+    std::vector<char> scanned(n),failed(n);
+    for(size_t i = 0;i < n;++i)
+    {
+        auto iter = cache[dir[i]].find(name[i]);
+        if(iter != cache[dir[i]].end() && iter->second.first == stamp[i])
+            info[i] = iter->second.second;
+        else
+            scanned[i] = 1;
+    }
+    size_t scan_count = size_t(std::count(scanned.begin(),scanned.end(),1));
+    if(!scan_count)
+        return true;
+    std::cout << "scanning " << scan_count << " dicom headers" << std::endl;
+    tipl::par_for(n,[&](size_t i)
+    {
+        if(!scanned[i])
+            return;
+        DwiHeader dwi;
+        if(!dwi.open(file_list[int(i)].toLocal8Bit().begin(),false))
+        {
+            failed[i] = 1;
+            return;
+        }
+        info[i].slice_location = dwi.slice_location;
+        info[i].bvalue = dwi.bvalue;
+        info[i].bvec = dwi.bvec;
+    });
+    if(std::find(failed.begin(),failed.end(),1) != failed.end())
+        return false;
+
+    // update the cache of folders with new headers
+    std::set<std::string> updated_dir;
+    for(size_t i = 0;i < n;++i)
+        if(scanned[i])
+        {
+            cache[dir[i]][name[i]] = std::make_pair(stamp[i],info[i]);
+            updated_dir.insert(dir[i]);
+        }
+    for(const auto& each_dir : updated_dir)
+    {
+        std::ofstream out(get_dicom_header_cache_name(each_dir));
+        if(!out)
+            continue;
+        // the layout detection compares these values exactly, so they must round-trip
+        out << std::setprecision(std::numeric_limits<float>::max_digits10);
+        for(const auto& entry : cache[each_dir])
+            out << entry.first << "\t" << entry.second.first << " " << entry.second.second.slice_location << " "
+                << entry.second.second.bvalue << " " << entry.second.second.bvec[0] << " "
+                << entry.second.second.bvec[1] << " " << entry.second.second.bvec[2] << std::endl;
+    }
+    return true;
+}
+
 bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     tipl::io::dicom dicom_header;// multiple frame image
@@ -566,96 +784,71 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
     // philips or GE single slice images
     if(geo[2] != 1 || dicom_header.is_mosaic)
         return false;
-    tipl::io::dicom dicom_header2;
-    if(file_list.size() < 2 || !dicom_header2.load_from_file(file_list[1].toLocal8Bit().begin()))
+    if(file_list.size() < 2)
         return false;
-    float s1 = dicom_header.get_slice_location();
+    std::vector<dicom_header_info> info;
+    {
+        prog_init p("scanning dicom headers");
+        if(!scan_dicom_headers(file_list,info))
+            return false;
+    }
+    unsigned int file_count = uint32_t(file_list.size());
+    auto same_b = [&](unsigned int i)
+    {
+        return info[0].bvec == info[i].bvec && info[0].bvalue == info[i].bvalue;
+    };
+    float s1 = info[0].slice_location;
     bool iterate_slice_first = true;
     unsigned int slice_num = 2;
     unsigned int b_num = 2;
-    if(s1 == 0.0) // no slice locaton information
+    if(s1 == 0.0f) // no slice locaton information
     {
-        DwiHeader dwi1,dwi2;
-        dwi1.open(file_list[0].toLocal8Bit().begin());
-        dwi2.open(file_list[1].toLocal8Bit().begin());
-        if(dwi1.bvec == dwi2.bvec && dwi1.bvalue == dwi2.bvalue) // iterater slice first
+        if(same_b(1)) // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec != dwi.bvec || dwi1.bvalue != dwi.bvalue)
-                    break;
-            }
+            for (;slice_num < file_count && same_b(slice_num);++slice_num)
+                ;
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
         else
         // iterate b first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec == dwi.bvec && dwi1.bvalue == dwi.bvalue)
-                    break;
-            }
-            geo[2] = file_list.size()/b_num;
+            for (;b_num < file_count && !same_b(b_num);++b_num)
+                ;
+            geo[2] = file_count/b_num;
             iterate_slice_first = false;
         }
     }
     else
     {
-        if(s1 == dicom_header2.get_slice_location()) // iterater b-value first
+        if(s1 == info[1].slice_location) // iterater b-value first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() != s1)
-                    break;
-            }
-            geo[2] = std::ceil((float)file_list.size()/(float)b_num);
+            for (;b_num < file_count && info[b_num].slice_location == s1;++b_num)
+                ;
+            geo[2] = uint32_t(std::ceil(float(file_count)/float(b_num)));
             iterate_slice_first = false;
         }
         else
         // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() == s1)
-                    break;
-            }
+            for (;slice_num < file_count && info[slice_num].slice_location != s1;++slice_num)
+                ;
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
     }
 
-
-    begin_prog("loading images");
-    for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
+    // b-table index and slice index of each file
+    std::vector<std::pair<unsigned int,unsigned int> > file_pos(file_count);
+    unsigned int volume_count = 0;
+    for (unsigned int index = 0,b_index = 0,slice_index = 0;index < file_count;++index)
     {
-        std::shared_ptr<DwiHeader> dwi(new DwiHeader);
-        if(!dwi->open(file_list[index].toLocal8Bit().begin()))
-            return false;
+        file_pos[index] = std::make_pair(b_index,slice_index);
         if(slice_index == 0)
-        {
-            dwi_files.push_back(dwi);
-            dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-            dwi_files.back()->image.resize(geo);
-            dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-        }
+            ++volume_count;
         else
-        {
-            size_t pos = slice_index*geo.plane_size();
-            if(pos+dwi->image.size() > dwi_files[b_index]->image.size())
+            if(b_index >= volume_count)
                 return false;
-            std::copy(dwi->image.begin(),dwi->image.end(),dwi_files[b_index]->image.begin() + pos);
-        }
         if(iterate_slice_first)
         {
             ++slice_index;
@@ -675,6 +868,46 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
             }
         }
     }
+
+    tipl::vector<3,float> voxel_size;
+    dicom_header.get_voxel_size(voxel_size);
+    std::vector<std::shared_ptr<DwiHeader> > volumes(volume_count);
+    for(auto& each : volumes)
+    {
+        each = std::make_shared<DwiHeader>();
+        each->image.resize(geo);
+        each->voxel_size = voxel_size;
+    }
+    std::vector<char> failed(file_count);
+    begin_prog("loading images");
+    if(!par_for_prog(file_count,[&](size_t index)
+    {
+        DwiHeader dwi;
+        if(!dwi.open(file_list[int(index)].toLocal8Bit().begin()))
+        {
+            failed[index] = 1;
+            return;
+        }
+        auto& volume = *volumes[file_pos[index].first];
+        size_t pos = file_pos[index].second*geo.plane_size();
+        if(pos+dwi.image.size() > volume.image.size())
+        {
+            failed[index] = 1;
+            return;
+        }
+        std::copy(dwi.image.begin(),dwi.image.end(),volume.image.begin() + int64_t(pos));
+        if(file_pos[index].second == 0)
+        {
+            volume.file_name = file_list[int(index)].toLocal8Bit().begin();
+            volume.report = dwi.report;
+            volume.bvec = dwi.bvec;
+            volume.bvalue = dwi.bvalue;
+            volume.te = dwi.te;
+            volume.slice_location = dwi.slice_location;
+        }
+    }) || std::find(failed.begin(),failed.end(),1) != failed.end())
+        return false;
+    dwi_files.insert(dwi_files.end(),volumes.begin(),volumes.end());
     return true;
 }
 void scale_image_buf_to_uint16(std::vector<tipl::image<float,3> >& image_buf)
@@ -870,14 +1103,19 @@ bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >&
 bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     begin_prog("loading images");
-    for (unsigned int index = 0;check_prog(index,file_list.size());++index)
+    std::vector<std::shared_ptr<DwiHeader> > new_files(size_t(file_list.size()));
+    if(!par_for_prog(new_files.size(),[&](size_t index)
     {
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        if (!new_file->open(file_list[index].toLocal8Bit().begin()))
-            continue;
-        new_file->file_name = file_list[index].toLocal8Bit().begin();
-        dwi_files.push_back(new_file);
-    }
+        if (!new_file->open(file_list[int(index)].toLocal8Bit().begin()))
+            return;
+        new_file->file_name = file_list[int(index)].toLocal8Bit().begin();
+        new_files[index] = new_file;
+    }))
+        return !dwi_files.empty();
+    for(auto& new_file : new_files)
+        if(new_file.get())
+            dwi_files.push_back(new_file);
     return !dwi_files.empty();
 }
 
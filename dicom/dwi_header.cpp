@@ -1,5 +1,7 @@
 #include <sstream>
 #include <string>
+#include <future>
+#include <QFile>
 #include "tipl/tipl.hpp"
 #include "dwi_header.hpp"
 #include "gzip_interface.hpp"
@@ -48,7 +50,8 @@ void get_report_from_bruker2(const tipl::io::bruker_info& header,std::string& re
     report += out.str();
 }
 bool get_compressed_image(tipl::io::dicom& dicom,tipl::image<short,2>& I);
-bool DwiHeader::open(const char* filename)
+// read_image = false parses only the header for grouping and sorting
+bool DwiHeader::open(const char* filename,bool read_image)
 {
     tipl::io::dicom header;
     if (!header.load_from_file(filename))
@@ -56,15 +59,19 @@ bool DwiHeader::open(const char* filename)
         tipl::io::nifti analyze_header;
         if (!analyze_header.load_from_file(filename))
             return false;
-        analyze_header >> image;
-        tipl::flip_xy(image);
+        if(read_image)
+        {
+            analyze_header >> image;
+            tipl::flip_xy(image);
+        }
         analyze_header.get_voxel_size(voxel_size);
         file_name = filename;
         return true;
     }
-
-    header >> image;
-    if(header.is_compressed)
+    slice_location = header.get_slice_location();
+    if(read_image)
+        header >> image;
+    if(read_image && header.is_compressed)
     {
         tipl::image<short,2> I;
         if(!get_compressed_image(header,I))
@@ -88,7 +95,8 @@ bool DwiHeader::open(const char* filename)
         tipl::get_orientation(3,orientation_matrix,dim_order,flip);
         tipl::reorient_vector(voxel_size,dim_order);
         tipl::reorient_matrix(orientation_matrix,dim_order,flip);
-        tipl::reorder(image,dim_order,flip);
+        if(read_image)
+            tipl::reorder(image,dim_order,flip);
         has_orientation_info = true;
     }
 
@@ -488,11 +496,6 @@ extern std::string src_error_msg;
 bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
                            int upsampling,bool sort_btable)
 {
-    if(!has_b_table(dwi_files))
-    {
-        src_error_msg = "invalid b-table";
-        return false;
-    }
     if(dwi_files.empty())
     {
         src_error_msg = "no DWI data for output";
@@ -503,6 +506,30 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
         sort_dwi(dwi_files);
         correct_t2(dwi_files);
     }
+    return output_src(di_file,dwi_files,dwi_files.front()->image.geometry(),upsampling,
+                      [&](unsigned int index,tipl::image<unsigned short,3>& I)
+                      {
+                          I = dwi_files[index]->image;
+                          return true;
+                      });
+}
+
+// read_volume is called once per volume in index order from a single worker thread,
+// so that the next volume is read and resampled while the current one is compressed.
+static bool write_src_file(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+                           tipl::geometry<3> geo,int upsampling,
+                           std::function<bool(unsigned int,tipl::image<unsigned short,3>&)>& read_volume)
+{
+    if(!DwiHeader::has_b_table(dwi_files))
+    {
+        src_error_msg = "invalid b-table";
+        return false;
+    }
+    if(dwi_files.empty())
+    {
+        src_error_msg = "no DWI data for output";
+        return false;
+    }
     gz_mat_write write_mat(di_file);
     if(!write_mat)
     {
@@ -510,7 +537,6 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
         src_error_msg += di_file;
         return false;
     }
-    tipl::geometry<3> geo = dwi_files.front()->image.geometry();
 
     //store dimension
     tipl::geometry<3> output_dim(geo);
@@ -572,36 +598,52 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     if(!dwi_files[0]->mask.empty())
         write_mat.write("mask",dwi_files[0]->mask,dwi_files[0]->mask.plane_size());
 
-    //store images
+    //store images: at most two volumes are held, one being written and one being prepared
+    auto prepare_volume = [&](unsigned int index,tipl::image<unsigned short,3>& buffer)
+    {
+        if(!read_volume(index,buffer) || buffer.geometry() != geo)
+            return false;
+        if(upsampling == 1)
+            tipl::upsampling(buffer);
+        if(upsampling == 2)
+            tipl::downsampling(buffer);
+        if(upsampling == 3)
+        {
+            tipl::upsampling(buffer);
+            tipl::upsampling(buffer);
+        }
+        if(upsampling == 4)
+        {
+            tipl::downsampling(buffer);
+            tipl::downsampling(buffer);
+        }
+        return true;
+    };
+    tipl::image<unsigned short,3> cur_volume,next_volume;
+    if(!prepare_volume(0,cur_volume))
+    {
+        src_error_msg = "cannot read DWI volume 0";
+        return false;
+    }
     begin_prog("Save Files");
     for (unsigned int index = 0;check_prog(index,(unsigned int)(dwi_files.size()));++index)
     {
+        std::future<bool> next;
+        if(index+1 < dwi_files.size())
+            next = std::async(std::launch::async,[&,index](){return prepare_volume(index+1,next_volume);});
         std::ostringstream name;
-        tipl::image<unsigned short,3> buffer;
-        const unsigned short* ptr = 0;
         name << "image" << index;
-        ptr = (const unsigned short*)dwi_files[index]->begin();
-        if(upsampling)
+        write_mat.write(name.str().c_str(),&*cur_volume.begin(),output_dim.plane_size(),output_dim.depth());
+        if(next.valid())
         {
-            buffer.resize(geo);
-            std::copy(ptr,ptr+geo.size(),buffer.begin());
-            if(upsampling == 1)
-                tipl::upsampling(buffer);
-            if(upsampling == 2)
-                tipl::downsampling(buffer);
-            if(upsampling == 3)
-            {
-                tipl::upsampling(buffer);
-                tipl::upsampling(buffer);
-            }
-            if(upsampling == 4)
+            if(!next.get())
             {
-                tipl::downsampling(buffer);
-                tipl::downsampling(buffer);
+                src_error_msg = "cannot read DWI volume ";
+                src_error_msg += std::to_string(index+1);
+                return false;
             }
-            ptr = (const unsigned short*)&*buffer.begin();
+            cur_volume.swap(next_volume);
         }
-        write_mat.write(name.str().c_str(),ptr,output_dim.plane_size(),output_dim.depth());
     }
 
     if(prog_aborted())
@@ -622,3 +664,29 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     write_mat.write("report",report1);
     return true;
 }
+
+// the SRC file is written to a temporary file that replaces di_file only when complete,
+// so that an aborted or failed output does not leave a truncated SRC file behind
+bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,
+                           tipl::geometry<3> geo,int upsampling,
+                           std::function<bool(unsigned int,tipl::image<unsigned short,3>&)> read_volume)
+{
+    // keep the .gz suffix so that the temporary file is still compressed
+    std::string temp_name(di_file);
+    temp_name.insert(QString(di_file).endsWith(".gz") ? temp_name.size()-3 : temp_name.size(),".tmp");
+    if(!write_src_file(temp_name.c_str(),dwi_files,geo,upsampling,read_volume))
+    {
+        QFile::remove(temp_name.c_str());
+        return false;
+    }
+    QFile::remove(di_file);
+    QFile::remove((std::string(di_file)+".idx").c_str());
+    if(!QFile::rename(temp_name.c_str(),di_file))
+    {
+        QFile::remove(temp_name.c_str());
+        src_error_msg = "cannot output file to ";
+        src_error_msg += di_file;
+        return false;
+    }
+    return true;
+}
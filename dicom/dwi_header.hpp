@@ -2,6 +2,7 @@
 #define DWI_HEADER_HPP
 #include <vector>
 #include <string>
+#include <functional>
 #include "tipl/tipl.hpp"
 
 
@@ -17,10 +18,11 @@ public:// for HCP dataset
 public:
     tipl::vector<3,float> bvec;
     float bvalue,te;
+    float slice_location = 0.0f;
     tipl::vector<3,float> voxel_size;
 public:
     DwiHeader(void): bvalue(0.0f), te(0.0f) {}
-    bool open(const char* filename);
+    bool open(const char* filename,bool read_image = true);
 public:
     const unsigned short* begin(void) const
     {
@@ -60,6 +62,8 @@ public:
 
 public:
     static bool output_src(const char* file_name, std::vector<std::shared_ptr<DwiHeader> >& dwi_files, int upsampling,bool sort_btable);
+    static bool output_src(const char* file_name, std::vector<std::shared_ptr<DwiHeader> >& dwi_files, tipl::geometry<3> geo,int upsampling,
+                           std::function<bool(unsigned int,tipl::image<unsigned short,3>&)> read_volume);
     static bool has_b_table(std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
 };
 
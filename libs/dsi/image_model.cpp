@@ -1,4 +1,5 @@
 #include <filesystem>
+#include <iomanip>
 #include <QFileInfo>
 #include <QDir>
 #include <QInputDialog>
@@ -450,9 +451,51 @@ bool ImageModel::run_steps(std::string steps)
 {
     std::istringstream in(steps);
     std::string step;
+    std::vector<std::string> step_list;
     std::getline(in,step); // ignore the first step [Step T2][Reconstruction]
     while(std::getline(in,step))
+        step_list.push_back(step);
+    return run_steps(step_list);
+}
+// only steps that take much longer than reading a cached SRC are worth caching
+static bool is_cached_step(const std::string& step)
+{
+    return step.find("[Step T2][Edit][Rotate to MNI") == 0 ||
+           step.find("[Step T2][Edit][Resample]") == 0 ||
+           step.find("[Step T2][Edit][Correct Phase Distortion]") == 0;
+}
+// steps with effects that a cached SRC does not restore (the study SRC of a comparison,
+// a mask read from a file) must run, so the cacheable prefix ends before them
+static bool ends_cached_steps(const std::string& step)
+{
+    return step.find("[Step T2b(2)][Compare SRC]") == 0 ||
+           step.find("[Step T2a][Open]") == 0;
+}
+bool ImageModel::run_steps(const std::vector<std::string>& step_list)
+{
+    size_t start = 0;
+    bool use_cache = !step_cache_dir.empty() && voxel.grad_dev.empty();
+    size_t cacheable_count = 0;
+    for(;cacheable_count < step_list.size() && !ends_cached_steps(step_list[cacheable_count]);++cacheable_count)
+        ;
+    if(use_cache)
+    {
+        // start from the longest step prefix that has been cached
+        for(size_t count = cacheable_count;count > 0;--count)
+            if(is_cached_step(step_list[count-1]))
+            {
+                std::string cache_file_name = get_step_cache_file_name(step_list,count);
+                if(std::filesystem::exists(cache_file_name) && load_step_cache(cache_file_name))
+                {
+                    std::cout << "use cached preprocessing results from " << cache_file_name << std::endl;
+                    start = count;
+                    break;
+                }
+            }
+    }
+    for(size_t i = start;i < step_list.size();++i)
     {
+        const std::string& step = step_list[i];
         size_t pos = step.find('=');
         if(pos == std::string::npos)
         {
@@ -464,7 +507,175 @@ bool ImageModel::run_steps(std::string steps)
             if(!command(step.substr(0,pos),step.substr(pos+1,step.size()-pos-1)))
                 return false;
         }
+        if(use_cache && i < cacheable_count && is_cached_step(step) &&
+           !save_step_cache(get_step_cache_file_name(step_list,i+1)))
+            std::cout << "cannot save preprocessing results to " << step_cache_dir << std::endl;
+    }
+    return true;
+}
+uint64_t ImageModel::get_src_checksum(void)
+{
+    if(src_checksum)
+        return src_checksum;
+    std::vector<uint64_t> volume_hash(original_src_dwi_data.size());
+    tipl::par_for(original_src_dwi_data.size(),[&](unsigned int index)
+    {
+        uint64_t h = 14695981039346656037ull;
+        const unsigned short* ptr = original_src_dwi_data[index];
+        for(size_t i = 0;i < original_dim.size();++i)
+        {
+            h ^= ptr[i];
+            h *= 1099511628211ull;
+        }
+        volume_hash[index] = h;
+    });
+    uint64_t h = 14695981039346656037ull;
+    auto add = [&](const void* data,size_t size)
+    {
+        for(size_t i = 0;i < size;++i)
+        {
+            h ^= reinterpret_cast<const unsigned char*>(data)[i];
+            h *= 1099511628211ull;
+        }
+    };
+    add(&*original_dim.begin(),sizeof(int)*3);
+    add(&*voxel.vs.begin(),sizeof(float)*3);
+    add(&src_bvalues[0],sizeof(float)*src_bvalues.size());
+    add(&untouched_src_bvectors[0],sizeof(tipl::vector<3,float>)*untouched_src_bvectors.size());
+    add(&volume_hash[0],sizeof(uint64_t)*volume_hash.size());
+    return src_checksum = h;
+}
+extern std::vector<std::string> iso_template_list;
+std::string ImageModel::get_step_cache_file_name(const std::vector<std::string>& step_list,size_t count)
+{
+    std::ostringstream key;
+    auto add_file = [&](const std::string& file_name)
+    {
+        QFileInfo info(file_name.c_str());
+        if(info.isFile())
+            key << " " << info.absoluteFilePath().toStdString() << " " << info.size() << " " << info.lastModified().toMSecsSinceEpoch();
+    };
+    key << get_src_checksum();
+    // b-table checking and alignment read the templates
+    add_file(fib_template_file_name_2mm);
+    if(!iso_template_list.empty())
+        add_file(iso_template_list.front());
+    for(size_t i = 0;i < count;++i)
+    {
+        key << "\n" << step_list[i];
+        // steps that read another file also depend on its content
+        size_t pos = step_list[i].find('=');
+        if(pos != std::string::npos)
+            add_file(step_list[i].substr(pos+1));
+    }
+    uint64_t h = 14695981039346656037ull;
+    for(char c : key.str())
+    {
+        h ^= uint8_t(c);
+        h *= 1099511628211ull;
+    }
+    std::ostringstream out;
+    out << step_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << h << ".src.gz";
+    return out.str();
+}
+bool ImageModel::load_step_cache(const std::string& cache_file_name)
+{
+    auto reader = std::make_shared<gz_mat_read>();
+    tipl::geometry<3> dim;
+    tipl::vector<3> vs;
+    unsigned int row,col;
+    const float* table = nullptr;
+    const unsigned char* mask_ptr = nullptr;
+    if(!reader->load_from_file(cache_file_name.c_str()) ||
+       !reader->read("dimension",dim) ||
+       !reader->read("voxel_size",vs) ||
+       !reader->read("b_table",row,col,table))
+        return false;
+    std::vector<const unsigned short*> dwi_data(col);
+    for (size_t index = 0;index < dwi_data.size();++index)
+    {
+        unsigned int r,c;
+        std::ostringstream out;
+        out << "image" << index;
+        if(!reader->read(out.str().c_str(),r,c,dwi_data[index]) || size_t(r)*size_t(c) != dim.size())
+            return false;
+    }
+    if(!reader->read("mask",row,col,mask_ptr) || size_t(row)*size_t(col) != dim.size())
+        return false;
+
+    voxel.dim = dim;
+    voxel.vs = vs;
+    src_bvalues.resize(dwi_data.size());
+    src_bvectors.resize(dwi_data.size());
+    for (size_t index = 0;index < dwi_data.size();++index,table += 4)
+    {
+        src_bvalues[index] = table[0];
+        src_bvectors[index] = tipl::vector<3>(table[1],table[2],table[3]);
+    }
+    src_dwi_data.swap(dwi_data);
+    new_dwi.clear();
+    voxel.mask.resize(dim);
+    std::copy(mask_ptr,mask_ptr+dim.size(),voxel.mask.begin());
+    reader->read("report",voxel.report);
+    reader->read("steps",voxel.steps);
+    const float* rotate_ptr = nullptr;
+    has_image_rotation = reader->read("bvec_rotate",row,col,rotate_ptr) && size_t(row)*size_t(col) == 9;
+    if(has_image_rotation)
+        std::copy(rotate_ptr,rotate_ptr+9,src_bvectors_rotate.begin());
+    voxel.dwi_data.clear();
+    step_cache_reader = reader;
+    calculate_dwi_sum(false);
+    return true;
+}
+bool ImageModel::save_step_cache(const std::string& cache_file_name)
+{
+    const size_t max_cache_count = 16;
+    if(!QDir().mkpath(step_cache_dir.c_str()))
+        return false;
+    // write to a temporary file first so that other processes never read a partial cache
+    std::string tmp_file_name = cache_file_name;
+    tmp_file_name.insert(tmp_file_name.size()-7,".tmp");
+    {
+        gz_mat_write mat_writer(tmp_file_name.c_str());
+        if(!mat_writer)
+            return false;
+        uint16_t dim[3];
+        std::copy(voxel.dim.begin(),voxel.dim.end(),dim);
+        mat_writer.write("dimension",dim,1,3);
+        mat_writer.write("voxel_size",voxel.vs);
+        std::vector<float> b_table;
+        for (size_t index = 0;index < src_bvalues.size();++index)
+        {
+            b_table.push_back(src_bvalues[index]);
+            b_table.push_back(src_bvectors[index][0]);
+            b_table.push_back(src_bvectors[index][1]);
+            b_table.push_back(src_bvectors[index][2]);
+        }
+        mat_writer.write("b_table",b_table,4);
+        for (size_t index = 0;index < src_dwi_data.size();++index)
+        {
+            std::ostringstream out;
+            out << "image" << index;
+            mat_writer.write(out.str().c_str(),src_dwi_data[index],
+                             uint32_t(voxel.dim.plane_size()),uint32_t(voxel.dim.depth()));
+        }
+        mat_writer.write("mask",voxel.mask,uint32_t(voxel.dim.plane_size()));
+        mat_writer.write("report",voxel.report);
+        mat_writer.write("steps",voxel.steps);
+        if(has_image_rotation)
+            mat_writer.write("bvec_rotate",src_bvectors_rotate.begin(),3,3);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_file_name,cache_file_name,ec);
+    if(ec)
+    {
+        std::filesystem::remove(tmp_file_name,ec);
+        return false;
     }
+    // remove the least recently created cache files
+    QStringList cache_list = QDir(step_cache_dir.c_str()).entryList(QStringList("*.src.gz"),QDir::Files,QDir::Time);
+    for(int i = int(max_cache_count);i < cache_list.size();++i)
+        std::filesystem::remove(step_cache_dir + "/" + cache_list[i].toStdString(),ec);
     return true;
 }
 bool ImageModel::command(std::string cmd,std::string param)
@@ -643,6 +854,13 @@ bool ImageModel::command(std::string cmd,std::string param)
                         param+std::string(" mm isotropic.");
         return true;
     }
+    if(cmd == "[Step T2][Edit][Correct Phase Distortion]")
+    {
+        if(!distortion_correction(param.c_str()))
+            return false;
+        voxel.steps += cmd+"="+param+"\n";
+        return true;
+    }
     if(cmd == "[Step T2][Edit][Rotate to MNI]")
     {
         rotate_to_mni(1.0f);
@@ -739,23 +957,59 @@ void ImageModel::rotate(const tipl::geometry<3>& new_geo,
 {
     std::vector<tipl::image<unsigned short,3> > dwi(src_dwi_data.size());
     prog_init p("rotating");
-    tipl::par_for2(src_dwi_data.size(),[&](unsigned int index,unsigned int id)
+    if(!super_reso_ref.empty())
     {
-        if(!id)
-            check_prog(index,src_dwi_data.size());
-        dwi[index].resize(new_geo);
-        auto I = tipl::make_image(const_cast<unsigned short*>(src_dwi_data[index]),voxel.dim);
-        if(!super_reso_ref.empty())
+        tipl::par_for2(src_dwi_data.size(),[&](unsigned int index,unsigned int id)
+        {
+            if(!id)
+                check_prog(index,src_dwi_data.size());
+            dwi[index].resize(new_geo);
+            auto I = tipl::make_image(const_cast<unsigned short*>(src_dwi_data[index]),voxel.dim);
             tipl::resample_with_ref(I,super_reso_ref,dwi[index],affine,var);
-        else
+        });
+    }
+    else
+    {
+        for(size_t index = 0;index < dwi.size();++index)
+            dwi[index].resize(new_geo);
+        // All volumes share the same mapping. The source location and interpolation weights
+        // are computed once per tile of output voxels and then applied to every volume
+        // while they are still in cache.
+        const size_t tile_size = 256;
+        size_t tile_count = (new_geo.size()+tile_size-1)/tile_size;
+        tipl::par_for2(tile_count,[&](size_t tile,unsigned int id)
         {
-            if(cdm_dis.empty())
-                tipl::resample(I,dwi[index],affine,tipl::cubic);
-            else
-                tipl::resample_dis(I,dwi[index],affine,cdm_dis,tipl::cubic);
-        }
+            if(!id)
+                check_prog(uint32_t(tile),uint32_t(tile_count));
+            size_t from = tile*tile_size;
+            size_t to = std::min(from+tile_size,new_geo.size());
+            std::vector<tipl::cubic_interpolation<3> > interpo(to-from);
+            std::vector<char> inside(to-from);
+            tipl::pixel_index<3> pos(from,new_geo);
+            for(size_t i = 0;i < to-from;++i,++pos)
+            {
+                tipl::vector<3> Jpos(pos);
+                if(!cdm_dis.empty())
+                    Jpos += cdm_dis[pos.index()];
+                affine(Jpos);
+                inside[i] = interpo[i].get_location(voxel.dim,Jpos);
+            }
+            for(size_t index = 0;index < dwi.size();++index)
+            {
+                auto I = tipl::make_image(src_dwi_data[index],voxel.dim);
+                unsigned short* out = &dwi[index][0]+from;
+                for(size_t i = 0;i < to-from;++i)
+                {
+                    float value = 0.0f;
+                    if(inside[i])
+                        interpo[i].estimate(I,value);
+                    out[i] = uint16_t(std::max<float>(0.0f,std::min<float>(65535.0f,value+0.5f)));
+                }
+            }
+        });
+    }
+    for(size_t index = 0;index < dwi.size();++index)
         src_dwi_data[index] = &(dwi[index][0]);
-    });
 
     dwi.swap(new_dwi);
     // rotate b-table
@@ -1018,6 +1272,91 @@ void apply_distortion_map2(const image_type& v1,
 
 
 
+// sum of squared difference between the two corrected images
+template<typename image_type>
+float distortion_residual(const image_type& vv1,const image_type& vv2)
+{
+    size_t n = vv1.height()*vv1.depth();
+    size_t w = vv1.width();
+    std::vector<float> sum(n);
+    tipl::par_for(n,[&](size_t z)
+    {
+        const float* p1 = &vv1[0]+z*w;
+        const float* p2 = &vv2[0]+z*w;
+        float s = 0.0f;
+        for(size_t x = 0;x < w;++x)
+            s += (p1[x]-p2[x])*(p1[x]-p2[x]);
+        sum[z] = s;
+    });
+    return std::accumulate(sum.begin(),sum.end(),0.0f);
+}
+
+// coarse-to-fine estimation: the map from the half resolution level initializes the
+// current level, which then only needs a few iterations to refine the details.
+template<typename image_type>
+void estimate_distortion_map(const image_type& v1,const image_type& v2,tipl::image<float,3>& dis_map,int level = 0)
+{
+    const int max_iteration = 120;
+    const int check_interval = 10;
+    tipl::geometry<3> geo(v1.geometry());
+    if(std::min(geo.width(),geo.height()) > 32 && geo.depth() > 8)
+    {
+        image_type vv1,vv2;
+        tipl::downsample_with_padding(v1,vv1);
+        tipl::downsample_with_padding(v2,vv2);
+        estimate_distortion_map(vv1,vv2,dis_map,level+1);
+        tipl::upsample_with_padding(dis_map,dis_map,geo);
+        dis_map *= 2.0f;
+        tipl::filter::gaussian(dis_map);
+    }
+    else
+    {
+        get_distortion_map(v2,v1,dis_map);
+        tipl::filter::gaussian(dis_map);
+        tipl::filter::gaussian(dis_map);
+    }
+
+    image_type vv1,vv2,df,gx(geo),v1_gx(geo),v2_gx(geo);
+    tipl::gradient(v1,v1_gx,1,0);
+    tipl::gradient(v2,v2_gx,1,0);
+
+    float first_residual = 0.0f,last_residual = 0.0f;
+    int iter = 0;
+    for(;iter < max_iteration && check_prog(iter,max_iteration) && !prog_aborted();++iter)
+    {
+        apply_distortion_map2(v1,dis_map,vv1,true);
+        apply_distortion_map2(v2,dis_map,vv2,false);
+        // stop when the residual no longer decreases by 0.5% over the check interval
+        if(iter % check_interval == 0)
+        {
+            float residual = distortion_residual(vv1,vv2);
+            if(iter == 0)
+                first_residual = residual;
+            else
+            if(last_residual-residual < last_residual*0.005f)
+            {
+                last_residual = residual;
+                break;
+            }
+            last_residual = residual;
+        }
+        df = vv1;
+        df -= vv2;
+        vv1 += vv2;
+        df *= vv1;
+        tipl::gradient(df,gx,1,0);
+        gx += v1_gx;
+        gx -= v2_gx;
+        tipl::normalize_abs(gx,0.5f);
+        tipl::filter::gaussian(gx);
+        tipl::filter::gaussian(gx);
+        tipl::filter::gaussian(gx);
+        dis_map += gx;
+    }
+    std::cout << "distortion correction level " << level << " (" << geo << "): " << iter
+              << " iterations, residual " << first_residual << " -> " << last_residual << std::endl;
+}
+
 bool ImageModel::distortion_correction(const char* filename)
 {
     tipl::image<float,3> v2;
@@ -1050,7 +1389,7 @@ bool ImageModel::distortion_correction(const char* filename)
         }
     }
 
-    tipl::image<float,3> v1,vv1,vv2;
+    tipl::image<float,3> v1,vv1;
     v1 = tipl::make_image(
         src_dwi_data[size_t(std::min_element(src_bvalues.begin(),src_bvalues.end())-src_bvalues.begin())],voxel.dim);
 
@@ -1072,40 +1411,20 @@ bool ImageModel::distortion_correction(const char* filename)
         }
     }
 
-    tipl::image<float,3> dis_map(v1.geometry()),df,gx(v1.geometry()),v1_gx(v1.geometry()),v2_gx(v2.geometry());
-
-
+    tipl::image<float,3> dis_map;
     tipl::filter::gaussian(v1);
     tipl::filter::gaussian(v2);
-
-    tipl::gradient(v1,v1_gx,1,0);
-    tipl::gradient(v2,v2_gx,1,0);
-
-    get_distortion_map(v2,v1,dis_map);
-    tipl::filter::gaussian(dis_map);
-    tipl::filter::gaussian(dis_map);
-
-
-    for(int iter = 0;iter < 120;++iter)
+    begin_prog("estimating distortion");
+    estimate_distortion_map(v1,v2,dis_map);
+    if(prog_aborted())
     {
-        apply_distortion_map2(v1,dis_map,vv1,true);
-        apply_distortion_map2(v2,dis_map,vv2,false);
-        df = vv1;
-        df -= vv2;
-        vv1 += vv2;
-        df *= vv1;
-        tipl::gradient(df,gx,1,0);
-        gx += v1_gx;
-        gx -= v2_gx;
-        tipl::normalize_abs(gx,0.5f);
-        tipl::filter::gaussian(gx);
-        tipl::filter::gaussian(gx);
-        tipl::filter::gaussian(gx);
-        dis_map += gx;
+        error_msg = "distortion correction aborted";
+        return false;
     }
 
+    begin_prog("applying distortion correction");
     std::vector<tipl::image<unsigned short,3> > dwi(src_dwi_data.size());
-    for(size_t i = 0;i < src_dwi_data.size();++i)
+    for(size_t i = 0;check_prog(i,src_dwi_data.size());++i)
     {
         v1 = tipl::make_image(src_dwi_data[i],voxel.dim);
         if(swap_xy)
@@ -1117,6 +1436,11 @@ bool ImageModel::distortion_correction(const char* filename)
         if(swap_xy)
             tipl::swap_xy(dwi[i]);
     }
+    if(prog_aborted())
+    {
+        error_msg = "distortion correction aborted";
+        return false;
+    }
 
     new_dwi.swap(dwi);
     for(size_t i = 0;i < new_dwi.size();++i)
@@ -284,6 +284,16 @@ public:
 public:
     bool command(std::string cmd,std::string param = "");
     bool run_steps(std::string steps);
+    bool run_steps(const std::vector<std::string>& step_list);
+public:
+    // preprocessed DWI are cached here by source checksum and step prefix (disabled if empty)
+    std::string step_cache_dir;
+    std::shared_ptr<gz_mat_read> step_cache_reader;
+    uint64_t src_checksum = 0;
+    uint64_t get_src_checksum(void);
+    std::string get_step_cache_file_name(const std::vector<std::string>& step_list,size_t count);
+    bool load_step_cache(const std::string& cache_file_name);
+    bool save_step_cache(const std::string& cache_file_name);
 public:
     bool load_from_file(const char* dwi_file_name);
     bool save_to_file(const char* dwi_file_name);
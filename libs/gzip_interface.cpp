@@ -463,6 +463,7 @@ void gz_istream::close(void)
 
 bool gz_ostream::open(const char* file_name)
 {
+    write_error = false;
     if(is_gz(file_name))
     {
         handle = gzopen(file_name, "wb");
@@ -485,14 +486,18 @@ void gz_ostream::write(const void* buf_,size_t size)
         {
             if(gzwrite(handle,buf,block_size) <= 0)
             {
+                write_error = true;
                 close();
                 throw std::runtime_error("Cannot output gz file");
             }
             size -= block_size;
             buf = buf + block_size;
         }
-        if(gzwrite(handle,buf,uint32_t(size)) <= 0)
+        if(size && gzwrite(handle,buf,uint32_t(size)) <= 0)
+        {
+            write_error = true;
             close();
+        }
     }
     else
         if(out)
@@ -510,7 +515,8 @@ void gz_ostream::close(void)
 {
     if(handle)
     {
-        gzclose(handle);
+        if(gzclose(handle) != Z_OK)
+            write_error = true;
         handle = nullptr;
     }
     if(out)
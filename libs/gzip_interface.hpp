@@ -122,6 +122,7 @@ public:
 class gz_ostream{
     std::ofstream out;
     gzFile handle;
+    bool write_error = false;
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -143,7 +144,7 @@ public:
     void write(const void* buf_,size_t size);
     void flush(void);
     void close(void);
-    bool good(void) const {return handle ? !gzeof(handle):out.good();}
+    bool good(void) const {return !write_error && (handle ? !gzeof(handle):out.good());}
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
 
@@ -162,3 +162,102 @@ void atlas::region_indices_at(const tipl::vector<3,float>& mni_space,std::vector
 }
 
 
+
+void region_label_map::clear(void)
+{
+    label.clear();
+    overflow_pos.clear();
+    overflow_regions.clear();
+}
+void region_label_map::resize(const tipl::geometry<3>& geo)
+{
+    clear();
+    label.resize(geo);
+}
+void region_label_map::set_overflow(std::vector<std::vector<std::pair<uint32_t,std::vector<short> > > >& thread_overflow)
+{
+    std::vector<std::pair<uint32_t,std::vector<short> > > all;
+    for(auto& buf : thread_overflow)
+    {
+        for(auto& each : buf)
+            all.push_back(std::move(each));
+        buf.clear();
+    }
+    std::sort(all.begin(),all.end(),[](const std::pair<uint32_t,std::vector<short> >& lhs,
+                                       const std::pair<uint32_t,std::vector<short> >& rhs)
+    {
+        return lhs.first < rhs.first;
+    });
+    overflow_pos.resize(all.size());
+    overflow_regions.resize(all.size());
+    for(size_t i = 0;i < all.size();++i)
+    {
+        overflow_pos[i] = all[i].first;
+        overflow_regions[i].swap(all[i].second);
+    }
+}
+size_t region_label_map::labeled_count(void) const
+{
+    return size_t(label.size()-size_t(std::count(label.begin(),label.end(),uint16_t(0))));
+}
+void region_label_map::get_regions(size_t pos,std::vector<short>& regions) const
+{
+    for_each_region(pos,[&](short region){regions.push_back(region);});
+}
+
+void atlas::get_label_map(const tipl::image<tipl::vector<3,float>,3 >& mni_position,region_label_map& label_map)
+{
+    label_map.clear();
+    if(mni_position.empty() || !load_from_file())
+        return;
+    get_list();
+    label_map.resize(mni_position.geometry());
+
+    // region value to (region index + 1), built once instead of per region
+    std::vector<uint16_t> value_to_label;
+    if(!is_multiple_roi)
+        for(size_t i = 0;i < region_value.size() && i+1 < region_label_map::overflow_label;++i)
+        {
+            if(region_value[i] >= value_to_label.size())
+                value_to_label.resize(region_value[i]+1);
+            if(!value_to_label[region_value[i]])
+                value_to_label[region_value[i]] = uint16_t(i+1);
+        }
+    size_t region_count = std::min<size_t>(region_value.size(),multiple_I_pos.size());
+
+    tipl::vector<3> null;
+    std::vector<std::vector<std::pair<uint32_t,std::vector<short> > > > overflow(std::thread::hardware_concurrency());
+    tipl::par_for2(mni_position.size(),[&](size_t index,unsigned int id)
+    {
+        const auto& mni = mni_position[index];
+        if(mni == null)
+            return;
+        size_t offset = get_index(mni);
+        if(!offset || offset >= I.size())
+            return;
+        if(is_multiple_roi)
+        {
+            std::vector<short> regions;
+            for(size_t region_index = 0;region_index < region_count;++region_index)
+            {
+                size_t pos = multiple_I_pos[region_index] + offset;
+                if(pos < multiple_I.size() && multiple_I[pos])
+                    regions.push_back(short(region_index));
+            }
+            if(regions.empty())
+                return;
+            if(regions.size() == 1)
+            {
+                label_map.label[index] = uint16_t(regions[0]+1);
+                return;
+            }
+            label_map.label[index] = region_label_map::overflow_label;
+            overflow[size_t(id)].push_back(std::make_pair(uint32_t(index),std::move(regions)));
+            return;
+        }
+        auto value = I[offset];
+        if(value < value_to_label.size())
+            label_map.label[index] = value_to_label[value];
+    });
+    label_map.set_overflow(overflow);
+}
@@ -3,6 +3,41 @@
 #include "tipl/tipl.hpp"
 #include <vector>
 #include <string>
+
+// subject-space region lookup: label stores region index + 1 (0: no region).
+// voxels belonging to more than one region carry overflow_label and their
+// region lists are kept in a table sorted by voxel position
+struct region_label_map{
+    static constexpr uint16_t overflow_label = 0xFFFF;
+    tipl::image<uint16_t,3> label;
+    std::vector<uint32_t> overflow_pos;
+    std::vector<std::vector<short> > overflow_regions;
+public:
+    bool empty(void) const{return label.empty();}
+    void clear(void);
+    void resize(const tipl::geometry<3>& geo);
+    void set_overflow(std::vector<std::vector<std::pair<uint32_t,std::vector<short> > > >& thread_overflow);
+    size_t labeled_count(void) const;
+    void get_regions(size_t pos,std::vector<short>& regions) const;
+    template<typename fun_type>
+    void for_each_region(size_t pos,fun_type&& fun) const
+    {
+        uint16_t l = label[pos];
+        if(!l)
+            return;
+        if(l != overflow_label)
+        {
+            fun(short(l-1));
+            return;
+        }
+        auto iter = std::lower_bound(overflow_pos.begin(),overflow_pos.end(),uint32_t(pos));
+        if(iter == overflow_pos.end() || *iter != pos)
+            return;
+        for(auto region : overflow_regions[size_t(iter-overflow_pos.begin())])
+            fun(region);
+    }
+};
+
 class atlas{
 private:
     tipl::image<uint32_t,3> I;
@@ -46,6 +81,7 @@ public:
     bool is_labeled_as(const tipl::vector<3,float>& mni_space,unsigned int region_index);
     int region_index_at(const tipl::vector<3,float>& mni_space);
     void region_indices_at(const tipl::vector<3,float>& mni_space,std::vector<uint16_t>& indices);
+    void get_label_map(const tipl::image<tipl::vector<3,float>,3 >& mni_position,region_label_map& label_map);
 };
 
 #endif // ATLAS_HPP
@@ -1,5 +1,10 @@
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <QFile>
 
 void connectometry_db::read_db(fib_data* handle_)
 {
@@ -441,6 +446,12 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
         handle->error_msg += file_name;
         return false;
     }
+    return add_subject(m,file_name,subject_name);
+}
+// if out is assigned, the subject data are written to out as subjectN and not kept in the db
+bool connectometry_db::add_subject(gz_mat_read& m,const std::string& file_name,const std::string& subject_name,
+                                   gz_mat_write* out,std::vector<float>* out_R2)
+{
     std::vector<float> new_subject_qa(subject_qa_length);
     if(!sample_subject_profile(m,new_subject_qa))
     {
@@ -457,9 +468,17 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
         handle->error_msg += file_name;
         return false;
     }
-    R2.push_back(*value);
     if(subject_report.empty())
         m.read("report",subject_report);
+    if(out)
+    {
+        std::ostringstream name;
+        name << "subject" << num_subjects + out_R2->size();
+        out->write(name.str().c_str(),&new_subject_qa[0],handle->dir.num_fiber,si2vi.size());
+        out_R2->push_back(*value);
+        return true;
+    }
+    R2.push_back(*value);
     subject_qa_buf.push_back(std::move(new_subject_qa));
     subject_qa.push_back(&(subject_qa_buf.back()[0]));
     subject_names.push_back(subject_name);
@@ -474,6 +493,156 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
     return true;
 }
 
+bool connectometry_db::add_subject_files(const std::vector<std::string>& file_names,
+                                         const std::vector<std::string>& names,
+                                         const char* output_name)
+{
+    // with output_name, subjects are flushed to a temporary file in order, which
+    // replaces the database file only when all subjects are added
+    std::shared_ptr<gz_mat_write> matfile;
+    std::vector<float> new_R2;
+    std::string temp_name;
+    if(output_name)
+    {
+        // keep the .gz suffix so that the temporary file is still compressed
+        temp_name = output_name;
+        temp_name.insert(QString(output_name).endsWith(".gz") ? temp_name.size()-3 : temp_name.size(),".tmp");
+        matfile = std::make_shared<gz_mat_write>(temp_name.c_str());
+        if(!(*matfile))
+        {
+            handle->error_msg = "Cannot output file";
+            return false;
+        }
+        write_db_header(*matfile);
+        for(unsigned int index = 0;index < subject_qa.size();++index)
+        {
+            std::ostringstream out;
+            out << "subject" << index;
+            matfile->write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,si2vi.size());
+        }
+    }
+
+    // decompress files in parallel while the decompressed data waiting to be sampled
+    // stay within a memory budget. A file is assumed to be as large as the largest
+    // one loaded so far, and the file to be sampled next is always allowed.
+    const size_t memory_budget = size_t(2) << 30;
+    size_t thread_count = std::max<size_t>(1,std::min<size_t>(std::thread::hardware_concurrency(),file_names.size()));
+    std::vector<std::shared_ptr<gz_mat_read> > loaded(file_names.size());
+    std::vector<char> ready(file_names.size());
+    std::vector<size_t> reserved(file_names.size());
+    size_t next_file = 0,sampled = 0,in_flight_bytes = 0,expected_bytes = 0;
+    bool terminated = false;
+    std::mutex lock_loaded;
+    std::condition_variable cv;
+    std::vector<std::thread> threads;
+    for(size_t t = 0;t < thread_count;++t)
+        threads.push_back(std::thread([&]()
+        {
+            while(1)
+            {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lock(lock_loaded);
+                    cv.wait(lock,[&](){return terminated || next_file >= file_names.size() || next_file == sampled ||
+                                              (expected_bytes && in_flight_bytes + expected_bytes <= memory_budget);});
+                    if(terminated || next_file >= file_names.size())
+                        return;
+                    i = next_file++;
+                    reserved[i] = expected_bytes;
+                    in_flight_bytes += expected_bytes;
+                }
+                auto m = std::make_shared<gz_mat_read>();
+                size_t bytes = 0;
+                if(!m->load_from_file(file_names[i].c_str()))
+                    m.reset();
+                else
+                    for(unsigned int j = 0;j < m->size();++j)
+                        bytes += size_t((*m)[j].get_rows())*size_t((*m)[j].get_cols())*sizeof(float);
+                {
+                    std::lock_guard<std::mutex> lock(lock_loaded);
+                    loaded[i] = m;
+                    ready[i] = 1;
+                    in_flight_bytes += bytes;
+                    in_flight_bytes -= reserved[i];
+                    reserved[i] = bytes;
+                    expected_bytes = std::max<size_t>(expected_bytes,bytes);
+                }
+                cv.notify_all();
+            }
+        }));
+
+    bool result = true;
+    for(size_t i = 0;i < file_names.size();++i)
+    {
+        std::shared_ptr<gz_mat_read> m;
+        {
+            std::unique_lock<std::mutex> lock(lock_loaded);
+            while(!ready[i])
+            {
+                cv.wait_for(lock,std::chrono::milliseconds(100));
+                lock.unlock();
+                check_prog(i,file_names.size());
+                lock.lock();
+            }
+            m.swap(loaded[i]);
+        }
+        if(!check_prog(i,file_names.size()))
+        {
+            handle->error_msg = "aborted";
+            result = false;
+        }
+        else
+        if(!m.get())
+        {
+            handle->error_msg = "failed to load subject data ";
+            handle->error_msg += file_names[i];
+            result = false;
+        }
+        else
+            result = add_subject(*m,file_names[i],names[i],matfile.get(),&new_R2);
+        m.reset();
+        {
+            std::lock_guard<std::mutex> lock(lock_loaded);
+            in_flight_bytes -= reserved[i];
+            sampled = i+1;
+            if(!result)
+                terminated = true;
+        }
+        cv.notify_all();
+        if(!result)
+            break;
+    }
+    for(auto& t : threads)
+        t.join();
+    if(!result)
+    {
+        if(matfile.get())
+        {
+            matfile.reset();
+            QFile::remove(temp_name.c_str());
+        }
+        return false;
+    }
+
+    if(matfile.get())
+    {
+        std::vector<std::string> all_names(subject_names);
+        all_names.insert(all_names.end(),names.begin(),names.end());
+        std::vector<float> all_R2(R2);
+        all_R2.insert(all_R2.end(),new_R2.begin(),new_R2.end());
+        write_db_footer(*matfile,all_names,all_R2);
+        matfile.reset();
+        QFile::remove(output_name);
+        QFile::remove((std::string(output_name)+".idx").c_str());
+        if(!QFile::rename(temp_name.c_str(),output_name))
+        {
+            handle->error_msg = "Cannot output file";
+            return false;
+        }
+    }
+    return true;
+}
+
 void connectometry_db::get_subject_vector(unsigned int from,unsigned int to,
                                           std::vector<std::vector<float> >& subject_vector,
                         const tipl::image<int,3>& fp_mask,float fiber_threshold,bool normalize_fp) const
@@ -632,38 +801,28 @@ void connectometry_db::save_subject_vector(const char* output_name,
         }
     }
 }
-bool connectometry_db::save_subject_data(const char* output_name)
+void connectometry_db::write_db_header(gz_mat_write& matfile) const
 {
-    // store results
-    gz_mat_write matfile(output_name);
-    if(!matfile)
-    {
-        handle->error_msg = "Cannot output file";
-        return false;
-    }
     for(unsigned int index = 0;index < handle->mat_reader.size();++index)
         if(handle->mat_reader[index].get_name() != "report" &&
            handle->mat_reader[index].get_name().find("subject") != 0)
             matfile.write(handle->mat_reader[index]);
-    for(unsigned int index = 0;check_prog(index,subject_qa.size());++index)
-    {
-        std::ostringstream out;
-        out << "subject" << index;
-        matfile.write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,si2vi.size());
-    }
+}
+void connectometry_db::write_db_footer(gz_mat_write& matfile,const std::vector<std::string>& names,const std::vector<float>& R2_value) const
+{
     std::string name_string;
-    for(unsigned int index = 0;index < num_subjects;++index)
+    for(unsigned int index = 0;index < names.size();++index)
     {
-        name_string += subject_names[index];
+        name_string += names[index];
         name_string += "\n";
     }
     matfile.write("subject_names",name_string);
     matfile.write("index_name",index_name);
-    matfile.write("R2",R2);
+    matfile.write("R2",R2_value);
 
     {
         std::ostringstream out;
-        out << "A total of " << num_subjects << " diffusion MRI scans were included in the connectometry database." << subject_report.c_str();
+        out << "A total of " << names.size() << " diffusion MRI scans were included in the connectometry database." << subject_report.c_str();
         if(index_name.find("sdf") != std::string::npos || index_name.find("qa") != std::string::npos)
             out << " The quantitative anisotropy was extracted as the local connectome fingerprint (LCF, Yeh et al. PLoS Comput Biol 12(11): e1005203) and used in the connectometry analysis.";
         else
@@ -672,6 +831,24 @@ bool connectometry_db::save_subject_data(const char* output_name)
         matfile.write("subject_report",subject_report);
         matfile.write("report",report);
     }
+}
+bool connectometry_db::save_subject_data(const char* output_name)
+{
+    // store results
+    gz_mat_write matfile(output_name);
+    if(!matfile)
+    {
+        handle->error_msg = "Cannot output file";
+        return false;
+    }
+    write_db_header(matfile);
+    for(unsigned int index = 0;check_prog(index,subject_qa.size());++index)
+    {
+        std::ostringstream out;
+        out << "subject" << index;
+        matfile.write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,si2vi.size());
+    }
+    write_db_footer(matfile,std::vector<std::string>(subject_names.begin(),subject_names.begin()+num_subjects),R2);
     modified = false;
     return true;
 }
@@ -48,6 +48,11 @@ public:
     bool is_odf_consistent(gz_mat_read& m);
     bool add_subject_file(const std::string& file_name,
                             const std::string& subject_name);
+    bool add_subject(gz_mat_read& m,const std::string& file_name,const std::string& subject_name,
+                     gz_mat_write* out = nullptr,std::vector<float>* out_R2 = nullptr);
+    bool add_subject_files(const std::vector<std::string>& file_names,
+                           const std::vector<std::string>& names,
+                           const char* output_name = nullptr);
     void get_subject_vector_pos(std::vector<int>& subject_vector_pos,
                                 const tipl::image<int,3>& fp_mask,float fiber_threshold) const;
     void get_subject_vector(unsigned int from,unsigned int to,
@@ -61,6 +66,8 @@ public:
                              float fiber_threshold,
                              bool normalize_fp) const;
     bool save_subject_data(const char* output_name);
+    void write_db_header(gz_mat_write& matfile) const;
+    void write_db_footer(gz_mat_write& matfile,const std::vector<std::string>& names,const std::vector<float>& R2_value) const;
     void get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
                             tipl::image<float,2>& slice) const;
     void get_subject_volume(unsigned int subject_index,tipl::image<float,3>& volume) const;
@@ -1,4 +1,7 @@
+#include <atomic>
 #include <filesystem>
+#include <mutex>
+#include <thread>
 #include <QCoreApplication>
 #include <QFileInfo>
 #include "fib_data.hpp"
@@ -125,6 +128,11 @@ const float* odf_data::get_odf_data(unsigned int index) const
     return nullptr;
 }
 
+uint64_t item::new_generation(void)
+{
+    static std::atomic<uint64_t> last_generation(0);
+    return ++last_generation;
+}
 tipl::const_pointer_image<float,3> item::get_image(void)
 {
     if(!image_ready)
@@ -879,8 +887,7 @@ bool fib_data::load_from_mat(void)
     {
         QString name = QFileInfo(fa_template_list[index].c_str()).baseName().toLower();
         if(QFileInfo(fib_file_name.c_str()).fileName().contains(name) ||
-           QFileInfo(QString(fib_file_name.c_str())+"."+name+".mapping.gz").exists() ||
-           QFileInfo(QString(fib_file_name.c_str())+"."+name+".inv.mapping.gz").exists())
+           QFileInfo(QString(fib_file_name.c_str())+"."+name+".warp.gz").exists())
         {
             set_template_id(index);
             return true;
@@ -1023,7 +1030,11 @@ void fib_data::set_template_id(size_t new_id)
     {
         template_id = new_id;
         template_I.clear();
-        mni_position.clear();
+        clear_normalization();
+        {
+            std::lock_guard<std::mutex> lock(atlas_label_cache_mutex);
+            atlas_label_cache.clear();
+        }
         atlas_list.clear();
         track_atlas.reset();
         // populate atlas list
@@ -1045,23 +1056,67 @@ void fib_data::set_template_id(size_t new_id)
         }
     }
 }
+// template images shared by all fib_data in the process, one entry per template and downsampling level
+struct template_pyramid{
+    tipl::vector<3> vs;
+    tipl::matrix<4,4,float> trans;
+    std::vector<tipl::image<float,3> > I,I2;
+};
+static std::mutex template_pyramid_mutex;
+static std::map<size_t,template_pyramid> template_pyramid_cache;
+static bool get_template(size_t id,unsigned int level,
+                         tipl::image<float,3>& I,tipl::image<float,3>& I2,
+                         tipl::vector<3>& vs,tipl::matrix<4,4,float>& trans,std::string& error_msg)
+{
+    std::lock_guard<std::mutex> lock(template_pyramid_mutex);
+    auto pyramid = template_pyramid_cache.find(id);
+    if(pyramid == template_pyramid_cache.end())
+    {
+        template_pyramid new_pyramid;
+        new_pyramid.I.resize(1);
+        new_pyramid.I2.resize(1);
+        gz_nifti read;
+        if(!read.load_from_file(fa_template_list[id].c_str()))
+        {
+            error_msg = "cannot load ";
+            error_msg += fa_template_list[id];
+            return false;
+        }
+        read.toLPS(new_pyramid.I[0]);
+        read.get_voxel_size(new_pyramid.vs);
+        read.get_image_transformation(new_pyramid.trans);
+        // load iso template if exists
+        gz_nifti read2;
+        if(!iso_template_list[id].empty() &&
+           read2.load_from_file(iso_template_list[id].c_str()))
+            read2.toLPS(new_pyramid.I2[0]);
+        pyramid = template_pyramid_cache.insert(std::make_pair(id,std::move(new_pyramid))).first;
+    }
+    auto& p = pyramid->second;
+    while(p.I.size() <= level)
+    {
+        auto next_I = p.I.back();
+        auto next_I2 = p.I2.back();
+        tipl::downsampling(next_I);
+        if(!next_I2.empty())
+            tipl::downsampling(next_I2);
+        p.I.push_back(std::move(next_I));
+        p.I2.push_back(std::move(next_I2));
+    }
+    I = p.I[level];
+    I2 = p.I2[level];
+    vs = p.vs;
+    trans = p.trans;
+    return true;
+}
 bool fib_data::load_template(void)
 {
     if(!template_I.empty())
         return true;
-    gz_nifti read;
-    tipl::image<float,3> I;
+    tipl::image<float,3> I,I2;
     tipl::vector<3> I_vs;
-    if(!read.load_from_file(fa_template_list[template_id].c_str()))
-    {
-        error_msg = "cannot load ";
-        error_msg += fa_template_list[template_id];
+    if(!get_template(template_id,0,I,I2,I_vs,template_trans_to_mni,error_msg))
         return false;
-    }
-    tipl::matrix<4,4,float> tran;
-    read.toLPS(I);
-    read.get_voxel_size(I_vs);
-    read.get_image_transformation(template_trans_to_mni);
     float ratio = float(I.width()*I_vs[0])/float(dim[0]*vs[0]);
     if(ratio < 0.25f || ratio > 8.0f)
     {
@@ -1072,33 +1127,21 @@ bool fib_data::load_template(void)
     template_shift[0] = template_trans_to_mni[3];
     template_shift[1] = template_trans_to_mni[7];
     template_shift[2] = template_trans_to_mni[11];
-    template_I.swap(I);
     template_vs = I_vs;
     unsigned int downsampling = 0;
-    while(template_I.width()/3 > int(dim[0]))
+    while(I.width()/3 > int(dim[0]))
     {
         std::cout << "downsampling template by 2x to match subject resolution" << std::endl;
         template_vs *= 2.0f;
         template_trans_to_mni[0] *= 2.0f;
         template_trans_to_mni[5] *= 2.0f;
         template_trans_to_mni[10] *= 2.0f;
-        tipl::downsampling(template_I);
         ++downsampling;
+        tipl::matrix<4,4,float> dummy;
+        get_template(template_id,downsampling,I,I2,I_vs,dummy,error_msg);
     }
-
-
-    // load iso template if exists
-    {
-        gz_nifti read2;
-        if(!iso_template_list[template_id].empty() &&
-           read2.load_from_file(iso_template_list[template_id].c_str()))
-        {
-            read2.toLPS(template_I2);
-            for(unsigned int i = 0;i < downsampling;++i)
-                tipl::downsampling(template_I2);
-        }
-
-    }
+    template_I.swap(I);
+    template_I2.swap(I2);
     template_I *= 1.0f/float(tipl::mean(template_I));
     if(!template_I2.empty())
         template_I2 *= 1.0f/float(tipl::mean(template_I2));
@@ -1381,39 +1424,244 @@ void animal_reg(const tipl::image<float,3>& from,tipl::vector<3> from_vs,
     });
 }
 
+// solve inv(x) = -dis(x+inv(x)) by fixed-point iteration
+static void invert_displacement(const tipl::image<tipl::vector<3>,3>& dis,
+                                tipl::image<tipl::vector<3>,3>& inv_dis,
+                                bool& terminated)
+{
+    inv_dis.resize(dis.geometry());
+    std::fill(inv_dis.begin(),inv_dis.end(),tipl::vector<3>(0.0f,0.0f,0.0f));
+    for(unsigned int iter = 0;iter < 10 && !terminated;++iter)
+        inv_dis.for_each_mt([&](tipl::vector<3>& v,const tipl::pixel_index<3>& pos)
+        {
+            tipl::vector<3> p(pos),d;
+            p += v;
+            tipl::estimate(dis,p,d,tipl::linear);
+            v = d;
+            v *= -1.0f;
+        });
+}
+// sample a dense displacement every "factor" voxels, padded by one control point
+static void to_control_points(const tipl::image<tipl::vector<3>,3>& dis,unsigned int factor,
+                              tipl::image<tipl::vector<3>,3>& cp)
+{
+    const auto& geo = dis.geometry();
+    cp.resize(tipl::geometry<3>((geo.width()-1)/factor+2,
+                                (geo.height()-1)/factor+2,
+                                (geo.depth()-1)/factor+2));
+    cp.for_each_mt([&](tipl::vector<3>& v,const tipl::pixel_index<3>& pos)
+    {
+        size_t x = std::min<size_t>(size_t(pos[0])*factor,size_t(geo.width()-1));
+        size_t y = std::min<size_t>(size_t(pos[1])*factor,size_t(geo.height()-1));
+        size_t z = std::min<size_t>(size_t(pos[2])*factor,size_t(geo.depth()-1));
+        v = dis[(z*size_t(geo.height())+y)*size_t(geo.width())+x];
+    });
+}
+
+bool fib_data::load_warp(const std::string& file_name)
+{
+    gz_mat_read in;
+    if(!in.load_from_file(file_name.c_str()))
+        return false;
+    // check if the current fib files has the same recon steps as the one generating the maps
+    std::string check_steps;
+    in.read("steps",check_steps);
+    if(!check_steps.empty() && check_steps != steps)
+        return false;
+    tipl::geometry<3> geo,cp_geo;
+    const float* T_ptr = nullptr;
+    const float* factor_ptr = nullptr;
+    const float* dis_ptr = nullptr;
+    const float* inv_dis_ptr = nullptr;
+    unsigned int row,col;
+    if(!in.read("dimension",geo) || geo != template_I.geometry() ||
+       !in.read("cp_dimension",cp_geo) ||
+       !in.read("factor",row,col,factor_ptr) || row*col != 1 || *factor_ptr != float(warp_factor) ||
+       !in.read("T",row,col,T_ptr) || row*col != 12 ||
+       !in.read("dis",row,col,dis_ptr) || row != 3 || col != cp_geo.size() ||
+       !in.read("inv_dis",row,col,inv_dis_ptr) || row != 3 || col != cp_geo.size())
+        return false;
+    std::copy(T_ptr,T_ptr+12,warp_T.data);
+    warp_dis.resize(cp_geo);
+    warp_inv_dis.resize(cp_geo);
+    std::copy(dis_ptr,dis_ptr+3*cp_geo.size(),&warp_dis[0][0]);
+    std::copy(inv_dis_ptr,inv_dis_ptr+3*cp_geo.size(),&warp_inv_dis[0][0]);
+    return true;
+}
+
+bool fib_data::save_warp(const std::string& file_name) const
+{
+    gz_mat_write out(file_name.c_str());
+    if(!out)
+        return false;
+    float T[12];
+    std::copy(warp_T.data,warp_T.data+12,T);
+    float factor = warp_factor;
+    out.write("dimension",template_I.geometry());
+    out.write("cp_dimension",warp_dis.geometry());
+    out.write("voxel_size",template_vs);
+    out.write("trans",template_trans_to_mni);
+    out.write("factor",&factor,1,1);
+    out.write("T",T,4,3);
+    out.write("dis",&warp_dis[0][0],3,warp_dis.size());
+    out.write("inv_dis",&warp_inv_dis[0][0],3,warp_inv_dis.size());
+    out.write("steps",steps);
+    return true;
+}
+
+void fib_data::densify_mapping(bool inv)
+{
+    const float factor = warp_factor;
+    tipl::image<tipl::vector<3,float>,3 > mni(inv ? template_I.geometry() : dim);
+    if(inv)
+    {
+        mni.for_each_mt([&](tipl::vector<3,float>& v,const tipl::pixel_index<3>& pos)
+        {
+            tipl::vector<3> p(pos),d;
+            v = p;
+            p /= factor;
+            tipl::estimate(warp_dis,p,d,tipl::linear);
+            v += d;
+            warp_T(v);
+        });
+        inv_mni_position.swap(mni);
+    }
+    else
+    {
+        auto iT = warp_T;
+        iT.inverse();
+        mni.for_each_mt([&](tipl::vector<3,float>& v,const tipl::pixel_index<3>& pos)
+        {
+            tipl::vector<3> p(pos),d;
+            iT(p);
+            v = p;
+            p /= factor;
+            tipl::estimate(warp_inv_dis,p,d,tipl::linear);
+            v += d;
+            template_to_mni(v);
+        });
+        mni_position.swap(mni);
+    }
+}
+
+void fib_data::clear_normalization(void)
+{
+    mni_position.clear();
+    inv_mni_position.clear();
+    warp_dis.clear();
+    warp_inv_dis.clear();
+}
+
+bool cohort_normalization::get_mean_affine(tipl::affine_transform<double>& arg,float& max_cost)
+{
+    std::lock_guard<std::mutex> lock(affine_mutex);
+    if(!affine_count)
+        return false;
+    max_cost = worst_cost;
+    double w = 1.0/double(affine_count);
+    for(unsigned int i = 0;i < 3;++i)
+    {
+        arg.translocation[i] = affine_sum.translocation[i]*w;
+        arg.rotation[i] = affine_sum.rotation[i]*w;
+        arg.scaling[i] = affine_sum.scaling[i]*w;
+        arg.affine[i] = affine_sum.affine[i]*w;
+    }
+    return true;
+}
+void cohort_normalization::add_affine(const tipl::affine_transform<double>& arg,float cost)
+{
+    std::lock_guard<std::mutex> lock(affine_mutex);
+    if(!affine_count || cost > worst_cost)
+        worst_cost = cost;
+    if(!affine_count)
+        affine_sum = arg;
+    else
+    for(unsigned int i = 0;i < 3;++i)
+    {
+        affine_sum.translocation[i] += arg.translocation[i];
+        affine_sum.rotation[i] += arg.rotation[i];
+        affine_sum.scaling[i] += arg.scaling[i];
+        affine_sum.affine[i] += arg.affine[i];
+    }
+    ++affine_count;
+}
+void cohort_normalization::acquire_cdm(void)
+{
+    std::unique_lock<std::mutex> lock(cdm_mutex);
+    cdm_cv.wait(lock,[&](){return cdm_slots > 0;});
+    --cdm_slots;
+}
+void cohort_normalization::release_cdm(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(cdm_mutex);
+        ++cdm_slots;
+    }
+    cdm_cv.notify_one();
+}
+
+void normalize_cohort(const std::vector<std::string>& file_list,size_t template_id,unsigned int subject_count)
+{
+    if(file_list.empty())
+        return;
+    subject_count = std::max<unsigned int>(1,std::min<unsigned int>(subject_count,uint32_t(file_list.size())));
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency()/subject_count);
+    std::cout << "normalizing " << file_list.size() << " subjects, " << subject_count << " at a time" << std::endl;
+    auto cohort = std::make_shared<cohort_normalization>();
+    // cdm already spreads over all cores; letting half of the subjects run it at once
+    // keeps the cores busy through its serial parts without holding every subject's
+    // displacement fields in memory
+    cohort->cdm_slots = std::max<unsigned int>(1,subject_count/2);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for(unsigned int i = 0;i < subject_count;++i)
+        threads.push_back(std::thread([&]()
+        {
+            for(size_t index = next++;index < file_list.size() && !prog_aborted();index = next++)
+            {
+                fib_data fib;
+                if(!fib.load_from_file(file_list[index].c_str()))
+                {
+                    std::cout << "cannot load " << file_list[index] << std::endl;
+                    continue;
+                }
+                fib.set_template_id(template_id);
+                if(!fib.load_template())
+                {
+                    std::cout << fib.error_msg << std::endl;
+                    continue;
+                }
+                fib.normalization_thread_count = thread_count;
+                fib.cohort = cohort;
+                fib.run_normalization(false,true);
+            }
+        }));
+    for(auto& t : threads)
+        t.join();
+}
+
 void fib_data::run_normalization(bool background,bool inv)
 {
     if(!need_normalization ||
        (!inv && !mni_position.empty()) ||
        (inv && !inv_mni_position.empty()))
         return;
+    // the other direction has already been registered
+    if(!warp_dis.empty())
+    {
+        densify_mapping(inv);
+        prog = 5;
+        return;
+    }
     std::string output_file_name(fib_file_name);
     output_file_name += ".";
     output_file_name += QFileInfo(fa_template_list[template_id].c_str()).baseName().toLower().toStdString();
-    output_file_name += inv ? ".inv.mapping.gz" : ".mapping.gz";
-    gz_mat_read in;
-    if(in.load_from_file(output_file_name.c_str()))
+    output_file_name += ".warp.gz";
+    if(load_warp(output_file_name))
     {
-        // check if the current fib files has the same recon steps as the one generating the maps
-        std::string check_steps;
-        in.read("steps",check_steps);
-        if(check_steps.empty() || check_steps == steps)
-        {
-            tipl::image<tipl::vector<3,float>,3 > mni(inv ? template_I.geometry() : dim);
-            const float* ptr = nullptr;
-            unsigned int row,col;
-            in.read("mapping",row,col,ptr);
-            if(row == 3 && col == mni.size() && ptr)
-            {
-                std::copy(ptr,ptr+col*row,&mni[0][0]);
-                if(inv)
-                    inv_mni_position.swap(mni);
-                else
-                    mni_position.swap(mni);
-                prog = 5;
-                return;
-            }
-        }
+        densify_mapping(inv);
+        prog = 5;
+        return;
     }
     if(background)
         begin_prog("running normalization");
@@ -1459,8 +1707,26 @@ void fib_data::run_normalization(bool background,bool inv)
                     animal_reg(It2,template_vs,Is2,tvs,T,terminated);
             }
             else
-                tipl::reg::two_way_linear_mr(It,template_vs,Is,tvs,T,tipl::reg::affine,
-                                             tipl::reg::mutual_information(),terminated);
+            {
+                // in a cohort run, start from the mean affine of the subjects already
+                // registered, and fall back to the default start only if the result
+                // is worse than any subject accepted so far
+                tipl::affine_transform<double> arg;
+                float max_cost = 0.0f;
+                bool warm_start = cohort && cohort->get_mean_affine(arg,max_cost);
+                float cost = tipl::reg::two_way_linear_mr(It,template_vs,Is,tvs,T,tipl::reg::affine,
+                                             tipl::reg::mutual_information(),terminated,
+                                             normalization_thread_count,&arg);
+                if(warm_start && !terminated && cost > max_cost)
+                {
+                    arg = tipl::affine_transform<double>();
+                    cost = tipl::reg::two_way_linear_mr(It,template_vs,Is,tvs,T,tipl::reg::affine,
+                                             tipl::reg::mutual_information(),terminated,
+                                             normalization_thread_count,&arg);
+                }
+                if(cohort && !terminated)
+                    cohort->add_affine(arg,cost);
+            }
 
             for(unsigned int i = 0;i < downsampling;++i)
                 tipl::multiply_constant(T.data,T.data+12,2.0f);
@@ -1477,75 +1743,45 @@ void fib_data::run_normalization(bool background,bool inv)
         if(!Is2.empty())
             tipl::resample_mt(Is2,Iss2,T,tipl::linear);
         prog = 3;
+        // register once and obtain the opposite direction by inverting the displacement
         tipl::image<tipl::vector<3>,3> dis,inv_dis;
+        struct cdm_slot{
+            std::shared_ptr<cohort_normalization> cohort;
+            cdm_slot(std::shared_ptr<cohort_normalization> cohort_):cohort(cohort_)
+            {
+                if(cohort)
+                    cohort->acquire_cdm();
+            }
+            ~cdm_slot(void){release();}
+            void release(void)
+            {
+                if(cohort)
+                    cohort->release_cdm();
+                cohort.reset();
+            }
+        } slot(cohort);
         tipl::reg::cdm_pre(It,It2,Iss,Iss2);
         if(Iss2.geometry() == Iss.geometry())
         {
             set_title("dual normalization");
-            if(inv)
-                tipl::reg::cdm2(It,It2,Iss,Iss2,dis,terminated);
-            else
-                tipl::reg::cdm2(Iss,Iss2,It,It2,inv_dis,terminated);
+            tipl::reg::cdm2(It,It2,Iss,Iss2,dis,terminated);
         }
         else
-        {
-            if(inv)
-                tipl::reg::cdm(It,Iss,dis,terminated);
-            else
-                tipl::reg::cdm(Iss,It,inv_dis,terminated);
-        }
+            tipl::reg::cdm(It,Iss,dis,terminated);
 
         if(terminated)
             return;
         prog = 4;
-        tipl::image<tipl::vector<3,float>,3 > mni(inv ? template_I.geometry() : dim);
-
+        invert_displacement(dis,inv_dis,terminated);
         if(terminated)
             return;
-        if(inv)
-        {
-            mni.for_each_mt([&](tipl::vector<3,float>& v,const tipl::pixel_index<3>& pos)
-            {
-                tipl::vector<3> p(pos);
-                v = p;
-                v += dis[pos.index()];
-                T(v);
-            });
-            inv_mni_position.swap(mni);
-        }
-        else {
-            T.inverse();
-            mni.for_each_mt([&](tipl::vector<3,float>& v,const tipl::pixel_index<3>& pos)
-            {
-                tipl::vector<3> p(pos),d;
-                T(p);
-                v = p;
-                tipl::estimate(inv_dis,v,d,tipl::linear);
-                v += d;
-                template_to_mni(v);
-            });
-            mni_position.swap(mni);
-        }
+        slot.release();
 
-        gz_mat_write out(output_file_name.c_str());
-        if(out)
-        {
-            if(inv)
-            {
-                out.write("dimension",inv_mni_position.geometry());
-                out.write("voxel_size",template_vs);
-                out.write("trans",template_trans_to_mni);
-                out.write("mapping",&inv_mni_position[0][0],3,inv_mni_position.size());
-            }
-            else
-            {
-                out.write("dimension",mni_position.geometry());
-                out.write("voxel_size",vs);
-                out.write("trans",trans_to_mni);
-                out.write("mapping",&mni_position[0][0],3,mni_position.size());
-            }
-            out.write("steps",steps);
-        }
+        warp_T = T;
+        to_control_points(dis,warp_factor,warp_dis);
+        to_control_points(inv_dis,warp_factor,warp_inv_dis);
+        save_warp(output_file_name);
+        densify_mapping(inv);
         prog = 5;
     };
 
@@ -1667,58 +1903,159 @@ void fib_data::subject2mni(tipl::pixel_index<3>& index,tipl::vector<3>& pos)
     return;
 }
 
-void fib_data::get_atlas_roi(std::shared_ptr<atlas> at,unsigned int roi_index,std::vector<tipl::vector<3,short> >& points)
+uint32_t fib_data::get_mni_mapping_checksum(void) const
+{
+    // FNV-1a over the mapping
+    uint32_t hash = 2166136261u;
+    auto ptr = reinterpret_cast<const unsigned char*>(&mni_position[0][0]);
+    auto size = mni_position.size()*sizeof(tipl::vector<3,float>);
+    for(size_t i = 0;i < size;++i)
+    {
+        hash ^= ptr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::shared_ptr<region_label_map> fib_data::get_atlas_label_map(std::shared_ptr<atlas> at)
 {
+    // held throughout so that concurrent callers wait for one warp instead of repeating it
+    std::lock_guard<std::mutex> lock(atlas_label_cache_mutex);
+    auto iter = atlas_label_cache.find(at->filename);
+    if(iter != atlas_label_cache.end())
+        return iter->second;
     if(get_mni_mapping().empty() || !at->load_from_file())
+        return std::shared_ptr<region_label_map>();
+
+    auto label_map = std::make_shared<region_label_map>();
+    uint32_t checksum = get_mni_mapping_checksum();
+    std::string cache_file_name;
+    if(!fib_file_name.empty())
+    {
+        cache_file_name = fib_file_name;
+        cache_file_name += ".";
+        cache_file_name += QFileInfo(fa_template_list[template_id].c_str()).baseName().toLower().toStdString();
+        cache_file_name += ".";
+        cache_file_name += at->name;
+        cache_file_name += ".label.gz";
+    }
+
+    // reuse the labels saved by a previous run if they came from the same atlas and mapping
+    gz_mat_read in;
+    if(!cache_file_name.empty() && in.load_from_file(cache_file_name.c_str()))
+    {
+        std::string atlas_file;
+        tipl::geometry<3> label_dim;
+        unsigned int row,col;
+        const unsigned int* checksum_ptr = nullptr;
+        const uint16_t* label_ptr = nullptr;
+        if(in.read("atlas",atlas_file) && atlas_file == at->filename &&
+           in.read("dimension",label_dim) && label_dim == dim &&
+           in.read("checksum",row,col,checksum_ptr) && *checksum_ptr == checksum &&
+           in.read("label",row,col,label_ptr) && size_t(row)*size_t(col) == dim.size())
+        {
+            label_map->resize(dim);
+            std::copy(label_ptr,label_ptr+dim.size(),label_map->label.begin());
+            const unsigned int* pos_ptr = nullptr;
+            const unsigned int* count_ptr = nullptr;
+            const uint16_t* region_ptr = nullptr;
+            unsigned int pos_count = 0;
+            if(in.read("overflow_pos",row,pos_count,pos_ptr) &&
+               in.read("overflow_count",row,col,count_ptr) &&
+               in.read("overflow_region",row,col,region_ptr))
+            {
+                label_map->overflow_pos = std::vector<uint32_t>(pos_ptr,pos_ptr+pos_count);
+                label_map->overflow_regions.resize(pos_count);
+                for(size_t i = 0;i < pos_count;++i)
+                {
+                    label_map->overflow_regions[i] = std::vector<short>(region_ptr,region_ptr+count_ptr[i]);
+                    region_ptr += count_ptr[i];
+                }
+            }
+            atlas_label_cache[at->filename] = label_map;
+            return label_map;
+        }
+    }
+
+    at->get_label_map(mni_position,*label_map);
+    atlas_label_cache[at->filename] = label_map;
+
+    if(!cache_file_name.empty())
+    {
+        // write to a temporary file so that other processes never read a partial cache.
+        // keep the .gz suffix so that it is still compressed
+        std::string temp_name(cache_file_name);
+        temp_name.insert(temp_name.size()-3,".tmp");
+        bool written = false;
+        {
+        gz_mat_write out(temp_name.c_str());
+        if(out)
+        {
+            out.write("atlas",at->filename);
+            out.write("dimension",dim);
+            out.write("checksum",&checksum,1,1);
+            out.write("label",&label_map->label[0],label_map->label.size(),1);
+            if(!label_map->overflow_pos.empty())
+            {
+                std::vector<unsigned int> count;
+                std::vector<uint16_t> region;
+                for(const auto& each : label_map->overflow_regions)
+                {
+                    count.push_back(uint32_t(each.size()));
+                    region.insert(region.end(),each.begin(),each.end());
+                }
+                out.write("overflow_pos",&label_map->overflow_pos[0],1,label_map->overflow_pos.size());
+                out.write("overflow_count",&count[0],1,count.size());
+                out.write("overflow_region",&region[0],1,region.size());
+            }
+            written = bool(out);
+        }
+        }
+        std::error_code ec;
+        if(written)
+        {
+            std::filesystem::remove(cache_file_name+".idx",ec);
+            std::filesystem::rename(temp_name,cache_file_name,ec);
+        }
+        if(!written || ec)
+            std::filesystem::remove(temp_name,ec);
+    }
+    return label_map;
+}
+
+void fib_data::get_atlas_roi(std::shared_ptr<atlas> at,unsigned int roi_index,std::vector<tipl::vector<3,short> >& points)
+{
+    points.clear();
+    auto label_map = get_atlas_label_map(at);
+    if(!label_map.get() || label_map->label.geometry() != dim)
         return;
     unsigned int thread_count = std::thread::hardware_concurrency();
     std::vector<std::vector<tipl::vector<3,short> > > buf(thread_count);
-    mni_position.for_each_mt2([&](const tipl::vector<3>& mni,const tipl::pixel_index<3>& index,int id)
+    tipl::par_for2(dim.size(),[&](size_t i,unsigned int id)
     {
-        if (at->is_labeled_as(mni, roi_index))
-            buf[id].push_back(tipl::vector<3,short>(index.begin()));
+        label_map->for_each_region(i,[&](short region)
+        {
+            if(uint32_t(region) == roi_index)
+                buf[id].push_back(tipl::vector<3,short>(tipl::pixel_index<3>(i,dim).begin()));
+        });
     });
-    points.clear();
-    for(int i = 0;i < buf.size();++i)
+    for(size_t i = 0;i < buf.size();++i)
         points.insert(points.end(),buf[i].begin(),buf[i].end());
-
 }
 
 void fib_data::get_atlas_all_roi(std::shared_ptr<atlas> at,std::vector<std::vector<tipl::vector<3,short> > >& points)
 {
-    if(get_mni_mapping().empty() || !at->load_from_file())
+    auto label_map = get_atlas_label_map(at);
+    if(!label_map.get() || label_map->label.geometry() != dim)
         return;
     points.clear();
     points.resize(at->get_list().size());
-    std::vector<std::mutex> push_back_mutex(points.size());
-    if(at->is_multiple_roi)
-    {
-        mni_position.for_each_mt([&](const tipl::vector<3>& mni,const tipl::pixel_index<3>& index)
-        {
-            std::vector<uint16_t> region_indicies;
-            at->region_indices_at(mni,region_indicies);
-            if(region_indicies.empty())
-                return;
-            tipl::vector<3,short> point(index.begin());
-            for(unsigned int i = 0;i < region_indicies.size();++i)
-            {
-                auto region_index = region_indicies[i];
-                std::lock_guard<std::mutex> lock(push_back_mutex[region_index]);
-                points[region_index].push_back(point);
-            }
-        });
-    }
-    else
-    {
-        mni_position.for_each_mt([&](const tipl::vector<3>& mni,const tipl::pixel_index<3>& index)
+    for(tipl::pixel_index<3> index(dim);index < dim.size();++index)
+        label_map->for_each_region(index.index(),[&](short region)
         {
-            int region_index = at->region_index_at(mni);
-            if(region_index < 0 || region_index >= int(points.size()))
-                return;
-            std::lock_guard<std::mutex> lock(push_back_mutex[uint32_t(region_index)]);
-            points[uint32_t(region_index)].push_back(tipl::vector<3,short>(index.begin()));
+            if(uint32_t(region) < points.size())
+                points[uint32_t(region)].push_back(tipl::vector<3,short>(index.begin()));
         });
-    }
 }
 
 const tipl::image<tipl::vector<3,float>,3 >& fib_data::get_mni_mapping(void)
@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <mutex>
+#include <condition_variable>
 #include "prog_interface_static_link.h"
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
@@ -132,8 +134,11 @@ public:
         image_ready = false;
     }
     tipl::const_pointer_image<float,3> get_image(void);
-    void set_image(tipl::const_pointer_image<float,3> new_image){image_data = new_image;}
+    void set_image(tipl::const_pointer_image<float,3> new_image){image_data = new_image;generation = new_generation();}
 public:
+    // renewed whenever the image is replaced and unique across items, for caches of sampled values
+    uint64_t generation = new_generation();
+    static uint64_t new_generation(void);
     std::string name;
     bool image_ready = true;
     tipl::matrix<4,4,float> T,iT;// T: image->diffusion iT: diffusion->image
@@ -164,6 +169,22 @@ public:
     }
 };
 
+// shared by the subjects registered in one normalize_cohort run
+struct cohort_normalization{
+    std::mutex affine_mutex;
+    tipl::affine_transform<double> affine_sum;
+    unsigned int affine_count = 0;
+    float worst_cost = 0.0f;
+    bool get_mean_affine(tipl::affine_transform<double>& arg,float& max_cost);
+    void add_affine(const tipl::affine_transform<double>& arg,float cost);
+    // at most cdm_slots subjects run the nonlinear registration at once
+    std::mutex cdm_mutex;
+    std::condition_variable cdm_cv;
+    unsigned int cdm_slots = 1;
+    void acquire_cdm(void);
+    void release_cdm(void);
+};
+
 class TractModel;
 class fib_data
 {
@@ -188,6 +209,15 @@ public:
 public:
     int prog;
     tipl::image<tipl::vector<3,float>,3 > mni_position,inv_mni_position;
+private:
+    // one registration kept as coarse control-point displacements on the template grid,
+    // densified into mni_position / inv_mni_position on demand
+    static const unsigned int warp_factor = 3;
+    tipl::transformation_matrix<double> warp_T;
+    tipl::image<tipl::vector<3,float>,3 > warp_dis,warp_inv_dis;
+    bool load_warp(const std::string& file_name);
+    bool save_warp(const std::string& file_name) const;
+    void densify_mapping(bool inv);
 private:
     mutable tipl::image<tipl::vector<3,float>,3 > native_position;
 public:
@@ -219,7 +249,10 @@ public:
     void template_from_mni(tipl::vector<3>& p);
 
 public:
+    unsigned int normalization_thread_count = std::thread::hardware_concurrency();
+    std::shared_ptr<cohort_normalization> cohort;
     void run_normalization(bool background,bool inv);
+    void clear_normalization(void);
     bool can_map_to_mni(void);
     void mni2subject(tipl::vector<3>& pos);
     void subject2mni(tipl::vector<3>& pos);
@@ -227,6 +260,13 @@ public:
     void get_atlas_roi(std::shared_ptr<atlas> at,unsigned int roi_index,std::vector<tipl::vector<3,short> >& points);
     void get_atlas_all_roi(std::shared_ptr<atlas> at,std::vector<std::vector<tipl::vector<3,short> > >& points);
     const tipl::image<tipl::vector<3,float>,3 >& get_mni_mapping(void);
+public:
+    // atlas labels warped into subject space, keyed by atlas file name.
+    // ROI and connectivity code may ask for them from several threads.
+    std::map<std::string,std::shared_ptr<region_label_map> > atlas_label_cache;
+    std::mutex atlas_label_cache_mutex;
+    std::shared_ptr<region_label_map> get_atlas_label_map(std::shared_ptr<atlas> at);
+    uint32_t get_mni_mapping_checksum(void) const;
 public:
     fib_data(void)
     {
@@ -352,4 +392,7 @@ std::pair<float,float> evaluate_fib(
     return std::make_pair(connection_count,no_connection_count);
 }
 
+// register many subjects concurrently so that their warp files are ready for later use
+void normalize_cohort(const std::vector<std::string>& file_list,size_t template_id,unsigned int subject_count);
+
 #endif//FIB_DATA_HPP
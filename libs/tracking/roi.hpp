@@ -136,15 +136,23 @@ public:
         }
         return false;
     }
-    bool have_include(const float* track,unsigned int buffer_size) const
+    bool have_include_roi(const float* track,unsigned int buffer_size) const
     {
         for(unsigned int index = 0; index < inclusive.size(); ++index)
             if(!inclusive[index]->included(track,buffer_size))
                 return false;
+        return true;
+    }
+    bool match_atlas_track(const float* track,unsigned int buffer_size) const
+    {
         if(false_distance != 0.0f)
             return handle->find_nearest(track,buffer_size,false,false_distance) == track_id;
         return true;
     }
+    bool have_include(const float* track,unsigned int buffer_size) const
+    {
+        return have_include_roi(track,buffer_size) && match_atlas_track(track,buffer_size);
+    }
     bool setAtlas(unsigned int track_id_,float false_distance_)
     {
         if(!handle->load_track_atlas())
@@ -220,6 +228,10 @@ public:
                 seed.push_back(tipl::vector<3,short>(short(index.x()),short(index.y()),short(index.z())));
         setRegions(seed,1.0,3/*seed i*/,"whole brain");
     }
+    void setRegions(const ROIRegion& roi,unsigned char type,const char* roi_name)
+    {
+        setRegions(roi.get_region_voxels_raw(),roi.resolution_ratio,type,roi_name);
+    }
     void setRegions(const std::vector<tipl::vector<3,short> >& points,
                     float r,
                     unsigned char type,
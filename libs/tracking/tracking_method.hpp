@@ -138,6 +138,14 @@ struct TrackingParam
 };
 
 
+// reasons for a seed not producing a tract, counted by ThreadData
+enum track_reject_type{reject_seed = 0,reject_excluded,reject_too_long,reject_too_short,
+                       reject_no_include,reject_atlas,reject_end_region,reject_check_ending,
+                       reject_type_count};
+const char* const track_reject_name[reject_type_count] =
+    {"invalid seed","excluded","too long","too short",
+     "missing include region","atlas mismatch","failed end region","ended in white matter"};
+
 class TrackingMethod{
 private:
     std::shared_ptr<basic_interpolation> interpolation;
@@ -147,6 +155,7 @@ public:// Parameters
     tipl::vector<3,float> next_dir;
     bool terminated;
     bool forward;
+    unsigned char reject_reason = reject_seed;
 public:
     std::shared_ptr<tracking_data> trk;
     float current_fa_threshold;
@@ -213,9 +222,15 @@ public:
 		do
 		{
             if(get_buffer_size() > current_max_steps3 || buffer_back_pos + 3 >= track_buffer.size())
+            {
+                reject_reason = reject_too_long;
 				return false;
+            }
             if(roi_mgr->is_excluded_point(position))
+            {
+                reject_reason = reject_excluded;
 				return false;
+            }
             track_buffer[buffer_back_pos] = position[0];
             track_buffer[buffer_back_pos+1] = position[1];
             track_buffer[buffer_back_pos+2] = position[2];
@@ -238,21 +253,46 @@ public:
             track(*this);
 
             if(get_buffer_size() > current_max_steps3 || buffer_front_pos < 3)
-				return false;			
+            {
+                reject_reason = reject_too_long;
+				return false;
+            }
             if(terminated)
 				break;
 			buffer_front_pos -= 3;
             if(roi_mgr->is_excluded_point(position))
+            {
+                reject_reason = reject_excluded;
 				return false;
+            }
             track_buffer[buffer_front_pos] = position[0];
             track_buffer[buffer_front_pos+1] = position[1];
             track_buffer[buffer_front_pos+2] = position[2];
         }
         while(!roi_mgr->is_terminate_point(position));
 
-        return get_buffer_size() > current_min_steps3 &&
-               roi_mgr->have_include(get_result(),get_buffer_size()) &&
-               roi_mgr->fulfill_end_point(position,end_point1);
+        if(get_buffer_size() <= current_min_steps3)
+        {
+            reject_reason = reject_too_short;
+            return false;
+        }
+        const float* result = get_result();
+        if(!roi_mgr->have_include_roi(result,get_buffer_size()))
+        {
+            reject_reason = reject_no_include;
+            return false;
+        }
+        if(!roi_mgr->match_atlas_track(result,get_buffer_size()))
+        {
+            reject_reason = reject_atlas;
+            return false;
+        }
+        if(!roi_mgr->fulfill_end_point(position,end_point1))
+        {
+            reject_reason = reject_end_region;
+            return false;
+        }
+        return true;
 
 
 	}
@@ -3,7 +3,7 @@
 #endif
 #include "tracking_thread.hpp"
 #include "fib_data.hpp"
-void ThreadData::push_tracts(std::vector<std::vector<float> >& local_tract_buffer)
+void ThreadData::push_tracts(std::vector<std::vector<float> >& local_tract_buffer,std::vector<float>& local_weight)
 {
     std::lock_guard<std::mutex> lock(lock_feed_function);
     pushing_data = true;
@@ -12,9 +12,65 @@ void ThreadData::push_tracts(std::vector<std::vector<float> >& local_tract_buffe
         track_buffer.push_back(std::vector<float>());
         track_buffer.back().swap(local_tract_buffer[index]);
     }
+    track_weight.insert(track_weight.end(),local_weight.begin(),local_weight.end());
     local_tract_buffer.clear();
+    local_weight.clear();
     pushing_data = false;
 }
+void ThreadData::build_seed_alias(void)
+{
+    size_t n = seed_trial.size();
+    double total_trial = std::accumulate(seed_trial.begin(),seed_trial.end(),0.0);
+    double total_accept = std::accumulate(seed_accept.begin(),seed_accept.end(),0.0);
+    // a prior of 10 trials at the overall yield keeps rarely drawn seeds in play
+    const double prior_trial = 10.0;
+    double prior_accept = prior_trial*std::max(total_accept/std::max(total_trial,1.0),0.001);
+    std::vector<double> q(n);
+    double sum = 0.0;
+    for(size_t i = 0;i < n;++i)
+        sum += (q[i] = (seed_accept[i]+prior_accept)/(seed_trial[i]+prior_trial));
+    // mix with uniform seeding so that importance weights stay bounded by 10
+    for(size_t i = 0;i < n;++i)
+        q[i] = 0.9*q[i]/sum + 0.1/double(n);
+
+    // Vose's alias method
+    seed_weight.resize(n);
+    alias_prob.resize(n);
+    alias_index.resize(n);
+    std::vector<unsigned int> small,large;
+    for(size_t i = 0;i < n;++i)
+    {
+        seed_weight[i] = float(1.0/(double(n)*q[i]));
+        q[i] *= double(n);
+        alias_index[i] = uint32_t(i);
+        alias_prob[i] = 1.0f;
+        (q[i] < 1.0 ? small : large).push_back(uint32_t(i));
+    }
+    while(!small.empty() && !large.empty())
+    {
+        unsigned int s = small.back(),l = large.back();
+        small.pop_back();
+        alias_prob[s] = float(q[s]);
+        alias_index[s] = l;
+        q[l] -= 1.0-q[s];
+        if(q[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    seed_draw_since_build = 0;
+}
+unsigned int ThreadData::draw_adaptive_seed(float u1,float u2,float& weight)
+{
+    if(++seed_draw_since_build >= std::max<size_t>(4096,seed_trial.size()))
+        build_seed_alias();
+    unsigned int k = std::min<unsigned int>(uint32_t(u1*float(seed_trial.size())),uint32_t(seed_trial.size()-1));
+    unsigned int i = (u2 < alias_prob[k] ? k : alias_index[k]);
+    ++seed_trial[i];
+    weight = seed_weight[i];
+    return i;
+}
 void ThreadData::end_thread(void)
 {
     if (!threads.empty())
@@ -69,13 +125,17 @@ void ThreadData::run_thread(unsigned int thread_count,
     if(!roi_mgr->seeds.empty())
     try{
         std::vector<std::vector<float> > local_track_buffer;
+        std::vector<float> local_track_weight;
         while(!joinning &&
               !(param.stop_by_tract == 1 && tract_count[thread_id] >= end_count[thread_id]) &&
               !(param.stop_by_tract == 0 && seed_count[thread_id] >= end_count[thread_id]) &&
               !(param.max_seed_count > 0 && seed_count[thread_id] >= param.max_seed_count))
         {
+            if(max_track_buffer && local_track_buffer.size() >= 64)
+                while(!joinning && get_buffered_track_count() >= max_track_buffer)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
             if(!local_track_buffer.empty() && !pushing_data)
-                push_tracts(local_track_buffer);
+                push_tracts(local_track_buffer,local_track_weight);
             if(param.threshold == 0.0f)
             {
                 float w = threshold_gen(seed);
@@ -96,13 +156,39 @@ void ThreadData::run_thread(unsigned int thread_count,
                 method->current_min_steps3 = uint32_t(std::round(3.0f*param.min_length/step_size_in_mm));
             }
             ++seed_count[thread_id];
+            if(min_yield_seed_count && (seed_count[thread_id] & 255) == 0)
+            {
+                unsigned int total_seed_count = get_total_seed_count();
+                if(total_seed_count >= min_yield_seed_count &&
+                   float(get_total_tract_count()) < float(total_seed_count)*min_yield)
+                {
+                    low_yield = true;
+                    joinning = true;
+                    break;
+                }
+            }
+            unsigned int i;
+            float weight = 1.0f;
             {
                 // this ensure consistency
                 std::lock_guard<std::mutex> lock(lock_seed_function);
                 iteration+=thread_count;
-                unsigned int i = uint32_t(rand_gen(seed)*(float(roi_mgr->seeds.size())-1.0f));
+                if(param.center_seed == 2)
+                {
+                    float u1 = rand_gen(seed);
+                    float u2 = rand_gen(seed);
+                    i = draw_adaptive_seed(u1,u2,weight);
+                }
+                else
+                {
+                    i = uint32_t(rand_gen(seed)*(float(roi_mgr->seeds.size())-1.0f));
+                    if(seed_reweight != 0.0f)
+                        for(unsigned int retry = 0;retry < 8 &&
+                            rand_gen(seed)*(1.0f+seed_reweight*float(seed_fail_count[thread_id][i])) > 1.0f;++retry)
+                            i = uint32_t(rand_gen(seed)*(float(roi_mgr->seeds.size())-1.0f));
+                }
                 tipl::vector<3,float> pos(roi_mgr->seeds[i]);
-                if(!param.center_seed)
+                if(param.center_seed != 1)
                 {
                     pos[0] += rand_gen(seed);
                     pos[1] += rand_gen(seed);
@@ -112,24 +198,42 @@ void ThreadData::run_thread(unsigned int thread_count,
                 if(roi_mgr->seeds_r[i] != 1.0f)
                     pos /= roi_mgr->seeds_r[i];
                 if(!method->init(param.initial_direction,pos,seed))
+                {
+                    ++reject_count[thread_id][reject_seed];
                     continue;
+                }
             }
+            auto reject = [&](unsigned char reason)
+            {
+                ++reject_count[thread_id][reason];
+                if(seed_reweight != 0.0f && seed_fail_count[thread_id][i] < 255)
+                    ++seed_fail_count[thread_id][i];
+            };
             unsigned int point_count;
             const float *result = method->tracking(param.tracking_method,point_count);
             if(!result)
+            {
+                reject(method->reject_reason);
                 continue;
+            }
             const float* end = result+point_count+point_count+point_count;
             if(param.check_ending)
             {
                 if(point_count < 2)
+                {
+                    reject(reject_too_short);
                     continue;
+                }
                 if(result[2] > 0) // not the bottom slice
                 {
                     tipl::vector<3> p0(result),p1(result+3);
                     p1 -= p0;
                     p0 -= p1;
                     if(method->trk->is_white_matter(p0,white_matter_t))
+                    {
+                        reject(reject_check_ending);
                         continue;
+                    }
                 }
                 tipl::vector<3> p2(end-6),p3(end-3);
                 if(*(end-1) > 0) // not the bottom slice
@@ -137,20 +241,58 @@ void ThreadData::run_thread(unsigned int thread_count,
                     p2 -= p3;
                     p3 -= p2;
                     if(method->trk->is_white_matter(p3,white_matter_t))
+                    {
+                        reject(reject_check_ending);
                         continue;
+                    }
                 }
             }
 
+            if(param.center_seed == 2)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(lock_seed_function);
+                    ++seed_accept[i];
+                }
+                accepted_weight[thread_id] += double(weight);
+            }
             ++tract_count[thread_id];
             local_track_buffer.push_back(std::vector<float>(result,end));
+            local_track_weight.push_back(weight);
         }
-        push_tracts(local_track_buffer);
+        push_tracts(local_track_buffer,local_track_weight);
     }
     catch(...)
     {
 
     }
     running[thread_id] = 0;
+    if(on_finished && is_ended())
+        on_finished();
+}
+
+std::string ThreadData::get_yield_report(bool detail) const
+{
+    std::ostringstream out;
+    unsigned int total_seed_count = get_total_seed_count();
+    unsigned int total_tract_count = get_total_tract_count();
+    out << "seeds: " << total_seed_count << " tracts: " << total_tract_count
+        << " yield: " << (total_seed_count ? float(total_tract_count)/float(total_seed_count) : 0.0f) << std::endl;
+    if(low_yield)
+        out << "tracking stopped early due to low yield" << std::endl;
+    if(!detail)
+        return out.str();
+    for(unsigned char type = 0;type < reject_type_count;++type)
+        out << "rejected (" << track_reject_name[type] << "): " << get_total_reject_count(type) << std::endl;
+    for(size_t i = 0;i < seed_count.size();++i)
+        out << "thread " << i << " seeds: " << seed_count[i] << " tracts: " << tract_count[i] << std::endl;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+    if(seconds > 0.0)
+        out << "tracts per second: " << double(total_tract_count)/seconds << std::endl;
+    if(param.center_seed == 2 && total_seed_count)
+        out << "uniform-seeding yield estimated from importance weights: "
+            << std::accumulate(accepted_weight.begin(),accepted_weight.end(),0.0)/double(total_seed_count) << std::endl;
+    return out.str();
 }
 
 bool ThreadData::fetchTracks(TractModel* handle)
@@ -160,12 +302,27 @@ bool ThreadData::fetchTracks(TractModel* handle)
     if(handle->parameter_id.empty())
         handle->parameter_id = param.get_code();
     std::lock_guard<std::mutex> lock(lock_feed_function);
-    handle->add_tracts(track_buffer);
+    handle->add_tracts(track_buffer,track_weight);
     track_buffer.clear();
+    track_weight.clear();
     return true;
 
 }
 
+bool ThreadData::fetchTracks(std::vector<std::vector<float> >& tracts)
+{
+    std::lock_guard<std::mutex> lock(lock_feed_function);
+    if (track_buffer.empty())
+        return false;
+    if(tracts.empty())
+        tracts.swap(track_buffer);
+    else
+        std::move(track_buffer.begin(),track_buffer.end(),std::back_inserter(tracts));
+    track_buffer.clear();
+    track_weight.clear();
+    return true;
+}
+
 void ThreadData::apply_tip(TractModel* handle)
 {
     if (param.tip_iteration == 0 || handle->get_visible_track_count() == 0)
@@ -222,10 +379,16 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
     }
     report << roi_mgr->report;
     report << param.get_report();
+    if(param.center_seed == 2)
+        report << " Seeds were importance-sampled by the acceptance rate of each seeding voxel, and each tract was weighted by the inverse of its seeding probability relative to uniform seeding in the track density and connectivity counts.";
+    else
+    if(seed_reweight != 0.0f)
+        report << " A seeding voxel that had failed n times to produce a tract was kept with a probability of 1/(1+" << seed_reweight
+               << "n) and otherwise redrawn up to 8 times, with failures counted separately by each tracking thread.";
     // to ensure consistency, seed initialization with all orientation only fits with single thread
     if(param.initial_direction == 2)
         thread_count = 1;
-    if(param.center_seed)
+    if(param.center_seed == 1)
         std::shuffle(roi_mgr->seeds.begin(),roi_mgr->seeds.end(),std::mt19937(0));
 
     end_thread();
@@ -246,6 +409,21 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
         tract_count.resize(thread_count);
         end_count.resize(thread_count);
         running.resize(thread_count);
+        reject_count.clear();
+        reject_count.resize(thread_count,std::vector<unsigned int>(reject_type_count));
+        seed_fail_count.clear();
+        if(seed_reweight != 0.0f)
+            seed_fail_count.resize(thread_count,std::vector<unsigned char>(roi_mgr->seeds.size()));
+        accepted_weight.clear();
+        accepted_weight.resize(thread_count);
+        if(param.center_seed == 2)
+        {
+            seed_trial.clear();
+            seed_accept.clear();
+            seed_trial.resize(roi_mgr->seeds.size());
+            seed_accept.resize(roi_mgr->seeds.size());
+            build_seed_alias();
+        }
 
         std::fill(running.begin(),running.end(),1);
 
@@ -256,6 +434,8 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
 
     joinning = false;
     pushing_data = false;
+    low_yield = false;
+    start_time = std::chrono::steady_clock::now();
     seed = std::mt19937(param.random_seed ? std::random_device()():0);
     for (unsigned int index = 0;index < thread_count-1;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
@@ -4,6 +4,8 @@
 #include <ctime>
 #include <random>
 #include <memory>
+#include <chrono>
+#include <functional>
 
 #include "roi.hpp"
 #include "tracking_method.hpp"
@@ -37,7 +39,10 @@ public:
     std::vector<unsigned int> tract_count;
     std::vector<unsigned int> end_count;
     std::vector<unsigned char> running;
+    std::vector<std::vector<unsigned int> > reject_count; // [thread][track_reject_type]
     std::mutex  lock_feed_function,lock_seed_function;
+    // called by the last tracking thread to exit
+    std::function<void(void)> on_finished;
     unsigned int get_total_seed_count(void)const
     {
         if(seed_count.empty())
@@ -50,6 +55,15 @@ public:
             return 0;
         return std::accumulate(tract_count.begin(),tract_count.end(),0);
     }
+    unsigned int get_total_reject_count(unsigned char type) const
+    {
+        unsigned int sum = 0;
+        for(const auto& count : reject_count)
+            sum += count[type];
+        return sum;
+    }
+    // seed and tract counts, plus rejection reasons and per-thread counts if detail is set
+    std::string get_yield_report(bool detail = false) const;
     bool is_ended(void)
     {
         if(running.empty())
@@ -57,14 +71,45 @@ public:
         return std::find(running.begin(),running.end(),1) == running.end();
     }
 
+public:
+    // yield monitor: stop all threads once min_yield_seed_count seeds are placed
+    // and fewer than min_yield tracts per seed are accepted (0 disables)
+    unsigned int min_yield_seed_count = 0;
+    float min_yield = 0.0f;
+    bool low_yield = false;
+    // seeds that keep failing are drawn with probability 1/(1+seed_reweight*failures) (0 disables).
+    // failures are counted per thread so that a thread's draws do not depend on the others
+    float seed_reweight = 0.0f;
+    std::vector<std::vector<unsigned char> > seed_fail_count;
+public:
+    // adaptive seeding (param.center_seed == 2): seeds are drawn from an alias table
+    // weighted by their observed acceptance, and each tract carries the importance
+    // weight 1/(N*q) into TractModel so that weighted counts match uniform seeding
+    std::vector<unsigned int> seed_trial,seed_accept;
+    std::vector<float> seed_weight,alias_prob;
+    std::vector<unsigned int> alias_index;
+    size_t seed_draw_since_build = 0;
+    std::vector<double> accepted_weight;   // per thread
+    void build_seed_alias(void);
+    unsigned int draw_adaptive_seed(float u1,float u2,float& weight);
+    std::chrono::steady_clock::time_point start_time;
 public:
     std::vector<std::vector<float> > track_buffer;
-    void push_tracts(std::vector<std::vector<float> >& local_tract_buffer);
+    std::vector<float> track_weight; // weights of the tracts in track_buffer
+    void push_tracts(std::vector<std::vector<float> >& local_tract_buffer,std::vector<float>& local_weight);
     void end_thread(void);
 
 public:
     void run_thread(unsigned int thread_count,unsigned int thread_id);
     bool fetchTracks(TractModel* handle);
+    bool fetchTracks(std::vector<std::vector<float> >& tracts);
+    // tracking threads wait once this many tracts are waiting to be fetched (0 disables)
+    size_t max_track_buffer = 0;
+    size_t get_buffered_track_count(void)
+    {
+        std::lock_guard<std::mutex> lock(lock_feed_function);
+        return track_buffer.size();
+    }
     void apply_tip(TractModel* handle);
     void run(std::shared_ptr<tracking_data> trk,unsigned int thread_count,bool wait);
     void run(unsigned int thread_count,bool wait);
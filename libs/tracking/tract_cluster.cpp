@@ -1,4 +1,5 @@
 #include <set>
+#include <limits>
 #include "tract_cluster.hpp"
 #include "tipl/tipl.hpp"
 
@@ -35,15 +36,6 @@ TractCluster::TractCluster(const float* param):error_distance(param[3])
 
 }
 
-void TractCluster::set_tract_labels(Cluster* from,Cluster* to)
-{
-    std::vector<unsigned int>::const_iterator iter = from->tracts.begin();
-    std::vector<unsigned int>::const_iterator end = from->tracts.end();
-    for (;iter != end;++iter)
-        tract_labels[*iter] = to;
-
-}
-
 int TractCluster::get_index(short x,short y,short z)
 {
     int index = z;
@@ -53,72 +45,46 @@ int TractCluster::get_index(short x,short y,short z)
     index += x;
     return index;
 }
-/**
-prerequite:
-    tract_index1 > tract_index2
-*/
-void TractCluster::merge_tract(unsigned int tract_index1,unsigned int tract_index2)
+unsigned int TractCluster::find_root(unsigned int tract_index)
 {
-    if (tract_index1 == tract_index2)
-        return;
-    std::lock_guard<std::mutex> lock(lock_merge);
-    Cluster* cluster_index = tract_labels[tract_index1];
-    if (cluster_index == 0) // no cluster
+    while(true)
     {
-        cluster_index = tract_labels[tract_index2];
-        if (cluster_index == 0) // create a cluster for both
-        {
-            std::shared_ptr<Cluster> new_cluster_index(new Cluster);
-            new_cluster_index->index = clusters.size();
-            clusters.push_back(new_cluster_index);
-
-            new_cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = new_cluster_index.get();
-            new_cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = new_cluster_index.get();
-            return;
-        }
-        else
-        {
-            cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = cluster_index;
-            return;
-        }
+        unsigned int parent = tract_parent[tract_index];
+        if(parent == tract_index)
+            return tract_index;
+        unsigned int grand_parent = tract_parent[parent];
+        // path halving: a failed exchange only means another thread already changed the link
+        if(parent != grand_parent)
+            tract_parent[tract_index].compare_exchange_weak(parent,grand_parent);
+        tract_index = grand_parent;
     }
-    else
+}
+
+void TractCluster::merge_tract(unsigned int tract_index1,unsigned int tract_index2)
+{
+    while(true)
     {
-        Cluster* another_cluster_index = tract_labels[tract_index2];
-        if (another_cluster_index == 0) // add tract2 to the cluster
-        {
-            cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = cluster_index;
+        tract_index1 = find_root(tract_index1);
+        tract_index2 = find_root(tract_index2);
+        if (tract_index1 == tract_index2)
             return;
-        }
-        if (another_cluster_index == cluster_index) // already in the same group
+        if (tract_index1 < tract_index2)
+            std::swap(tract_index1,tract_index2);
+        // tract_index1 may have been linked by another thread, in which case retry
+        unsigned int root = tract_index1;
+        if(tract_parent[tract_index1].compare_exchange_strong(root,tract_index2))
             return;
-        // merge two clusters
-        if (another_cluster_index->tracts.size() > cluster_index->tracts.size())
-            std::swap(cluster_index,another_cluster_index);
-
-        cluster_index->tracts.resize(another_cluster_index->tracts.size()+cluster_index->tracts.size());
-        std::copy(another_cluster_index->tracts.begin(),another_cluster_index->tracts.end(),
-                  cluster_index->tracts.end()-another_cluster_index->tracts.size());
-
-        set_tract_labels(another_cluster_index,cluster_index);
-        clusters.back()->index = another_cluster_index->index;
-        clusters[another_cluster_index->index] = clusters.back();
-        clusters.pop_back();
-
     }
 }
 
 void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
 {
-    tract_labels.clear();
     tract_mid_voxels.clear();
     tract_end1.clear();
     tract_end2.clear();
-    tract_labels.resize(tracks.size());
+    std::vector<std::atomic<unsigned int> >(tracks.size()).swap(tract_parent);
+    for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+        tract_parent[tract_index] = tract_index;
     tract_length.resize(tracks.size());
     tract_mid_voxels.resize(tracks.size());
     tract_end1.resize(tracks.size());
@@ -176,9 +142,7 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
             unsigned int cur_index = passing_tracts[i];
             if(cur_index <= tract_index)
                 continue;
-            Cluster* label1 = tract_labels[tract_index];
-            Cluster* label2 = tract_labels[cur_index];
-            if (label1 != nullptr && label1 == label2)
+            if (find_root(tract_index) == find_root(cur_index))
                 continue;
 
             if(std::fabs(tract_end1[tract_index][0]-tract_end1[cur_index][0]) > error_distance ||
@@ -191,3 +155,157 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         }
     });
 }
+
+void TractCluster::run_clustering(void)
+{
+    // tracts merged with at least one other tract form a cluster
+    std::vector<unsigned int> root_cluster(tract_parent.size(),0);
+    for(unsigned int tract_index = 0;tract_index < tract_parent.size();++tract_index)
+        ++root_cluster[find_root(tract_index)];
+    clusters.clear();
+    for(unsigned int tract_index = 0;tract_index < tract_parent.size();++tract_index)
+        if(root_cluster[tract_index] > 1)
+        {
+            auto new_cluster = std::make_shared<Cluster>();
+            new_cluster->tracts.reserve(root_cluster[tract_index]);
+            root_cluster[tract_index] = uint32_t(clusters.size());
+            clusters.push_back(new_cluster);
+        }
+        else
+            root_cluster[tract_index] = std::numeric_limits<unsigned int>::max();
+    for(unsigned int tract_index = 0;tract_index < tract_parent.size();++tract_index)
+    {
+        unsigned int cluster_index = root_cluster[find_root(tract_index)];
+        if(cluster_index != std::numeric_limits<unsigned int>::max())
+            clusters[cluster_index]->tracts.push_back(tract_index);
+    }
+    sort_cluster();
+}
+
+// resample a tract into point_count points evenly spaced along its length
+static void resample_tract(const std::vector<float>& track,float* feature)
+{
+    const unsigned int point_count = QuickBundleCluster::point_count;
+    size_t n = track.size()/3;
+    std::vector<float> length(n);
+    for(size_t i = 1;i < n;++i)
+        length[i] = length[i-1] + float((tipl::vector<3>(&track[i*3])-tipl::vector<3>(&track[i*3-3])).length());
+    for(unsigned int k = 0,j = 0;k < point_count;++k,feature += 3)
+    {
+        float target = length.back()*float(k)/float(point_count-1);
+        while(j+1 < n-1 && length[j+1] < target)
+            ++j;
+        if(j+1 >= n)
+        {
+            std::copy(&track[j*3],&track[j*3]+3,feature);
+            continue;
+        }
+        float seg = length[j+1]-length[j];
+        float w = seg > 0.0f ? std::min<float>(1.0f,std::max<float>(0.0f,(target-length[j])/seg)) : 0.0f;
+        for(unsigned int d = 0;d < 3;++d)
+            feature[d] = track[j*3+d]*(1.0f-w)+track[j*3+3+d]*w;
+    }
+}
+
+// the centroid of the resampled points moves no more than the MDF distance,
+// so clusters within threshold are always found in the neighboring cells.
+int64_t QuickBundleCluster::get_cell(const float* centroid) const
+{
+    float center[3] = {0.0f,0.0f,0.0f};
+    for(unsigned int k = 0;k < point_count;++k,centroid += 3)
+        for(unsigned int d = 0;d < 3;++d)
+            center[d] += centroid[d];
+    int64_t cell = 0;
+    for(unsigned int d = 0;d < 3;++d)
+        cell = (cell << 21) + int64_t(std::floor(center[d]/float(point_count)/threshold)) + (int64_t(1) << 20);
+    return cell;
+}
+
+void QuickBundleCluster::add_tract(unsigned int tract_index,const float* feature)
+{
+    const unsigned int size = point_count*3;
+    int64_t cell = get_cell(feature);
+    float max_sum = threshold*float(point_count);
+    float best_sum = max_sum;
+    unsigned int best_cluster = 0;
+    bool best_flip = false,found = false;
+    for(int64_t dz = -1;dz <= 1;++dz)
+        for(int64_t dy = -1;dy <= 1;++dy)
+            for(int64_t dx = -1;dx <= 1;++dx)
+            {
+                auto iter = grid.find(cell + dz*(int64_t(1) << 42) + dy*(int64_t(1) << 21) + dx);
+                if(iter == grid.end())
+                    continue;
+                for(unsigned int cluster_index : iter->second)
+                {
+                    const float* c = &centroids[size_t(cluster_index)*size];
+                    float direct = 0.0f,flip = 0.0f;
+                    for(unsigned int k = 0;k < point_count && (direct < best_sum || flip < best_sum);++k)
+                    {
+                        const float* p = feature+k*3;
+                        const float* q = c+(point_count-1-k)*3;
+                        direct += std::sqrt((p[0]-c[k*3])*(p[0]-c[k*3])+(p[1]-c[k*3+1])*(p[1]-c[k*3+1])+(p[2]-c[k*3+2])*(p[2]-c[k*3+2]));
+                        flip += std::sqrt((p[0]-q[0])*(p[0]-q[0])+(p[1]-q[1])*(p[1]-q[1])+(p[2]-q[2])*(p[2]-q[2]));
+                    }
+                    if(std::min(direct,flip) < best_sum)
+                    {
+                        best_sum = std::min(direct,flip);
+                        best_cluster = cluster_index;
+                        best_flip = flip < direct;
+                        found = true;
+                    }
+                }
+            }
+    if(!found)
+    {
+        best_cluster = uint32_t(clusters.size());
+        clusters.push_back(std::make_shared<Cluster>());
+        centroids.insert(centroids.end(),feature,feature+size);
+        centroid_cell.push_back(cell);
+        grid[cell].push_back(best_cluster);
+        clusters.back()->tracts.push_back(tract_index);
+        return;
+    }
+    // update the running mean of the cluster centroid
+    auto& tracts = clusters[best_cluster]->tracts;
+    tracts.push_back(tract_index);
+    float* c = &centroids[size_t(best_cluster)*size];
+    float w = 1.0f/float(tracts.size());
+    for(unsigned int k = 0;k < point_count;++k)
+    {
+        const float* p = feature+(best_flip ? point_count-1-k : k)*3;
+        for(unsigned int d = 0;d < 3;++d)
+            c[k*3+d] += (p[d]-c[k*3+d])*w;
+    }
+    int64_t new_cell = get_cell(c);
+    if(new_cell != centroid_cell[best_cluster])
+    {
+        auto& old_list = grid[centroid_cell[best_cluster]];
+        old_list.erase(std::find(old_list.begin(),old_list.end(),best_cluster));
+        grid[new_cell].push_back(best_cluster);
+        centroid_cell[best_cluster] = new_cell;
+    }
+}
+
+void QuickBundleCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
+{
+    const size_t block_size = 65536;
+    const unsigned int size = point_count*3;
+    std::vector<float> features;
+    // tracts are resampled in parallel one block at a time and then assigned in order
+    for(size_t from = 0;from < tracks.size();from += block_size)
+    {
+        size_t to = std::min(from+block_size,tracks.size());
+        features.resize((to-from)*size);
+        tipl::par_for(to-from,[&](size_t i)
+        {
+            if(!tracks[from+i].empty())
+                resample_tract(tracks[from+i],&features[i*size]);
+        });
+        for(size_t i = 0;i < to-from;++i)
+            if(!tracks[from+i].empty())
+                add_tract(uint32_t(from+i),&features[i*size]);
+    }
+    for (unsigned int index = 0;index < clusters.size();++index)
+        clusters[index]->index = index;
+}
@@ -1,6 +1,8 @@
 #ifndef TRACT_CLUSTER_HPP
 #define TRACT_CLUSTER_HPP
 #include <vector>
+#include <atomic>
+#include <unordered_map>
 #include "tipl/tipl.hpp"
 #include <map>
 
@@ -36,7 +38,7 @@ template<class method_type>
 class FeatureBasedClutering : public BasicCluster
 {
     std::vector<std::vector<double> > features;
-    std::vector<unsigned char> classifications;
+    std::vector<unsigned int> classifications;
     mutable std::vector<unsigned int> result;
     method_type clustering_method;
     unsigned int cluster_number;
@@ -66,12 +68,12 @@ public:
     {
         classifications.resize(features.size());
         clustering_method(features.begin(),features.end(),10,classifications.begin());
-        std::map<unsigned char,std::vector<unsigned int> > cluster_map;
+        std::map<unsigned int,std::vector<unsigned int> > cluster_map;
         for (unsigned int index = 0;index < classifications.size();++index)
             cluster_map[classifications[index]].push_back(index);
 		clusters.resize(cluster_map.size());
-                std::map<unsigned char,std::vector<unsigned int> >::iterator iter = cluster_map.begin();
-                std::map<unsigned char,std::vector<unsigned int> >::iterator end = cluster_map.end();
+                std::map<unsigned int,std::vector<unsigned int> >::iterator iter = cluster_map.begin();
+                std::map<unsigned int,std::vector<unsigned int> >::iterator end = cluster_map.end();
                 for(unsigned int index = 0;iter != end;++iter,++index)
 		{
             clusters[index] = std::make_shared<Cluster>();
@@ -90,17 +92,16 @@ class TractCluster : public BasicCluster
     tipl::geometry<3> dim;
     unsigned int w,wh;
     float error_distance;
-    std::mutex  lock_merge;
 private:
-
-
-    void set_tract_labels(Cluster* from,Cluster* to);
+    // lock-free disjoint set: roots point to themselves and are always linked
+    // under a root with a smaller index, so concurrent merges cannot form a cycle
+    std::vector<std::atomic<unsigned int> > tract_parent;
+    unsigned int find_root(unsigned int tract_index);
     void merge_tract(unsigned int tract_index1,unsigned int tract_index2);
     int get_index(short x,short y,short z);
 private:
     std::vector<std::vector<unsigned int> > voxel_connection;
 private:
-    std::vector<Cluster*> tract_labels;// 0 is no cluster
     std::vector<unsigned int> tract_mid_voxels;
     std::vector<tipl::vector<3> > tract_end1;
     std::vector<tipl::vector<3> > tract_end2;
@@ -111,10 +112,29 @@ private:
 public:
     TractCluster(const float* param);
     void add_tracts(const std::vector<std::vector<float> >& tracks);
-	void run_clustering(void){sort_cluster();}
+    void run_clustering(void);
 
 };
 
+// QuickBundles: tracts are streamed once and assigned to the nearest centroid
+// by the minimum average direct-flip distance (MDF) of resampled points.
+class QuickBundleCluster : public BasicCluster
+{
+public:
+    static const unsigned int point_count = 12;
+private:
+    float threshold;
+    std::vector<float> centroids; // point_count*3 per cluster
+    std::vector<int64_t> centroid_cell;
+    std::unordered_map<int64_t,std::vector<unsigned int> > grid;
+    int64_t get_cell(const float* centroid) const;
+    void add_tract(unsigned int tract_index,const float* feature);
+public:
+    QuickBundleCluster(const float* param):threshold(param[3]){}
+    void add_tracts(const std::vector<std::vector<float> >& tracks);
+    void run_clustering(void){sort_cluster();}
+};
+
 
 
 
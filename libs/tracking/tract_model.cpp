@@ -1,15 +1,22 @@
 //---------------------------------------------------------------------------
 #include <QString>
 #include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QStandardPaths>
+#include <QCryptographicHash>
 #include <QImage>
 #include <fstream>
+#include <atomic>
 #include <filesystem>
 #include <sstream>
+#include <iomanip>
 #include <iterator>
 #include <tuple>
 #include <set>
 #include <map>
 #include <cmath>
+#include <cstring>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -23,6 +30,7 @@
 void prepare_idx(const char* file_name,std::shared_ptr<gz_istream> in);
 void save_idx(const char* file_name,std::shared_ptr<gz_istream> in);
 const tipl::rgb default_tract_color(255,160,60);
+bool TractModel::save_chunked_tt = false;
 void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothed)
 {
     smoothed.clear();
@@ -46,22 +54,391 @@ void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothe
     }
 }
 
+union tract_header{
+    char buf[16];
+    struct {
+    uint32_t count; // number of coordinates
+    int32_t x; // first coordinate (x*32,y*32,z*32)
+    int32_t y;
+    int32_t z;
+    } h;
+};
+// size of a compressed tract record starting at rec
+inline size_t tt_record_size(const char* rec)
+{
+    return *reinterpret_cast<const uint32_t*>(rec)+sizeof(tract_header)-3;
+}
+// expand a compressed tract record, buf_size is the size of the buffer holding it
+inline void tt_decode(const char* rec,size_t buf_size,std::vector<float>& cur_tract)
+{
+    tract_header hr;
+    std::copy(rec,rec+16,hr.buf);
+    if(hr.h.count > buf_size)
+        return;
+    cur_tract.resize(hr.h.count);
+    cur_tract[0] = hr.h.x;
+    cur_tract[1] = hr.h.y;
+    cur_tract[2] = hr.h.z;
+    rec += sizeof(tract_header)-3;
+    for(size_t j = 3;j < cur_tract.size();++j)
+        cur_tract[j] = (cur_tract[j-3] + rec[j]);
+    for(size_t j = 0;j < cur_tract.size();++j)
+        cur_tract[j] = std::ldexp(cur_tract[j],-5);
+}
+
+/* Chunked .tt.gz: a concatenation of gzip members, so the file is still a valid gzip stream.
+ * member 0: header (marked by a "TT" extra field), dimension, voxel size, color, report, parameter id
+ * member 1..n: blocks of compressed tract records, each deflated independently
+ * member n+1: block directory (offset, compressed size, raw size, tract count per block) and cluster
+ * last member: 34 bytes, empty, with the directory offset in its extra field
+ */
+static const size_t tt_chunk_size = 4194304; // 4mb of tract records per block
+static const unsigned int tt_chunk_version = 1;
+static const size_t tt_eof_size = 34;
+static bool deflate_member(const char* buf,size_t size,std::vector<char>& out,const unsigned char* extra = nullptr,unsigned int extra_len = 0)
+{
+    z_stream strm;
+    strm.zalloc = nullptr;
+    strm.zfree = nullptr;
+    strm.opaque = nullptr;
+    if(deflateInit2(&strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    gz_header h;
+    std::memset(&h,0,sizeof(h));
+    h.os = 255;
+    h.extra = const_cast<unsigned char*>(extra);
+    h.extra_len = extra_len;
+    if(extra)
+        deflateSetHeader(&strm,&h);
+    out.resize(deflateBound(&strm,uLong(size))+extra_len+64);
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+    strm.avail_in = uInt(size);
+    strm.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    strm.avail_out = uInt(out.size());
+    int ret = deflate(&strm,Z_FINISH);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END;
+}
+// out can be presized to the expected output size
+static bool inflate_member(const char* buf,size_t size,std::vector<char>& out)
+{
+    z_stream strm;
+    strm.zalloc = nullptr;
+    strm.zfree = nullptr;
+    strm.opaque = nullptr;
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+    strm.avail_in = uInt(size);
+    if(inflateInit2(&strm,31) != Z_OK)
+        return false;
+    if(out.empty())
+        out.resize(size*4+1024);
+    int ret = Z_OK;
+    while(ret == Z_OK)
+    {
+        if(size_t(strm.total_out) == out.size())
+            out.resize(out.size()*2);
+        strm.next_out = reinterpret_cast<Bytef*>(&out[strm.total_out]);
+        strm.avail_out = uInt(out.size()-strm.total_out);
+        ret = inflate(&strm,Z_NO_FLUSH);
+    }
+    out.resize(strm.total_out);
+    inflateEnd(&strm);
+    return ret == Z_STREAM_END;
+}
+template<typename T>
+void tt_append(std::vector<char>& buf,T value)
+{
+    buf.insert(buf.end(),reinterpret_cast<const char*>(&value),reinterpret_cast<const char*>(&value)+sizeof(T));
+}
+static void tt_append(std::vector<char>& buf,const std::string& str)
+{
+    tt_append(buf,uint32_t(str.length()));
+    buf.insert(buf.end(),str.begin(),str.end());
+}
+template<typename T>
+bool tt_parse(const char*& pos,const char* end,T& value)
+{
+    if(end-pos < int64_t(sizeof(T)))
+        return false;
+    std::memcpy(&value,pos,sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+static bool tt_parse(const char*& pos,const char* end,std::string& str)
+{
+    uint32_t length = 0;
+    if(!tt_parse(pos,end,length) || end-pos < int64_t(length))
+        return false;
+    str = std::string(pos,pos+length);
+    pos += length;
+    return true;
+}
+
+bool ChunkedTTWriter::open(const char* file_name,const tipl::geometry<3>& geo,const tipl::vector<3>& vs,
+                           const std::string& report,const std::string& parameter_id,unsigned int color)
+{
+    out.open(file_name,std::ios::binary);
+    if(!out)
+        return false;
+    std::string idx_name(file_name);
+    idx_name += ".idx";
+    if(std::filesystem::exists(idx_name))
+        std::filesystem::remove(idx_name);
+    std::vector<char> header;
+    for(unsigned int d = 0;d < 3;++d)
+        tt_append(header,int32_t(geo[d]));
+    for(unsigned int d = 0;d < 3;++d)
+        tt_append(header,float(vs[d]));
+    tt_append(header,uint32_t(color));
+    tt_append(header,report);
+    tt_append(header,parameter_id);
+    const unsigned char extra[8] = {'T','T',4,0,tt_chunk_version,0,0,0};
+    std::vector<char> member;
+    if(!deflate_member(&header[0],header.size(),member,extra,sizeof(extra)))
+        return false;
+    out.write(&member[0],std::streamsize(member.size()));
+    pos = member.size();
+    dir.clear();
+    return !!out;
+}
+bool ChunkedTTWriter::add_chunks(const char* buf,const std::vector<size_t>& bound,const std::vector<size_t>& count)
+{
+    std::vector<std::vector<char> > member(count.size());
+    std::vector<char> ok(count.size());
+    tipl::par_for(count.size(),[&](size_t i)
+    {
+        ok[i] = deflate_member(buf+bound[i],bound[i+1]-bound[i],member[i]);
+    });
+    for(size_t i = 0;i < count.size();++i)
+    {
+        if(!ok[i])
+            return false;
+        dir.push_back(pos);
+        dir.push_back(member[i].size());
+        dir.push_back(bound[i+1]-bound[i]);
+        dir.push_back(count[i]);
+        out.write(&member[i][0],std::streamsize(member[i].size()));
+        pos += member[i].size();
+    }
+    return !!out;
+}
+bool ChunkedTTWriter::close(const std::vector<uint16_t>& cluster)
+{
+    if(!out.is_open())
+        return false;
+    std::vector<char> directory;
+    tt_append(directory,uint64_t(dir.size()/4));
+    for(auto v : dir)
+        tt_append(directory,v);
+    tt_append(directory,uint64_t(cluster.size()));
+    for(auto c : cluster)
+        tt_append(directory,c);
+    std::vector<char> member;
+    if(!deflate_member(&directory[0],directory.size(),member))
+        return false;
+    out.write(&member[0],std::streamsize(member.size()));
+    // empty gzip member carrying the directory offset
+    unsigned char eof[tt_eof_size] = {0x1f,0x8b,8,4,0,0,0,0,0,255,12,0,'T','T',8,0};
+    uint64_t dir_pos = pos;
+    std::memcpy(eof+16,&dir_pos,sizeof(dir_pos));
+    eof[24] = 3; // empty deflate block, followed by zero crc32 and size
+    out.write(reinterpret_cast<const char*>(eof),tt_eof_size);
+    bool result = !!out;
+    out.close();
+    return result;
+}
+
+bool ChunkedTTReader::is_chunked(const char* file_name)
+{
+    std::ifstream in(file_name,std::ios::binary);
+    unsigned char buf[14];
+    if(!in.read(reinterpret_cast<char*>(buf),sizeof(buf)))
+        return false;
+    return buf[0] == 0x1f && buf[1] == 0x8b && (buf[3] & 4) && buf[12] == 'T' && buf[13] == 'T';
+}
+bool ChunkedTTReader::open(const char* file_name)
+{
+    in.open(file_name,std::ios::binary);
+    if(!in)
+        return false;
+    in.seekg(0,std::ios::end);
+    uint64_t file_size = uint64_t(in.tellg());
+    if(file_size < tt_eof_size)
+        return false;
+    unsigned char eof[tt_eof_size];
+    in.seekg(int64_t(file_size-tt_eof_size),std::ios::beg);
+    in.read(reinterpret_cast<char*>(eof),tt_eof_size);
+    if(!in || eof[12] != 'T' || eof[13] != 'T')
+        return false;
+    uint64_t dir_pos = 0;
+    std::memcpy(&dir_pos,eof+16,sizeof(dir_pos));
+    if(dir_pos >= file_size-tt_eof_size)
+        return false;
+
+    std::vector<char> buf,directory;
+    if(!read_member(dir_pos,file_size-tt_eof_size-dir_pos,buf) ||
+       !inflate_member(&buf[0],buf.size(),directory))
+        return false;
+    const char* pos = &directory[0];
+    const char* end = pos+directory.size();
+    uint64_t block_count = 0,cluster_count = 0;
+    if(!tt_parse(pos,end,block_count) || uint64_t(end-pos) < block_count*4*sizeof(uint64_t))
+        return false;
+    dir.resize(block_count*4);
+    for(auto& v : dir)
+        tt_parse(pos,end,v);
+    if(!tt_parse(pos,end,cluster_count) || uint64_t(end-pos) < cluster_count*sizeof(uint16_t))
+        return false;
+    cluster.resize(cluster_count);
+    for(auto& c : cluster)
+        tt_parse(pos,end,c);
+    first_track.resize(block_count+1);
+    first_track[0] = 0;
+    for(size_t i = 0;i < block_count;++i)
+        first_track[i+1] = first_track[i]+dir[i*4+3];
+
+    std::vector<char> header;
+    if(!read_member(0,block_count ? dir[0] : dir_pos,buf) ||
+       !inflate_member(&buf[0],buf.size(),header))
+        return false;
+    pos = &header[0];
+    end = pos+header.size();
+    int32_t dim[3];
+    float voxel_size[3];
+    uint32_t c;
+    for(unsigned int d = 0;d < 3;++d)
+        if(!tt_parse(pos,end,dim[d]))
+            return false;
+    for(unsigned int d = 0;d < 3;++d)
+        if(!tt_parse(pos,end,voxel_size[d]))
+            return false;
+    if(!tt_parse(pos,end,c) || !tt_parse(pos,end,report) || !tt_parse(pos,end,parameter_id))
+        return false;
+    geo = tipl::geometry<3>(dim[0],dim[1],dim[2]);
+    vs = tipl::vector<3>(voxel_size[0],voxel_size[1],voxel_size[2]);
+    color = c;
+    return true;
+}
+bool ChunkedTTReader::read_member(uint64_t offset,uint64_t size,std::vector<char>& buf)
+{
+    buf.resize(size);
+    if(!size)
+        return false;
+    in.clear();
+    in.seekg(int64_t(offset),std::ios::beg);
+    return !!in.read(&buf[0],std::streamsize(size));
+}
+bool ChunkedTTReader::read_blocks(size_t from,size_t to,std::vector<std::vector<float> >& tracts)
+{
+    tracts.clear();
+    if(from >= to || to > block_count())
+        return from == to;
+    std::vector<char> buf;
+    uint64_t offset = dir[from*4];
+    if(!read_member(offset,dir[(to-1)*4]+dir[(to-1)*4+1]-offset,buf))
+        return false;
+    tracts.resize(first_track[to]-first_track[from]);
+    std::vector<char> ok(to-from);
+    tipl::par_for(to-from,[&](size_t i)
+    {
+        size_t b = from+i;
+        std::vector<char> raw(dir[b*4+2]);
+        if(!inflate_member(&buf[dir[b*4]-offset],dir[b*4+1],raw) || raw.size() != dir[b*4+2])
+            return;
+        auto cur_tract = tracts.begin()+int64_t(first_track[b]-first_track[from]);
+        for(size_t pos = 0,k = 0;pos+sizeof(tract_header) <= raw.size() && k < dir[b*4+3];pos += tt_record_size(&raw[pos]),++k,++cur_tract)
+            tt_decode(&raw[pos],raw.size(),*cur_tract);
+        ok[i] = 1;
+    });
+    return std::find(ok.begin(),ok.end(),0) == ok.end();
+}
+bool ChunkedTTReader::read_tracts(size_t from,size_t count,std::vector<std::vector<float> >& tracts)
+{
+    tracts.clear();
+    size_t to = std::min<size_t>(from+count,track_count());
+    if(from >= to)
+        return true;
+    size_t from_block = size_t(std::upper_bound(first_track.begin(),first_track.end(),from)-first_track.begin())-1;
+    size_t to_block = size_t(std::lower_bound(first_track.begin(),first_track.end(),to)-first_track.begin());
+    if(!read_blocks(from_block,to_block,tracts))
+        return false;
+    size_t shift = from-first_track[from_block];
+    tracts.erase(tracts.begin()+int64_t(shift+to-from),tracts.end());
+    tracts.erase(tracts.begin(),tracts.begin()+int64_t(shift));
+    return true;
+}
+
 /* 1. spatial resolution of 1/32 voxel spacing.
  * 2. step size between (-127/32 to 128/32) voxels for x,y,z, direction
  */
 class TinyTrack{
 
-    union tract_header{
-        char buf[16];
-        struct {
-        uint32_t count; // number of coordinates
-        int32_t x; // first coordinate (x*32,y*32,z*32)
-        int32_t y;
-        int32_t z;
-        } h;
-    };
-
     public:
+    // convert a tract to 1/32-voxel integer steps, returns the size of its record
+    static size_t compress(const std::vector<float>& tract,std::vector<int32_t>& t32)
+    {
+        t32.resize(tract.size());
+        // all coordinates multiply by 32 and convert to integer
+        for(size_t j = 0;j < t32.size();j++)
+            t32[j] = int(std::round(std::ldexp(tract[j],5)));
+        // Calculate coordinate displacement, skipping the first coordinate
+        for(size_t j = t32.size()-1;j >= 3;j--)
+            t32[j] -= t32[j-3];
+
+        // check if there is a leap, skipping the first coordinate
+        bool has_leap = false;
+        for(size_t j = 3;j < t32.size();j++)
+            if(t32[j] < -127 || t32[j] > 127)
+            {
+                has_leap = true;
+                break;
+            }
+        // if there is a leap, interpolate it
+        if(has_leap)
+        {
+            std::vector<int32_t> new_t32;
+            new_t32.reserve(t32.size());
+            for(size_t j = 0;j < t32.size();j += 3)
+            {
+                int32_t x = t32[j];
+                int32_t y = t32[j+1];
+                int32_t z = t32[j+2];
+                bool interpolated = false;
+                while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
+                {
+                    x /= 2;
+                    y /= 2;
+                    z /= 2;
+                    interpolated = true;
+                }
+                if(interpolated)
+                {
+                    t32[j] -= x;
+                    t32[j+1] -= y;
+                    t32[j+2] -= z;
+                    j -= 3;
+                }
+                new_t32.push_back(x);
+                new_t32.push_back(y);
+                new_t32.push_back(z);
+            }
+            new_t32.swap(t32);
+        }
+        return sizeof(tract_header)+t32.size()-3;
+    }
+    static void store(const std::vector<int32_t>& t32,char* out)
+    {
+        tract_header hr;
+        hr.h.count = uint32_t(t32.size());
+        hr.h.x = t32[0];
+        hr.h.y = t32[1];
+        hr.h.z = t32[2];
+        std::copy(hr.buf,hr.buf+16,out);
+        out += sizeof(tract_header)-3;
+        for(size_t j = 3;j < t32.size();j++)
+            out[j] = char(t32[j]);
+    }
     static bool save_to_file(const char* file_name,
                              tipl::geometry<3> geo,
                              tipl::vector<3> vs,
@@ -71,6 +448,19 @@ class TinyTrack{
                              const std::string& parameter_id,
                              unsigned int color = 0)
     {
+        std::vector<std::vector<int32_t> > track32(tract_data.size());
+        std::vector<size_t> buf_size(track32.size());
+        prog_init p("compressing trajectories");
+        check_prog(0,tract_data.size());
+        tipl::par_for2(track32.size(),[&](size_t i,unsigned int id)
+        {
+            if(id == 0)
+                check_prog(i,tract_data.size());
+            buf_size[i] = compress(tract_data[i],track32[i]);
+        });
+        if(TractModel::save_chunked_tt)
+            return save_chunked(file_name,geo,vs,track32,buf_size,cluster,report,parameter_id,color);
+
         gz_mat_write out(file_name);
         if (!out)
             return false;
@@ -85,64 +475,6 @@ class TinyTrack{
         if(!cluster.empty())
             out.write("cluster",&cluster[0],cluster.size(),1);
 
-        std::vector<std::vector<int32_t> > track32(tract_data.size());
-        std::vector<size_t> buf_size(track32.size());
-        prog_init p("compressing trajectories");
-        check_prog(0,tract_data.size());
-        tipl::par_for2(track32.size(),[&](size_t i,unsigned int id)
-        {
-            if(id == 0)
-                check_prog(i,tract_data.size());
-            auto& t32 = track32[i];
-            t32.resize(tract_data[i].size());
-            // all coordinates multiply by 32 and convert to integer
-            for(size_t j = 0;j < t32.size();j++)
-                t32[j] = int(std::round(std::ldexp(tract_data[i][j],5)));
-            // Calculate coordinate displacement, skipping the first coordinate
-            for(size_t j = t32.size()-1;j >= 3;j--)
-                t32[j] -= t32[j-3];
-
-            // check if there is a leap, skipping the first coordinate
-            bool has_leap = false;
-            for(size_t j = 3;j < t32.size();j++)
-                if(t32[j] < -127 || t32[j] > 127)
-                {
-                    has_leap = true;
-                    break;
-                }
-            // if there is a leap, interpolate it
-            if(has_leap)
-            {
-                std::vector<int32_t> new_t32;
-                new_t32.reserve(t32.size());
-                for(size_t j = 0;j < t32.size();j += 3)
-                {
-                    int32_t x = t32[j];
-                    int32_t y = t32[j+1];
-                    int32_t z = t32[j+2];
-                    bool interpolated = false;
-                    while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
-                    {
-                        x /= 2;
-                        y /= 2;
-                        z /= 2;
-                        interpolated = true;
-                    }
-                    if(interpolated)
-                    {
-                        t32[j] -= x;
-                        t32[j+1] -= y;
-                        t32[j+2] -= z;
-                        j -= 3;
-                    }
-                    new_t32.push_back(x);
-                    new_t32.push_back(y);
-                    new_t32.push_back(z);
-                }
-                new_t32.swap(t32);
-            }
-            buf_size[i] = sizeof(tract_header)+t32.size()-3;
-        });
         set_title((std::string("saving to ")+std::filesystem::path(file_name).filename().string()).c_str());
         for(size_t block = 0,cur_track_block = 0;check_prog(cur_track_block,track32.size());++block)
         {
@@ -160,17 +492,7 @@ class TinyTrack{
             std::vector<char> out_buf(total_size);
             tipl::par_for(pos.size(),[&](size_t i)
             {
-                auto& t32 = track32[cur_track_block+i];
-                auto out = &out_buf[pos[i]];
-                tract_header hr;
-                hr.h.count = uint32_t(t32.size());
-                hr.h.x = t32[0];
-                hr.h.y = t32[1];
-                hr.h.z = t32[2];
-                std::copy(hr.buf,hr.buf+16,out);
-                out += sizeof(tract_header)-3;
-                for(size_t j = 3;j < t32.size();j++)
-                    out[j] = char(t32[j]);
+                store(track32[cur_track_block+i],&out_buf[pos[i]]);
             });
 
             if(block == 0)
@@ -181,6 +503,80 @@ class TinyTrack{
         }
         return true;
     }
+    static bool save_chunked(const char* file_name,
+                             tipl::geometry<3> geo,
+                             tipl::vector<3> vs,
+                             const std::vector<std::vector<int32_t> >& track32,
+                             const std::vector<size_t>& buf_size,
+                             const std::vector<uint16_t>& cluster,
+                             const std::string& report,
+                             const std::string& parameter_id,
+                             unsigned int color)
+    {
+        ChunkedTTWriter out;
+        if(!out.open(file_name,geo,vs,report,parameter_id,color))
+            return false;
+        set_title((std::string("saving to ")+std::filesystem::path(file_name).filename().string()).c_str());
+        for(size_t cur_track = 0;check_prog(cur_track,track32.size());)
+        {
+            // cut up to 64 blocks at a time and compress them in parallel
+            size_t total_size = 0;
+            std::vector<size_t> pos,bound(1,0),count(1,0);
+            for(size_t i = cur_track;i < track32.size();++i)
+            {
+                pos.push_back(total_size);
+                total_size += buf_size[i];
+                ++count.back();
+                if(total_size-bound.back() >= tt_chunk_size)
+                {
+                    bound.push_back(total_size);
+                    if(bound.size() > 64)
+                        break;
+                    count.push_back(0);
+                }
+            }
+            if(count.back())
+                bound.push_back(total_size);
+            else
+                count.pop_back();
+
+            std::vector<char> out_buf(total_size);
+            tipl::par_for(pos.size(),[&](size_t i)
+            {
+                store(track32[cur_track+i],&out_buf[pos[i]]);
+            });
+            if(!out.add_chunks(&out_buf[0],bound,count))
+                return false;
+            cur_track += pos.size();
+        }
+        return out.close(cluster);
+    }
+    static bool load_chunked(const char* file_name,
+                             std::vector<std::vector<float> >& tract_data,
+                             std::vector<uint16_t>& tract_cluster,
+                             tipl::geometry<3>& geo,tipl::vector<3>& vs,
+                             std::string& report,std::string& parameter_id,unsigned int& color)
+    {
+        ChunkedTTReader in;
+        if(!in.open(file_name))
+            return false;
+        geo = in.geo;
+        vs = in.vs;
+        report = in.report;
+        parameter_id = in.parameter_id;
+        if(in.color)
+            color = in.color;
+        tract_cluster = in.cluster;
+        tract_data.reserve(tract_data.size()+in.track_count());
+        for(size_t block = 0;check_prog(block,in.block_count());block += 64)
+        {
+            std::vector<std::vector<float> > tracts;
+            if(!in.read_blocks(block,std::min<size_t>(block+64,in.block_count()),tracts))
+                return false;
+            std::move(tracts.begin(),tracts.end(),std::back_inserter(tract_data));
+        }
+        return true;
+    }
     static bool load_from_file(const char* file_name,
                                std::vector<std::vector<float> >& tract_data,
                                std::vector<uint16_t>& tract_cluster,
@@ -188,6 +584,8 @@ class TinyTrack{
                                std::string& report,std::string& parameter_id,unsigned int& color)
     {
         prog_init p("loading ",std::filesystem::path(file_name).filename().string().c_str());
+        if(ChunkedTTReader::is_chunked(file_name))
+            return load_chunked(file_name,tract_data,tract_cluster,geo,vs,report,parameter_id,color);
         gz_mat_read in;
         prepare_idx(file_name,in.in);
         if (!in.load_from_file(file_name))
@@ -225,30 +623,13 @@ class TinyTrack{
             }
             size_t buf_size = size_t(row)*size_t(col);
             std::vector<size_t> pos;
-            for(size_t i = 0;i < buf_size;)
-            {
+            for(size_t i = 0;i < buf_size;i += tt_record_size(track_buf+i))
                 pos.push_back(i);
-                i += *reinterpret_cast<const uint32_t*>(track_buf+i);
-                i += sizeof(tract_header)-3;
-            }
             size_t add_tract_index = tract_data.size();
             tract_data.resize(add_tract_index+pos.size());
             tipl::par_for(pos.size(),[&](size_t i)
             {
-                auto& cur_tract = tract_data[i+add_tract_index];
-                tract_header hr;
-                std::copy(&track_buf[pos[i]],&track_buf[pos[i]]+16,hr.buf);
-                if(hr.h.count > buf_size)
-                    return;
-                cur_tract.resize(hr.h.count);
-                cur_tract[0] = hr.h.x;
-                cur_tract[1] = hr.h.y;
-                cur_tract[2] = hr.h.z;
-                size_t shift = pos[i]+sizeof(tract_header)-3;
-                for(size_t j = 3;j < cur_tract.size();++j)
-                    cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
-                for(size_t j = 0;j < cur_tract.size();++j)
-                    cur_tract[j] = std::ldexp(cur_tract[j],-5);
+                tt_decode(track_buf+pos[i],buf_size,tract_data[i+add_tract_index]);
             });
         }
 
@@ -452,35 +833,530 @@ struct Tck{
                 }
             }
         }
-
-        std::ifstream in(file_name,std::ios::binary);
-        if(!in)
-            return false;
-        in.seekg(0,std::ios::end);
-        unsigned int total_size = uint32_t(in.tellg());
-        in.seekg(offset,std::ios::beg);
-        std::vector<unsigned int> buf((total_size-offset)/4);
-        in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
-        for(unsigned int index = 0;index < buf.size();)
+
+        std::ifstream in(file_name,std::ios::binary);
+        if(!in)
+            return false;
+        in.seekg(0,std::ios::end);
+        unsigned int total_size = uint32_t(in.tellg());
+        in.seekg(offset,std::ios::beg);
+        std::vector<unsigned int> buf((total_size-offset)/4);
+        in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
+        for(unsigned int index = 0;index < buf.size();)
+        {
+            unsigned int end = std::find(buf.begin()+index,buf.end(),0x7FC00000)-buf.begin(); // NaN
+            if(end-index > 3)
+            {
+                std::vector<float> track(end-index);
+                std::copy((const float*)&*buf.begin() + index,
+                          (const float*)&*buf.begin() + end,
+                          track.begin());
+                loaded_tract_data.push_back(std::move(track));
+                tipl::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),vs[0]);
+            }
+            index = end+3;
+        }
+        return true;
+    }
+
+};
+
+
+
+bool TractStreamWriter::supported(const std::string& file_name)
+{
+    if(file_name.length() <= 4)
+        return false;
+    std::string ext(file_name.end()-4,file_name.end());
+    return ext == "t.gz" || ext == ".trk" || ext == "k.gz" || ext == ".tck";
+}
+static const unsigned int tck_header_size = 200;
+static std::string tck_header(const tipl::geometry<3>& geo,const tipl::vector<3>& vs,size_t count)
+{
+    std::ostringstream out;
+    out << "mrtrix tracks" << std::endl;
+    out << "datatype: Float32LE" << std::endl;
+    out << "dim: " << geo[0] << "," << geo[1] << "," << geo[2] << std::endl;
+    out << "vox: " << vs[0] << "," << vs[1] << "," << vs[2] << std::endl;
+    out << "datatype: Float32LE" << std::endl;
+    // fixed width so that the count can be rewritten in place
+    out << "file: . " << tck_header_size << "\ncount: " << std::setw(12) << std::setfill('0') << count << "\nEND\n";
+    return out.str();
+}
+bool TractStreamWriter::open(const std::string& file_name,const tipl::geometry<3>& geo,const tipl::vector<3>& vs_,
+                             const std::string& report,const std::string& parameter_id)
+{
+    if(!supported(file_name))
+        return false;
+    ext = std::string(file_name.end()-4,file_name.end());
+    vs = vs_;
+    if(ext == "t.gz")
+    {
+        if(TractModel::save_chunked_tt)
+        {
+            tt_chunk_out = std::make_shared<ChunkedTTWriter>();
+            if(!tt_chunk_out->open(file_name.c_str(),geo,vs,report,parameter_id,0))
+                return false;
+        }
+        else
+        {
+            tt_out = std::make_shared<gz_mat_write>(file_name.c_str());
+            if(!(*tt_out))
+                return false;
+            tt_out->write("dimension",geo);
+            tt_out->write("voxel_size",vs);
+            tt_out->write("report",report);
+            if(!parameter_id.empty())
+                tt_out->write("parameter_id",parameter_id);
+        }
+    }
+    if(ext == ".trk" || ext == "k.gz")
+    {
+        trk_out = std::make_shared<gz_ostream>();
+        if(!trk_out->open(file_name.c_str()))
+            return false;
+        TrackVis trk;
+        trk.init(geo,vs);
+        trk.n_count = 0; // read until the end of file
+        *(uint32_t*)(trk.reserved+440) = uint32_t(default_tract_color);
+        if(parameter_id.length())
+            std::copy(parameter_id.begin(),parameter_id.begin()+std::min<int>(439,int(parameter_id.length())),trk.reserved);
+        trk_out->write((const char*)&trk,1000);
+    }
+    if(ext == ".tck")
+    {
+        tck_out = std::make_shared<std::ofstream>(file_name.c_str(),std::ios::binary);
+        if(!(*tck_out))
+            return false;
+        std::string t = tck_header(geo,vs,0);
+        if(t.length() > tck_header_size)
+            return false;
+        char header[tck_header_size] = {0};
+        std::copy(t.begin(),t.end(),header);
+        tck_out->write(header,sizeof(header));
+        tck_geo = geo;
+    }
+    closing = false;
+    failed = false;
+    count = 0;
+    tt_block = 0;
+    writer = std::thread([this]()
+    {
+        while(true)
+        {
+            std::vector<std::vector<float> > tracts;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock,[this](){return closing || !queue.empty();});
+                if(queue.empty())
+                    break;
+                tracts.swap(queue.front());
+                queue.pop_front();
+                for(const auto& t : tracts)
+                    queued_size -= t.size();
+            }
+            queue_cv.notify_all();
+            write(tracts);
+        }
+    });
+    return true;
+}
+void TractStreamWriter::push(std::vector<std::vector<float> >& tracts)
+{
+    if(tracts.empty() || !writer.joinable())
+        return;
+    size_t size = 0;
+    for(const auto& t : tracts)
+        size += t.size();
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    queue_cv.wait(lock,[&](){return queued_size < max_queued_size || queue.empty();});
+    queue.push_back(std::vector<std::vector<float> >());
+    queue.back().swap(tracts);
+    queued_size += size;
+    queue_cv.notify_all();
+}
+void TractStreamWriter::write(const std::vector<std::vector<float> >& tracts)
+{
+    if(tt_out.get() || tt_chunk_out.get())
+    {
+        std::vector<std::vector<int32_t> > track32(tracts.size());
+        std::vector<size_t> buf_size(tracts.size());
+        tipl::par_for(tracts.size(),[&](size_t i)
+        {
+            buf_size[i] = TinyTrack::compress(tracts[i],track32[i]);
+        });
+        for(size_t i = 0;i < tracts.size();++i)
+        {
+            if(tt_buf.size()+buf_size[i] > 134217728) // 128 mb per block
+                flush_tt();
+            size_t pos = tt_buf.size();
+            tt_buf.resize(pos+buf_size[i]);
+            TinyTrack::store(track32[i],&tt_buf[pos]);
+        }
+    }
+    if(trk_out.get())
+        for(const auto& t : tracts)
+        {
+            int n_point = int(t.size()/3);
+            std::vector<float> buffer(t);
+            for(size_t j = 0;j < buffer.size();++j)
+                buffer[j] *= vs[j%3];
+            trk_out->write((const char*)&n_point,sizeof(int));
+            trk_out->write((const char*)&buffer[0],sizeof(float)*buffer.size());
+            if(!(*trk_out))
+            {
+                failed = true;
+                break;
+            }
+        }
+    if(tck_out.get())
+    {
+        unsigned int NaN = 0x7FC00000;
+        for(const auto& t : tracts)
+        {
+            std::vector<float> buf(t);
+            tipl::multiply_constant(buf,vs[0]);
+            tck_out->write((char*)&buf[0],buf.size()*sizeof(float));
+            tck_out->write((char*)&NaN,sizeof(NaN));
+            tck_out->write((char*)&NaN,sizeof(NaN));
+            tck_out->write((char*)&NaN,sizeof(NaN));
+        }
+        if(!(*tck_out))
+            failed = true;
+    }
+    count += tracts.size();
+}
+void TractStreamWriter::flush_tt(void)
+{
+    if(tt_buf.empty())
+        return;
+    if(tt_chunk_out.get())
+    {
+        std::vector<size_t> bound(1,0),count(1,0);
+        for(size_t pos = 0;pos < tt_buf.size();pos += tt_record_size(&tt_buf[pos]))
+        {
+            if(pos-bound.back() >= tt_chunk_size)
+            {
+                bound.push_back(pos);
+                count.push_back(0);
+            }
+            ++count.back();
+        }
+        bound.push_back(tt_buf.size());
+        if(!tt_chunk_out->add_chunks(&tt_buf[0],bound,count))
+            failed = true;
+        tt_buf.clear();
+        return;
+    }
+    try{
+        if(tt_block == 0)
+            tt_out->write("track",&tt_buf[0],tt_buf.size(),1);
+        else
+            tt_out->write((std::string("track")+std::to_string(tt_block)).c_str(),&tt_buf[0],tt_buf.size(),1);
+    }
+    catch(const std::runtime_error&)
+    {
+        failed = true;
+    }
+    if(!(*tt_out))
+        failed = true;
+    ++tt_block;
+    tt_buf.clear();
+}
+bool TractStreamWriter::close(void)
+{
+    if(!writer.joinable())
+        return !failed;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        closing = true;
+    }
+    queue_cv.notify_all();
+    writer.join();
+    if(tt_out.get())
+    {
+        flush_tt();
+        // a run without any tract still needs a track entry to be a valid tt file
+        if(tt_block == 0)
+        {
+            char empty = 0;
+            tt_out->write("track",&empty,0,1);
+            if(!(*tt_out))
+                failed = true;
+        }
+        tt_out.reset();
+    }
+    if(tt_chunk_out.get())
+    {
+        flush_tt();
+        if(!tt_chunk_out->close(std::vector<uint16_t>()))
+            failed = true;
+        tt_chunk_out.reset();
+    }
+    if(trk_out.get())
+    {
+        trk_out->close();
+        if(!(*trk_out))
+            failed = true;
+        trk_out.reset();
+    }
+    if(tck_out.get())
+    {
+        unsigned int INF = 0x7FB00000;
+        tck_out->write((char*)&INF,sizeof(INF));
+        tck_out->write((char*)&INF,sizeof(INF));
+        tck_out->write((char*)&INF,sizeof(INF));
+        std::string t = tck_header(tck_geo,vs,count);
+        tck_out->seekp(0);
+        tck_out->write(t.c_str(),std::streamsize(t.length()));
+        if(!(*tck_out))
+            failed = true;
+        tck_out.reset();
+    }
+    return !failed;
+}
+
+bool TractFileView::open(const char* file_name_,const tipl::vector<3>& vs_)
+{
+    file_name = file_name_;
+    vs = vs_;
+    if(QString(file_name_).endsWith("tt.gz"))
+    {
+        if(!ChunkedTTReader::is_chunked(file_name_))
+        {
+            error_msg = "out-of-core access needs a chunked .tt.gz file. Convert it using --action=exp --chunked_tt=1";
+            return false;
+        }
+        tt = std::make_shared<ChunkedTTReader>();
+        if(!tt->open(file_name_))
+        {
+            error_msg = "cannot read ";
+            error_msg += file_name;
+            return false;
+        }
+        report = tt->report;
+        parameter_id = tt->parameter_id;
+        return true;
+    }
+    is_trk = QString(file_name_).endsWith(".trk");
+    if(!is_trk && !QString(file_name_).endsWith(".tck"))
+    {
+        error_msg = "out-of-core access supports .tck, .trk, and chunked .tt.gz files";
+        return false;
+    }
+    file = std::make_shared<QFile>(file_name_);
+    if(!file->open(QIODevice::ReadOnly) || !(data = file->map(0,file->size())))
+    {
+        error_msg = "cannot map ";
+        error_msg += file_name;
+        return false;
+    }
+    data_size = size_t(file->size());
+    size_t begin = 0,n_count = 0;
+    if(is_trk)
+    {
+        TrackVis trk;
+        if(data_size < 1000)
+        {
+            error_msg = "invalid trk file";
+            return false;
+        }
+        std::memcpy(&trk,data,1000);
+        n_scalars = trk.n_scalars;
+        n_properties = trk.n_properties;
+        std::copy(trk.dim,trk.dim+3,dim);
+        flip_x = trk.voxel_order[1] == 'R';
+        flip_y = trk.voxel_order[1] == 'A';
+        begin = 1000;
+        n_count = size_t(std::max<int>(0,trk.n_count));
+        // same as TractModel::load_from_file
+        parameter_id = std::string(trk.reserved,std::find(trk.reserved,trk.reserved+440,0));
+        if(parameter_id.find(' ') != std::string::npos)
+            parameter_id.clear();
+        if(!parameter_id.empty())
+        {
+            report = "\nThis tractography was generated using the following parameters: ";
+            TrackingParam param;
+            if(param.set_code(parameter_id))
+                report += param.get_report();
+        }
+    }
+    else
+    {
+        // the header is text lines ending at "END", with the data offset in "file: . offset"
+        std::istringstream in(std::string(reinterpret_cast<const char*>(data),
+                                          reinterpret_cast<const char*>(data)+std::min<size_t>(data_size,65536)));
+        std::string line;
+        while(std::getline(in,line) && line != "END")
+        {
+            if(line.substr(0,7) == std::string("file: ."))
+                std::istringstream(line.substr(7)) >> begin;
+            // coordinates are scaled by the voxel size in the header, as TractModel loads them
+            if(line.substr(0,4) == std::string("vox:"))
+            {
+                std::string s(line.substr(4));
+                std::replace(s.begin(),s.end(),',',' ');
+                std::istringstream(s) >> vs[0] >> vs[1] >> vs[2];
+            }
+        }
+        if(!begin || begin >= data_size)
+        {
+            error_msg = "invalid tck file";
+            return false;
+        }
+    }
+    if(!load_index())
+    {
+        build_index(begin,n_count);
+        save_index();
+    }
+    return true;
+}
+// index files are kept in the user cache folder, named by the hash of the tract file path
+static std::string get_tract_index_name(const std::string& file_name)
+{
+    QString cache_dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/tract_index_cache";
+    QByteArray path = QFileInfo(file_name.c_str()).absoluteFilePath().toUtf8();
+    return (cache_dir + "/" + QCryptographicHash::hash(path,QCryptographicHash::Md5).toHex() + ".tidx").toStdString();
+}
+bool TractFileView::load_index(void)
+{
+    std::string idx_name = get_tract_index_name(file_name);
+    if(!std::filesystem::exists(idx_name) ||
+       QFileInfo(idx_name.c_str()).lastModified() < QFileInfo(file_name.c_str()).lastModified())
+        return false;
+    std::ifstream in(idx_name.c_str(),std::ios::binary);
+    uint64_t file_size = 0,count = 0;
+    if(!in.read(reinterpret_cast<char*>(&file_size),sizeof(file_size)) ||
+       !in.read(reinterpret_cast<char*>(&count),sizeof(count)) || file_size != data_size)
+        return false;
+    offset.resize(count);
+    if(!count || !in.read(reinterpret_cast<char*>(&offset[0]),std::streamsize(count*sizeof(uint64_t))) ||
+       offset.back() > data_size)
+    {
+        offset.clear();
+        return false;
+    }
+    std::cout << "using index file " << idx_name << std::endl;
+    return true;
+}
+void TractFileView::save_index(void) const
+{
+    if(data_size <= 134217728) // 128mb
+        return;
+    std::string idx_name = get_tract_index_name(file_name);
+    if(!QDir().mkpath(QFileInfo(idx_name.c_str()).absolutePath()))
+        return;
+    std::ofstream out(idx_name.c_str(),std::ios::binary);
+    if(!out)
+        return;
+    std::cout << "saving index file " << idx_name << " for future access" << std::endl;
+    uint64_t file_size = data_size,count = offset.size();
+    out.write(reinterpret_cast<const char*>(&file_size),sizeof(file_size));
+    out.write(reinterpret_cast<const char*>(&count),sizeof(count));
+    out.write(reinterpret_cast<const char*>(&offset[0]),std::streamsize(count*sizeof(uint64_t)));
+}
+void TractFileView::build_index(size_t begin,size_t n_count)
+{
+    prog_init p("indexing ",std::filesystem::path(file_name).filename().string().c_str());
+    offset.clear();
+    size_t pos = begin;
+    if(is_trk)
+    {
+        for(;pos+sizeof(int32_t) <= data_size && (!n_count || offset.size() < n_count);)
+        {
+            if((offset.size() & 0xFFFF) == 0)
+                check_prog(pos,data_size);
+            int32_t n_point = *reinterpret_cast<const int32_t*>(data+pos);
+            size_t record_size = sizeof(int32_t)+(size_t(std::max<int32_t>(0,n_point))*size_t(3+n_scalars)+size_t(n_properties))*sizeof(float);
+            if(n_point < 0 || pos+record_size > data_size)
+                break;
+            offset.push_back(pos);
+            pos += record_size;
+        }
+    }
+    else
+    {
+        // each tract ends with a NaN triplet and the file ends with an INF triplet
+        const uint32_t* buf = reinterpret_cast<const uint32_t*>(data+begin);
+        size_t n = (data_size-begin)/sizeof(uint32_t),start = 0;
+        for(size_t i = 0;i < n;++i)
         {
-            unsigned int end = std::find(buf.begin()+index,buf.end(),0x7FC00000)-buf.begin(); // NaN
-            if(end-index > 3)
+            if(buf[i] == 0x7FC00000)
             {
-                std::vector<float> track(end-index);
-                std::copy((const float*)&*buf.begin() + index,
-                          (const float*)&*buf.begin() + end,
-                          track.begin());
-                loaded_tract_data.push_back(std::move(track));
-                tipl::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),vs[0]);
+                if((offset.size() & 0xFFFF) == 0)
+                    check_prog(i,n);
+                offset.push_back(begin+start*sizeof(float));
+                i += 2;
+                start = i+1;
+                continue;
             }
-            index = end+3;
+            if(buf[i] == 0x7F800000 || buf[i] == 0x7FB00000)
+                break;
         }
-        return true;
+        pos = begin+start*sizeof(float);
     }
-
-};
-
-
+    offset.push_back(pos);
+    check_prog(0,0);
+}
+void TractFileView::decode(size_t index,std::vector<float>& tract) const
+{
+    const unsigned char* rec = data+offset[index];
+    if(!is_trk)
+    {
+        // the record is followed by a NaN triplet
+        size_t n = (offset[index+1]-offset[index])/sizeof(float);
+        tract.resize(n < 3 ? 0 : n-3);
+        if(!tract.empty())
+            std::memcpy(&tract[0],rec,tract.size()*sizeof(float));
+        tipl::divide_constant(tract.begin(),tract.end(),vs[0]);
+        return;
+    }
+    size_t record_size = offset[index+1]-offset[index];
+    if(record_size < sizeof(int32_t))
+    {
+        tract.clear();
+        return;
+    }
+    int32_t n_point = *reinterpret_cast<const int32_t*>(rec);
+    const float* from = reinterpret_cast<const float*>(rec+sizeof(int32_t));
+    size_t shift = size_t(3+n_scalars);
+    // a stale index on a replaced file must not read past the record
+    size_t max_point = (record_size-sizeof(int32_t))/(shift*sizeof(float));
+    tract.resize(std::min<size_t>(size_t(std::max<int32_t>(0,n_point)),max_point)*3);
+    for(size_t i = 0;i < tract.size();i += 3,from += shift)
+    {
+        float x = from[0]/vs[0];
+        float y = from[1]/vs[1];
+        tract[i] = flip_x ? dim[0]-x-1 : x;
+        tract[i+1] = flip_y ? dim[1]-y-1 : y;
+        tract[i+2] = from[2]/vs[2];
+    }
+}
+bool TractFileView::read(size_t from,size_t count,std::vector<std::vector<float> >& tracts)
+{
+    if(tt.get())
+        return tt->read_tracts(from,count,tracts);
+    tracts.clear();
+    if(from >= size())
+        return from == size();
+    tracts.resize(std::min<size_t>(count,size()-from));
+    tipl::par_for(tracts.size(),[&](size_t i)
+    {
+        decode(from+i,tracts[i]);
+    });
+    return true;
+}
+bool TractFileView::for_each_chunk(size_t chunk_size,std::function<bool(size_t,std::vector<std::vector<float> >&)> fun)
+{
+    for(size_t from = 0;check_prog(from,size());from += chunk_size)
+    {
+        std::vector<std::vector<float> > tracts;
+        if(!read(from,chunk_size,tracts) || !fun(from,tracts))
+            return false;
+    }
+    return !prog_aborted();
+}
 
 bool tt2trk(const char* tt_file,const char* trk_file)
 {
@@ -499,6 +1375,22 @@ bool tt2trk(const char* tt_file,const char* trk_file)
     return TrackVis::save_to_file(trk_file,geo,vs,tract_data,scalar,report,color);
 }
 
+bool tt2tt(const char* tt_file,const char* new_tt_file)
+{
+    std::vector<std::vector<float> > tract_data;
+    std::vector<uint16_t> cluster;
+    std::string report,pid;
+    tipl::vector<3> vs;
+    tipl::geometry<3> geo;
+    unsigned int color = 0;
+    if(!TinyTrack::load_from_file(tt_file,tract_data,cluster,geo,vs,report,pid,color))
+    {
+        std::cout << "cannot read file:" << tt_file << std::endl;
+        return false;
+    }
+    return TinyTrack::save_to_file(new_tt_file,geo,vs,tract_data,cluster,report,pid,color);
+}
+
 bool trk2tt(const char* trk_file,const char* tt_file)
 {
     TrackVis vis;
@@ -620,12 +1512,14 @@ bool load_fib_from_tracks(const char* file_name,tipl::image<float,3>& I,tipl::ve
 //---------------------------------------------------------------------------
 void TractModel::add(const TractModel& rhs)
 {
+    set_changed(tract_data.size());
     for(unsigned int index = 0;index < rhs.redo_size.size();++index)
         redo_size.push_back(std::make_pair(rhs.redo_size[index].first + tract_data.size(),
                                            rhs.redo_size[index].second));
     tract_data.insert(tract_data.end(),rhs.tract_data.begin(),rhs.tract_data.end());
     tract_color.insert(tract_color.end(),rhs.tract_color.begin(),rhs.tract_color.end());
     tract_tag.insert(tract_tag.end(),rhs.tract_tag.begin(),rhs.tract_tag.end());
+    tract_weight.insert(tract_weight.end(),rhs.tract_weight.begin(),rhs.tract_weight.end());
     deleted_tract_data.insert(deleted_tract_data.end(),
                               rhs.deleted_tract_data.begin(),
                               rhs.deleted_tract_data.end());
@@ -635,6 +1529,9 @@ void TractModel::add(const TractModel& rhs)
     deleted_tract_tag.insert(deleted_tract_tag.end(),
                                rhs.deleted_tract_tag.begin(),
                                rhs.deleted_tract_tag.end());
+    deleted_tract_weight.insert(deleted_tract_weight.end(),
+                               rhs.deleted_tract_weight.begin(),
+                               rhs.deleted_tract_weight.end());
     deleted_count.insert(deleted_count.begin(),
                          rhs.deleted_count.begin(),
                          rhs.deleted_count.end());
@@ -744,15 +1641,18 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
         tract_cluster.clear();
 
     loaded_tract_data.swap(tract_data);
+    clear_tract_index();
     tract_color.clear();
     tract_color.resize(tract_data.size());
     if(color)
         std::fill(tract_color.begin(),tract_color.end(),color);
     tract_tag.clear();
     tract_tag.resize(tract_data.size());
+    tract_weight.assign(tract_data.size(),1.0f);
     deleted_tract_data.clear();
     deleted_tract_color.clear();
     deleted_tract_tag.clear();
+    deleted_tract_weight.clear();
     deleted_count.clear();
     is_cut.clear();
     redo_size.clear();
@@ -982,8 +1882,13 @@ void TractModel::save_vrml(const std::string& file_name,
                            unsigned char tract_color_style,
                            float tube_diameter,
                            unsigned char tract_tube_detail,
-                           const std::string&)
+                           const std::string&,
+                           float lod_tolerance)
 {
+    // 0: full detail, otherwise points below the tolerance are dropped as in rendering
+    if(lod_tolerance > 0.0f)
+        update_lod();
+    std::vector<float> lod_tract;
     std::ofstream out(file_name.c_str());
     std::vector<tipl::vector<3,float> > points(8),previous_points(8);
     tipl::rgb paint_color;
@@ -1035,12 +1940,17 @@ void TractModel::save_vrml(const std::string& file_name,
     };
     for (unsigned int data_index = 0; data_index < tract_data.size(); ++data_index)
     {
+        const float* data_iter = tract_data[data_index].data();
         unsigned int vertex_count = uint32_t(get_tract_length(data_index))/3;
+        if(lod_tolerance > 0.0f)
+        {
+            get_lod_tract(data_index,lod_tolerance,lod_tract);
+            data_iter = lod_tract.data();
+            vertex_count = uint32_t(lod_tract.size()/3);
+        }
         if (vertex_count <= 1)
             continue;
 
-        const float* data_iter = &tract_data[data_index][0];
-
         switch(tract_color_style)
         {
         case 1:
@@ -1337,6 +2247,7 @@ bool TractModel::load_tracts_color_from_file(const char* file_name)
             tract_color[index] = tipl::rgb(std::min<int>(colors[pos],255),
                                                   std::min<int>(colors[pos+1],255),
                                                   std::min<int>(colors[pos+2],255));
+    set_changed(0,tract_color.size());
     return true;
 }
 //---------------------------------------------------------------------------
@@ -1444,6 +2355,7 @@ void TractModel::resample(float new_step)
         new_tracts.push_back(tract_data[i][tract_data[i].size()-1]);
         new_tracts.swap(tract_data[i]);
     });
+    clear_tract_index();
 }
 //---------------------------------------------------------------------------
 void TractModel::get_tract_points(std::vector<tipl::vector<3,float> >& points)
@@ -1456,6 +2368,188 @@ void TractModel::get_tract_points(std::vector<tipl::vector<3,float> >& points)
         }
 }
 //---------------------------------------------------------------------------
+uint64_t TractModel::new_generation(void)
+{
+    static std::atomic<uint64_t> last_generation(0);
+    return ++last_generation;
+}
+//---------------------------------------------------------------------------
+void TractModel::set_changed(size_t from,size_t to)
+{
+    generation = new_generation();
+    change_log.push_back(std::make_tuple(generation,from,to));
+    if(change_log.size() > 64)
+    {
+        dropped_change_generation = std::get<0>(change_log.front());
+        change_log.pop_front();
+    }
+}
+//---------------------------------------------------------------------------
+bool TractModel::is_unchanged(size_t from,size_t to,uint64_t since) const
+{
+    if(since < dropped_change_generation)
+        return false;
+    for(auto iter = change_log.rbegin();iter != change_log.rend() && std::get<0>(*iter) > since;++iter)
+        if(to > std::get<1>(*iter) && from < std::get<2>(*iter))
+            return false;
+    return true;
+}
+//---------------------------------------------------------------------------
+void TractModel::set_tract_color(std::vector<unsigned int>& new_color)
+{
+    // only the range that differs is marked as changed
+    size_t from = 0,to = std::max(new_color.size(),tract_color.size());
+    if(new_color.size() == tract_color.size())
+    {
+        for(;from < to && new_color[from] == tract_color[from];++from)
+            ;
+        for(;to > from && new_color[to-1] == tract_color[to-1];--to)
+            ;
+    }
+    tract_color = new_color;
+    color_changed = true;
+    if(from < to)
+        set_changed(from,to);
+}
+//---------------------------------------------------------------------------
+void TractModel::clear_tract_index(void)
+{
+    set_changed();
+    for(unsigned char dim = 0;dim < 3;++dim)
+    {
+        slice_index[dim].clear();
+        slice_indexed_count[dim] = 0;
+    }
+    tract_lod.clear();
+    tract_rank.clear();
+    std::lock_guard<std::mutex> lock(scalar_cache_mutex);
+    scalar_cache.clear();
+}
+//---------------------------------------------------------------------------
+// Douglas-Peucker: each point gets the largest tolerance at which it is kept,
+// bounded by that of the point that split its range
+void get_lod(const float* p,size_t n,std::vector<float>& lod)
+{
+    lod.resize(n);
+    if(!n)
+        return;
+    lod.front() = lod.back() = std::numeric_limits<float>::max();
+    std::vector<std::tuple<size_t,size_t,float> > ranges;
+    ranges.push_back(std::make_tuple(size_t(0),n-1,std::numeric_limits<float>::max()));
+    while(!ranges.empty())
+    {
+        size_t from,to;
+        float bound;
+        std::tie(from,to,bound) = ranges.back();
+        ranges.pop_back();
+        if(to <= from+1)
+            continue;
+        tipl::vector<3> a(p+from*3),ab(p+to*3);
+        ab -= a;
+        float ab2 = ab*ab;
+        float max_d = -1.0f;
+        size_t max_i = from+1;
+        for(size_t i = from+1;i < to;++i)
+        {
+            tipl::vector<3> ap(p+i*3);
+            ap -= a;
+            float t = ab2 > 0.0f ? std::min(1.0f,std::max(0.0f,(ap*ab)/ab2)) : 0.0f;
+            ap -= ab*t;
+            float d = float(ap.length());
+            if(d > max_d)
+            {
+                max_d = d;
+                max_i = i;
+            }
+        }
+        lod[max_i] = std::min(max_d,bound);
+        ranges.push_back(std::make_tuple(from,max_i,lod[max_i]));
+        ranges.push_back(std::make_tuple(max_i,to,lod[max_i]));
+    }
+}
+//---------------------------------------------------------------------------
+void TractModel::update_lod(void)
+{
+    if(tract_lod.size() > tract_data.size())
+        tract_lod.clear();
+    size_t from = tract_lod.size();
+    if(from == tract_data.size())
+        return;
+    tract_lod.resize(tract_data.size());
+    tipl::par_for(tract_data.size()-from,[&](size_t i)
+    {
+        i += from;
+        get_lod(tract_data[i].data(),tract_data[i].size()/3,tract_lod[i]);
+    });
+}
+//---------------------------------------------------------------------------
+void TractModel::get_lod_tract(unsigned int index,float tolerance,std::vector<float>& points) const
+{
+    points.clear();
+    const auto& lod = tract_lod[index];
+    for(size_t i = 0,j = 0;i < lod.size();++i,j += 3)
+        if(lod[i] >= tolerance)
+            points.insert(points.end(),tract_data[index].begin()+int64_t(j),tract_data[index].begin()+int64_t(j+3));
+}
+//---------------------------------------------------------------------------
+void TractModel::update_rank(void)
+{
+    if(tract_rank.size() == tract_data.size())
+        return;
+    // sort tracts by the Morton code of their mid points and rank them by the
+    // bit-reversed sorted order, so that any rank threshold selects a spatially
+    // even subset
+    std::vector<std::pair<uint32_t,uint32_t> > code(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](size_t i)
+    {
+        uint32_t c = 0;
+        if(!tract_data[i].empty())
+        {
+            const float* mid = &tract_data[i][tract_data[i].size()/6*3];
+            for(unsigned int bit = 0;bit < 10;++bit)
+                for(unsigned int d = 0;d < 3;++d)
+                    if(uint32_t(std::max(0.0f,mid[d])) & (1u << bit))
+                        c |= 1u << (bit*3+d);
+        }
+        code[i] = std::make_pair(c,uint32_t(i));
+    });
+    std::sort(code.begin(),code.end());
+    tract_rank.resize(tract_data.size());
+    for(uint32_t i = 0;i < code.size();++i)
+    {
+        uint32_t r = i;
+        r = ((r >> 1) & 0x55555555u) | ((r & 0x55555555u) << 1);
+        r = ((r >> 2) & 0x33333333u) | ((r & 0x33333333u) << 2);
+        r = ((r >> 4) & 0x0F0F0F0Fu) | ((r & 0x0F0F0F0Fu) << 4);
+        r = ((r >> 8) & 0x00FF00FFu) | ((r & 0x00FF00FFu) << 8);
+        r = (r >> 16) | (r << 16);
+        tract_rank[code[i].second] = float(double(r)/4294967296.0);
+    }
+}
+//---------------------------------------------------------------------------
+void TractModel::update_slice_index(unsigned char dim)
+{
+    if(slice_indexed_count[dim] > tract_data.size())
+    {
+        slice_index[dim].clear();
+        slice_indexed_count[dim] = 0;
+    }
+    auto& index = slice_index[dim];
+    for(size_t i = slice_indexed_count[dim];i < tract_data.size();++i)
+    {
+        const float* p = tract_data[i].data();
+        uint32_t n = uint32_t(tract_data[i].size()/3);
+        for(uint32_t from = 0,to = 1;from < n;from = to++)
+        {
+            int slice = int(std::round(p[from*3+dim]));
+            while(to < n && int(std::round(p[to*3+dim])) == slice)
+                ++to;
+            index[slice].push_back(slice_run{uint32_t(i),from,to});
+        }
+    }
+    slice_indexed_count[dim] = tract_data.size();
+}
+//---------------------------------------------------------------------------
 void TractModel::get_in_slice_tracts(unsigned char dim,int pos,
                                      tipl::matrix<4,4,float>* pT,
                                      std::vector<std::vector<tipl::vector<2,float> > >& lines,
@@ -1473,22 +2567,55 @@ void TractModel::get_in_slice_tracts(unsigned char dim,int pos,
         line.clear();
     };
     unsigned int skip = std::max<unsigned int>(1,uint32_t(tract_data.size())/max_count);
-    if(!pT) // native space
+    // point ranges that may be in the slice, ordered by tract and point
+    std::vector<slice_run> runs;
+    auto get_runs = [&](float from,float to)
+    {
+        update_slice_index(dim);
+        auto& index = slice_index[dim];
+        for(auto iter = index.lower_bound(int(std::round(std::min(from,to))));
+            iter != index.end() && iter->first <= int(std::round(std::max(from,to)));++iter)
+            for(const auto& r : iter->second)
+                if(r.tract % skip == 0)
+                    runs.push_back(r);
+        if(int(std::round(from)) == int(std::round(to)))
+            return;
+        // join runs of adjacent slices so that lines are not broken
+        std::sort(runs.begin(),runs.end(),[](const slice_run& lhs,const slice_run& rhs)
+        {return lhs.tract < rhs.tract || (lhs.tract == rhs.tract && lhs.from < rhs.from);});
+        size_t count = 0;
+        for(size_t i = 0;i < runs.size();++i)
+            if(count && runs[count-1].tract == runs[i].tract && runs[count-1].to >= runs[i].from)
+                runs[count-1].to = std::max(runs[count-1].to,runs[i].to);
+            else
+                runs[count++] = runs[i];
+        runs.resize(count);
+    };
+    auto for_each_run = [&](auto&& in_slice,auto&& to_slice)
     {
-        for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
+        for(const auto& r : runs)
+        {
+            for(uint32_t j = r.from;j < r.to;++j)
             {
-                if(int(std::round(tract_data[index][j+dim])) == pos)
-                {
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,tract_data[index][j],
-                                          tract_data[index][j+1],
-                                          tract_data[index][j+2],p[0],p[1]);
-                    line.push_back(p);
-                }
+                tipl::vector<3> t(&tract_data[r.tract][j*3]);
+                if(in_slice(t))
+                    line.push_back(to_slice(t));
                 else
-                    add_line(index);
+                    add_line(r.tract);
             }
+            add_line(r.tract);
+        }
+    };
+    auto space2slice = [&](const tipl::vector<3>& t)
+    {
+        tipl::vector<2,float> p;
+        tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
+        return p;
+    };
+    if(!pT) // native space
+    {
+        get_runs(pos,pos);
+        for_each_run([&](const tipl::vector<3>& t){return int(std::round(t[dim])) == pos;},space2slice);
     }
     else
     {
@@ -1498,41 +2625,20 @@ void TractModel::get_in_slice_tracts(unsigned char dim,int pos,
             float scale = T[0];
             tipl::vector<3,float> shift(T[3],T[7],T[11]);
             pos -= shift[dim];
-            for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
-            {
-                if(int(std::round(tract_data[index][j+dim]*scale)) == pos)
-                {
-                    tipl::vector<3> t(&tract_data[index][j]);
-                    t *= scale;
-                    t += shift;
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
-                    line.push_back(p);
-                }
-                else
-                    add_line(index);
-            }
+            get_runs((float(pos)-0.5f)/scale,(float(pos)+0.5f)/scale);
+            for_each_run([&](const tipl::vector<3>& t){return int(std::round(t[dim]*scale)) == pos;},
+                         [&](tipl::vector<3> t){t *= scale;t += shift;return space2slice(t);});
         }
         else
         // more complicated transformation
         {
             tipl::vector<3,float> rotate(&T[0]+dim*4);
             pos -= T[dim*4+3];
-            for (unsigned int index = 0;index < tract_data.size();index += skip,add_line(index))
-            for (unsigned int j = 0;j < tract_data[index].size();j += 3)
-            {
-                tipl::vector<3> t(&tract_data[index][j]);
-                if(int(std::round(rotate*t)) == pos)
-                {
-                    t.to(T);
-                    tipl::vector<2,float> p;
-                    tipl::space2slice(dim,t[0],t[1],t[2],p[0],p[1]);
-                    line.push_back(p);
-                }
-                else
-                    add_line(index);
-            }
+            // the slice is oblique to the index, check all points
+            for (unsigned int index = 0;index < tract_data.size();index += skip)
+                runs.push_back(slice_run{index,0,uint32_t(tract_data[index].size()/3)});
+            for_each_run([&](const tipl::vector<3>& t){return int(std::round(rotate*t)) == pos;},
+                         [&](tipl::vector<3> t){t.to(T);return space2slice(t);});
         }
     }
 }
@@ -1602,15 +2708,97 @@ void TractModel::clear(void)
     tract_data.clear();
     tract_color.clear();
     tract_tag.clear();
+    tract_weight.clear();
     redo_size.clear();
+    clear_tract_index();
 }
 //---------------------------------------------------------------------------
 void TractModel::erase_empty(void)
 {
+    {
+        size_t first_empty = 0;
+        for(;first_empty < tract_data.size() && !tract_data[first_empty].empty();++first_empty)
+            ;
+        set_changed(first_empty);
+    }
+    // remove the runs of deleted tracts and renumber the rest in the slice index
+    for(unsigned char dim = 0;dim < 3;++dim)
+    {
+        if(!slice_indexed_count[dim])
+            continue;
+        if(slice_indexed_count[dim] > tract_data.size())
+        {
+            slice_index[dim].clear();
+            slice_indexed_count[dim] = 0;
+            continue;
+        }
+        std::vector<uint32_t> new_index(slice_indexed_count[dim]);
+        uint32_t count = 0;
+        for(size_t i = 0;i < new_index.size();++i)
+            new_index[i] = tract_data[i].empty() ? std::numeric_limits<uint32_t>::max() : count++;
+        if(count == new_index.size())
+            continue;
+        for(auto iter = slice_index[dim].begin();iter != slice_index[dim].end();)
+        {
+            auto& bucket = iter->second;
+            bucket.erase(std::remove_if(bucket.begin(),bucket.end(),[&](const slice_run& r)
+                {return new_index[r.tract] == std::numeric_limits<uint32_t>::max();}),bucket.end());
+            for(auto& r : bucket)
+                r.tract = new_index[r.tract];
+            if(bucket.empty())
+                iter = slice_index[dim].erase(iter);
+            else
+                ++iter;
+        }
+        slice_indexed_count[dim] = count;
+    }
+    if(tract_lod.size() <= tract_data.size())
+    {
+        size_t count = 0;
+        for(size_t i = 0;i < tract_lod.size();++i)
+            if(!tract_data[i].empty())
+                tract_lod[count++].swap(tract_lod[i]);
+        tract_lod.resize(count);
+    }
+    else
+        tract_lod.clear();
+    if(tract_rank.size() == tract_data.size())
+    {
+        size_t count = 0;
+        for(size_t i = 0;i < tract_rank.size();++i)
+            if(!tract_data[i].empty())
+                tract_rank[count++] = tract_rank[i];
+        tract_rank.resize(count);
+    }
+    else
+        tract_rank.clear();
+    {
+        std::lock_guard<std::mutex> lock(scalar_cache_mutex);
+        for(auto& iter : scalar_cache)
+        {
+            auto& cache = iter.second;
+            auto new_cache = std::make_shared<tract_scalar>();
+            new_cache->image_generation = cache->image_generation;
+            new_cache->iT = cache->iT;
+            new_cache->last_use = cache->last_use;
+            if(cache->offset.size() <= tract_data.size()+1)
+                for(size_t i = 0;i+1 < cache->offset.size();++i)
+                    if(!tract_data[i].empty())
+                    {
+                        new_cache->values.insert(new_cache->values.end(),
+                                                 cache->values.begin()+int64_t(cache->offset[i]),
+                                                 cache->values.begin()+int64_t(cache->offset[i+1]));
+                        new_cache->offset.push_back(new_cache->values.size());
+                    }
+            cache = new_cache;
+        }
+    }
     tract_color.erase(std::remove_if(tract_color.begin(),tract_color.end(),
                         [&](const unsigned int& data){return tract_data[&data-&tract_color[0]].empty();}), tract_color.end());
     tract_tag.erase(std::remove_if(tract_tag.begin(),tract_tag.end(),
                         [&](const unsigned int& data){return tract_data[&data-&tract_tag[0]].empty();}), tract_tag.end());
+    tract_weight.erase(std::remove_if(tract_weight.begin(),tract_weight.end(),
+                        [&](const float& data){return tract_data[&data-&tract_weight[0]].empty();}), tract_weight.end());
     tract_data.erase(std::remove_if(tract_data.begin(),tract_data.end(),
                         [&](const std::vector<float>& data){return data.empty();}), tract_data.end() );
 }
@@ -1624,6 +2812,7 @@ void TractModel::delete_tracts(const std::vector<unsigned int>& tracts_to_delete
         deleted_tract_data.push_back(std::move(tract_data[tracts_to_delete[index]]));
         deleted_tract_color.push_back(tract_color[tracts_to_delete[index]]);
         deleted_tract_tag.push_back(tract_tag[tracts_to_delete[index]]);
+        deleted_tract_weight.push_back(tract_weight[tracts_to_delete[index]]);
     }
     erase_empty();
     deleted_count.push_back(tracts_to_delete.size());
@@ -1756,8 +2945,8 @@ void TractModel::delete_branch(void)
 
     std::shared_ptr<fib_data> handle(new fib_data(geo,vs,trans_to_mni));
     std::shared_ptr<RoiMgr> roi_mgr(new RoiMgr(handle));
-    roi_mgr->setRegions(r1.get_region_voxels_raw(),r1.resolution_ratio,2,"end1");
-    roi_mgr->setRegions(r2.get_region_voxels_raw(),r2.resolution_ratio,2,"end2");
+    roi_mgr->setRegions(r1,2,"end1");
+    roi_mgr->setRegions(r2,2,"end2");
     filter_by_roi(roi_mgr);
 }
 //---------------------------------------------------------------------------
@@ -1786,6 +2975,7 @@ void TractModel::cut(float select_angle,const std::vector<tipl::vector<3,float>
     select(select_angle,dirs,from_pos,selected);
     std::vector<std::vector<float> > new_tract;
     std::vector<unsigned int> new_tract_color;
+    std::vector<float> new_tract_weight;
 
     std::vector<unsigned int> tract_to_delete;
     for (unsigned int index = 0;index < selected.size();++index)
@@ -1794,8 +2984,10 @@ void TractModel::cut(float select_angle,const std::vector<tipl::vector<3,float>
         {
             new_tract.push_back(std::vector<float>(tract_data[index].begin(),tract_data[index].begin()+selected[index]));
             new_tract_color.push_back(tract_color[index]);
+            new_tract_weight.push_back(tract_weight[index]);
             new_tract.push_back(std::vector<float>(tract_data[index].begin() + selected[index],tract_data[index].end()));
             new_tract_color.push_back(tract_color[index]);
+            new_tract_weight.push_back(tract_weight[index]);
             tract_to_delete.push_back(index);
         }
     if(tract_to_delete.empty())
@@ -1807,6 +2999,7 @@ void TractModel::cut(float select_angle,const std::vector<tipl::vector<3,float>
         tract_data.push_back(std::move(new_tract[index]));
         tract_color.push_back(new_tract_color[index]);
         tract_tag.push_back(cur_cut_id);
+        tract_weight.push_back(new_tract_weight[index]);
     }
     ++cur_cut_id;
     redo_size.clear();
@@ -1858,6 +3051,7 @@ void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater,co
         get_cut_points(tract_data,dim,pos,greater,*T,has_cut);
     std::vector<std::vector<float> > new_tract;
     std::vector<unsigned int> new_tract_color;
+    std::vector<float> new_tract_weight;
     std::vector<unsigned int> tract_to_delete;
     for(unsigned int i = 0;i < tract_data.size();++i)
     {
@@ -1874,6 +3068,7 @@ void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater,co
             {
                 new_tract.push_back(std::vector<float>());
                 new_tract_color.push_back(tract_color[i]);
+                new_tract_weight.push_back(tract_weight[i]);
                 adding = true;
             }
             new_tract.back().push_back(tract_data[i][j]);
@@ -1890,6 +3085,7 @@ void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater,co
             tract_data.push_back(std::move(new_tract[index]));
             tract_color.push_back(new_tract_color[index]);
             tract_tag.push_back(cur_cut_id);
+            tract_weight.push_back(new_tract_weight[index]);
         }
     ++cur_cut_id;
     redo_size.clear();
@@ -2049,6 +3245,7 @@ void TractModel::reconnect_track(float distance,float angular_threshold)
                 tract_data[t2].clear();
             }
         }
+    clear_tract_index();
     erase_empty();
 }
 //---------------------------------------------------------------------------
@@ -2074,10 +3271,17 @@ void TractModel::paint(float select_angle,
 {
     std::vector<unsigned int> selected;
     select(select_angle,dirs,from_pos,selected);
+    size_t from = selected.size(),to = 0;
     for (unsigned int index = 0;index < selected.size();++index)
         if (selected[index] > 0)
+        {
             tract_color[index] = color;
+            from = std::min<size_t>(from,index);
+            to = index+1;
+        }
     color_changed = true;
+    if(from < to)
+        set_changed(from,to);
 }
 
 //---------------------------------------------------------------------------
@@ -2271,6 +3475,7 @@ void TractModel::clear_deleted(void)
     deleted_tract_data.clear();
     deleted_tract_color.clear();
     deleted_tract_tag.clear();
+    deleted_tract_weight.clear();
     redo_size.clear();
 }
 
@@ -2284,9 +3489,11 @@ void TractModel::undo(void)
         tract_data.push_back(std::move(deleted_tract_data.back()));
         tract_color.push_back(deleted_tract_color.back());
         tract_tag.push_back(deleted_tract_tag.back());
+        tract_weight.push_back(deleted_tract_weight.back());
         deleted_tract_data.pop_back();
         deleted_tract_color.pop_back();
         deleted_tract_tag.pop_back();
+        deleted_tract_weight.pop_back();
     }
     // handle the cut situation
     if(is_cut.back())
@@ -2299,6 +3506,7 @@ void TractModel::undo(void)
     is_cut.pop_back();
     deleted_count.pop_back();
     saved = false;
+    set_changed();
 }
 
 
@@ -2325,6 +3533,7 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tracks)
 //---------------------------------------------------------------------------
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract,tipl::rgb color)
 {
+    set_changed(tract_data.size());
     tract_data.reserve(tract_data.size()+new_tract.size());
 
     for (unsigned int index = 0;index < new_tract.size();++index)
@@ -2334,12 +3543,26 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract,tipl::rg
         tract_data.push_back(std::move(new_tract[index]));
         tract_color.push_back(color);
         tract_tag.push_back(0);
+        tract_weight.push_back(1.0f);
     }
     saved = false;
 }
+//---------------------------------------------------------------------------
+void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract,const std::vector<float>& weights)
+{
+    size_t from = tract_data.size();
+    std::vector<unsigned char> added(new_tract.size());
+    for (size_t index = 0;index < new_tract.size();++index)
+        added[index] = !new_tract[index].empty();
+    add_tracts(new_tract);
+    for (size_t index = 0;index < added.size() && index < weights.size();++index)
+        if(added[index])
+            tract_weight[from++] = weights[index];
+}
 
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigned int length_threshold,tipl::rgb color)
 {
+    set_changed(tract_data.size());
     tract_data.reserve(tract_data.size()+new_tract.size()/2.0);
     for (unsigned int index = 0;index < new_tract.size();++index)
     {
@@ -2348,79 +3571,266 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigne
         tract_data.push_back(std::move(new_tract[index]));
         tract_color.push_back(color);
         tract_tag.push_back(0);
+        tract_weight.push_back(1.0f);
     }
     saved = false;
 }
 //---------------------------------------------------------------------------
-void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
-                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+// Calls fun(voxel_index,dir) for each sample of a tract in the output space.
+// When the output is finer than the tract space (e.g. tdi2, tdi4), segments longer
+// than half an output voxel are subdivided so that the map has no gaps. Otherwise
+// only the tract points are sampled, and the first point carries no direction.
+template<typename fun_type>
+void for_each_tdi_sample(const std::vector<float>& tract,const tipl::matrix<4,4,float>& transformation,
+                         const tipl::geometry<3>& geo,bool endpoint,fun_type&& fun)
+{
+    size_t n = tract.size()/3;
+    if(!n)
+        return;
+    auto emit = [&](tipl::vector<3> pos,const tipl::vector<3>& dir)
+    {
+        pos.round();
+        tipl::vector<3,int> ipos(pos);
+        if (geo.is_valid(ipos))
+            fun(tipl::pixel_index<3>::voxel2index(ipos.begin(),geo),dir);
+    };
+    auto get_point = [&](size_t k)
+    {
+        tipl::vector<3> pos(&tract[k*3]);
+        pos.to(transformation);
+        return pos;
+    };
+    tipl::vector<3> prev(get_point(0));
+    if(n == 1)
+    {
+        emit(prev,tipl::vector<3>());
+        return;
+    }
+    if(endpoint)
+    {
+        tipl::vector<3> dir1(get_point(1)-prev),end(get_point(n-1)),dir2(end-get_point(n-2));
+        dir1.normalize();
+        dir2.normalize();
+        emit(prev,dir1);
+        emit(end,dir2);
+        return;
+    }
+    float max_scale = 0.0f;
+    for(unsigned int col = 0;col < 3;++col)
+        max_scale = std::max<float>(max_scale,float(tipl::vector<3>(transformation[col],
+                                                                    transformation[col+4],
+                                                                    transformation[col+8]).length()));
+    if(max_scale <= 1.01f)
+    {
+        emit(prev,tipl::vector<3>());
+        for(size_t k = 1;k < n;++k)
+        {
+            tipl::vector<3> cur(get_point(k)),dir(cur-prev);
+            dir.normalize();
+            emit(cur,dir);
+            prev = cur;
+        }
+        return;
+    }
+    for(size_t k = 1;k < n;++k)
+    {
+        tipl::vector<3> cur(get_point(k)),dir(cur-prev);
+        float length = float(dir.length());
+        unsigned int step = std::max<unsigned int>(1,uint32_t(std::ceil(length*2.0f)));
+        tipl::vector<3> unit_dir(dir);
+        unit_dir.normalize();
+        if(k == 1)
+            emit(prev,unit_dir);
+        for(unsigned int s = 1;s <= step;++s)
+        {
+            tipl::vector<3> pos(dir);
+            pos *= float(s)/float(step);
+            pos += prev;
+            emit(pos,unit_dir);
+        }
+        prev = cur;
+    }
+}
+// Tracts are divided into contiguous blocks, one per shard volume. Shards are
+// summed in block order so that the result does not depend on thread scheduling.
+size_t get_tdi_shard_count(size_t tract_count,size_t voxel_bytes)
+{
+    size_t shard_count = std::max<size_t>(1,std::thread::hardware_concurrency());
+    // keep shard volumes within 2GB
+    shard_count = std::min<size_t>(shard_count,std::max<size_t>(1,(size_t(1) << 31)/std::max<size_t>(1,voxel_bytes)));
+    return std::max<size_t>(1,std::min<size_t>(shard_count,tract_count));
+}
+void get_all_tracts(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                    std::vector<const std::vector<float>*>& tracts,
+                    std::vector<float>& weights)
+{
+    tracts.clear();
+    weights.clear();
+    for(const auto& model : tract_models)
+    {
+        for(const auto& t : model->get_tracts())
+            tracts.push_back(&t);
+        weights.insert(weights.end(),model->get_tract_weights().begin(),model->get_tract_weights().end());
+    }
+}
+// weight(i) is added for tract i, so the weighted version uses float voxels
+template<typename value_type,typename weight_fun>
+void accumulate_density_map(const std::vector<const std::vector<float>*>& tracts,
+                            tipl::image<value_type,3>& mapping,
+                            const tipl::matrix<4,4,float>& transformation,bool endpoint,
+                            weight_fun&& weight)
 {
     tipl::geometry<3> geo = mapping.geometry();
-    tipl::par_for(tract_data.size(),[&](unsigned int i)
+    size_t shard_count = get_tdi_shard_count(tracts.size(),mapping.size()*sizeof(value_type));
+    std::vector<tipl::image<value_type,3> > shards(shard_count);
+    tipl::par_for(shard_count,[&](size_t shard)
     {
-        std::set<size_t> point_set;
-        for (unsigned int j = 0;j < tract_data[i].size();j+=3)
-        {
-            if(j && endpoint)
-                j = uint32_t(tract_data[i].size())-3;
-            tipl::vector<3,float> pos(tract_data[i].begin()+j);
-            pos.to(transformation);
-            pos.round();
-            tipl::vector<3,int> ipos(pos);
-            if (geo.is_valid(ipos))
-                point_set.insert(tipl::pixel_index<3>::voxel2index(ipos.begin(),mapping.geometry()));
+        shards[shard].resize(geo);
+        std::vector<size_t> point_list;
+        for(size_t i = tracts.size()*shard/shard_count;i < tracts.size()*(shard+1)/shard_count;++i)
+        {
+            point_list.clear();
+            for_each_tdi_sample(*tracts[i],transformation,geo,endpoint,[&](size_t pos,const tipl::vector<3>&)
+            {
+                point_list.push_back(pos);
+            });
+            // a tract counts once per voxel
+            std::sort(point_list.begin(),point_list.end());
+            point_list.erase(std::unique(point_list.begin(),point_list.end()),point_list.end());
+            for(auto pos : point_list)
+                shards[shard][pos] += weight(i);
         }
-
-        for(auto pos : point_set)
-            ++mapping[pos];
+    });
+    tipl::par_for(mapping.size(),[&](size_t index)
+    {
+        for(size_t shard = 0;shard < shard_count;++shard)
+            mapping[index] += shards[shard][index];
     });
 }
-//---------------------------------------------------------------------------
-void TractModel::get_density_map(
-        tipl::image<tipl::rgb,3>& mapping,
-        const tipl::matrix<4,4,float>& transformation,bool endpoint)
+void get_density_map(const std::vector<const std::vector<float>*>& tracts,
+                     tipl::image<unsigned int,3>& mapping,
+                     const tipl::matrix<4,4,float>& transformation,bool endpoint)
 {
-    tipl::geometry<3> geo = mapping.geometry();
-    tipl::image<float,3> map_r(geo),map_g(geo),map_b(geo);
-    std::cout << "aggregating tracts to voxels" << std::endl;
-    tipl::par_for (tract_data.size(),[&](unsigned int i)
+    accumulate_density_map(tracts,mapping,transformation,endpoint,[](size_t){return 1u;});
+}
+void get_density_map(const std::vector<const std::vector<float>*>& tracts,
+                     const std::vector<float>& weights,
+                     tipl::image<float,3>& mapping,
+                     const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    accumulate_density_map(tracts,mapping,transformation,endpoint,[&](size_t i){return weights[i];});
+}
+// accumulates the absolute directions of tracts passing each voxel into map_rgb,
+// each scaled by the tract weight if weights is not empty
+void get_direction_map(const std::vector<const std::vector<float>*>& tracts,
+                       const std::vector<float>& weights,
+                       std::vector<tipl::vector<3> >& map_rgb,
+                       const tipl::geometry<3>& geo,
+                       const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    size_t shard_count = get_tdi_shard_count(tracts.size(),geo.size()*sizeof(tipl::vector<3>));
+    std::vector<std::vector<tipl::vector<3> > > shards(shard_count);
+    tipl::par_for(shard_count,[&](size_t shard)
     {
-        const float* buf = &*tract_data[i].begin();
-        for (unsigned int j = 3;j < tract_data[i].size();j+=3)
+        shards[shard].resize(geo.size());
+        for(size_t i = tracts.size()*shard/shard_count;i < tracts.size()*(shard+1)/shard_count;++i)
         {
-            if(j > 3 && endpoint)
-                j = uint32_t(tract_data[i].size()-3);
-            tipl::vector<3,float>  pos(buf+j),dir(buf+j-3);
-            pos.to(transformation);
-            dir.to(transformation);
-            dir -= pos;
-            dir.normalize();
-            pos.round();
-            tipl::vector<3,int> ipos(pos);
-            if (!geo.is_valid(ipos))
-                continue;
-            size_t ptr = tipl::pixel_index<3>::voxel2index(ipos.begin(),mapping.geometry());
-            map_r[ptr] += std::fabs(dir[0]);
-            map_g[ptr] += std::fabs(dir[1]);
-            map_b[ptr] += std::fabs(dir[2]);
+            float w = weights.empty() ? 1.0f : weights[i];
+            for_each_tdi_sample(*tracts[i],transformation,geo,endpoint,[&](size_t pos,const tipl::vector<3>& dir)
+            {
+                shards[shard][pos] += tipl::vector<3>(w*std::fabs(dir[0]),w*std::fabs(dir[1]),w*std::fabs(dir[2]));
+            });
         }
     });
-    std::cout << "generating rgb maps" << std::endl;
+    size_t first_shard = 0;
+    if(map_rgb.size() != geo.size())
+    {
+        map_rgb.swap(shards[0]);
+        first_shard = 1;
+    }
+    tipl::par_for(map_rgb.size(),[&](size_t index)
+    {
+        for(size_t shard = first_shard;shard < shard_count;++shard)
+            map_rgb[index] += shards[shard][index];
+    });
+}
+void direction_map_to_rgb(const std::vector<tipl::vector<3> >& map_rgb,tipl::image<tipl::rgb,3>& mapping)
+{
     float max_value = 0.0f;
     for(size_t index = 0;index < mapping.size();++index)
-        max_value = std::max<float>(max_value,map_r[index]+map_g[index]+map_b[index]);
+        max_value = std::max<float>(max_value,map_rgb[index][0]+map_rgb[index][1]+map_rgb[index][2]);
 
     tipl::par_for(mapping.size(),[&](size_t index)
     {
-        float sum = map_r[index]+map_g[index]+map_b[index];
+        float sum = map_rgb[index][0]+map_rgb[index][1]+map_rgb[index][2];
         if(sum == 0.0f)
             return;
-        tipl::vector<3> v(map_r[index],map_g[index],map_b[index]);
+        tipl::vector<3> v(map_rgb[index]);
         sum = v.normalize();
         v*=255.0f*std::log(200.0f*sum/max_value+1)/2.303f;
         mapping[index] = tipl::rgb(uint8_t(std::min<float>(255,v[0])),uint8_t(std::min<float>(255,v[1])),uint8_t(std::min<float>(255,v[2])));
     });
 }
+void get_density_map(const std::vector<const std::vector<float>*>& tracts,
+                     const std::vector<float>& weights,
+                     tipl::image<tipl::rgb,3>& mapping,
+                     const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<tipl::vector<3> > map_rgb;
+    std::cout << "aggregating tracts to voxels" << std::endl;
+    get_direction_map(tracts,weights,map_rgb,mapping.geometry(),transformation,endpoint);
+    std::cout << "generating rgb maps" << std::endl;
+    direction_map_to_rgb(map_rgb,mapping);
+}
+//---------------------------------------------------------------------------
+void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
+                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<const std::vector<float>*> tracts;
+    for(const auto& t : tract_data)
+        tracts.push_back(&t);
+    ::get_density_map(tracts,mapping,transformation,endpoint);
+}
+//---------------------------------------------------------------------------
+void TractModel::get_density_map(
+        tipl::image<tipl::rgb,3>& mapping,
+        const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<const std::vector<float>*> tracts;
+    for(const auto& t : tract_data)
+        tracts.push_back(&t);
+    ::get_density_map(tracts,tract_weight,mapping,transformation,endpoint);
+}
+//---------------------------------------------------------------------------
+void TractModel::get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                                 tipl::image<unsigned int,3>& mapping,
+                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<const std::vector<float>*> tracts;
+    std::vector<float> weights;
+    get_all_tracts(tract_models,tracts,weights);
+    ::get_density_map(tracts,mapping,transformation,endpoint);
+}
+//---------------------------------------------------------------------------
+void TractModel::get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                                 tipl::image<float,3>& mapping,
+                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<const std::vector<float>*> tracts;
+    std::vector<float> weights;
+    get_all_tracts(tract_models,tracts,weights);
+    ::get_density_map(tracts,weights,mapping,transformation,endpoint);
+}
+//---------------------------------------------------------------------------
+void TractModel::get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                                 tipl::image<tipl::rgb,3>& mapping,
+                                 const tipl::matrix<4,4,float>& transformation,bool endpoint)
+{
+    std::vector<const std::vector<float>*> tracts;
+    std::vector<float> weights;
+    get_all_tracts(tract_models,tracts,weights);
+    ::get_density_map(tracts,weights,mapping,transformation,endpoint);
+}
 bool TractModel::export_end_pdi(
                        const char* file_name,
                        const std::vector<std::shared_ptr<TractModel> >& tract_models,float end_distance)
@@ -2435,18 +3845,12 @@ bool TractModel::export_end_pdi(
     {
         std::vector<tipl::vector<3,short> > p1,p2;
         tract_models[index]->to_end_point_voxels(p1,p2,1.0f,end_distance);
-        tipl::par_for(p1.size(),[&](size_t j)
-        {
-            tipl::vector<3,short> p = p1[j];
+        for(const auto& p : p1)
             if(dim.is_valid(p))
                 p1_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
-        });
-        tipl::par_for(p2.size(),[&](size_t j)
-        {
-            tipl::vector<3,short> p = p2[j];
+        for(const auto& p : p2)
             if(dim.is_valid(p))
                 p2_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
-        });
     }
     tipl::image<float,3> pdi1(p1_map),pdi2(p2_map);
     if(tract_models.size() > 1)
@@ -2496,15 +3900,21 @@ bool TractModel::export_tdi(const char* filename,
     if(color)
     {
         tipl::image<tipl::rgb,3> tdi(dim);
-        for(unsigned int index = 0;index < tract_models.size();++index)
-            tract_models[index]->get_density_map(tdi,transformation,end_point);
+        get_density_map(tract_models,tdi,transformation,end_point);
+        return gz_nifti::save_to_file(filename,tdi,vs,tipl::matrix<4,4,float>(tract_models[0]->trans_to_mni*transformation));
+    }
+    else
+    if(std::any_of(tract_models.begin(),tract_models.end(),[](const std::shared_ptr<TractModel>& t){return t->is_weighted();}))
+    {
+        // importance-weighted tracts give a fractional density
+        tipl::image<float,3> tdi(dim);
+        get_density_map(tract_models,tdi,transformation,end_point);
         return gz_nifti::save_to_file(filename,tdi,vs,tipl::matrix<4,4,float>(tract_models[0]->trans_to_mni*transformation));
     }
     else
     {
         tipl::image<unsigned int,3> tdi(dim);
-        for(unsigned int index = 0;index < tract_models.size();++index)
-            tract_models[index]->get_density_map(tdi,transformation,end_point);
+        get_density_map(tract_models,tdi,transformation,end_point);
         return gz_nifti::save_to_file(filename,tdi,vs,tipl::matrix<4,4,float>(tract_models[0]->trans_to_mni*transformation));
     }
 }
@@ -3055,13 +4465,97 @@ void gradient(input_iterator from,input_iterator to,output_iterator out)
     }
 }
 
+// returns the cached values only if they are current and cover all tracts
+std::shared_ptr<const TractModel::tract_scalar> TractModel::find_tract_scalar(std::shared_ptr<fib_data> handle,unsigned int index_num) const
+{
+    std::lock_guard<std::mutex> lock(scalar_cache_mutex);
+    auto iter = scalar_cache.find(std::make_pair(static_cast<const fib_data*>(handle.get()),handle->view_item[index_num].name));
+    if(iter == scalar_cache.end())
+        return std::shared_ptr<const tract_scalar>();
+    const auto& cache = iter->second;
+    const auto& image = handle->view_item[index_num];
+    if(cache->offset.size() != tract_data.size()+1 ||
+       cache->image_generation != image.generation ||
+       !std::equal(image.iT.begin(),image.iT.end(),cache->iT.begin()))
+        return std::shared_ptr<const tract_scalar>();
+    cache->last_use = ++scalar_cache_tick;
+    return cache;
+}
+std::shared_ptr<const TractModel::tract_scalar> TractModel::get_tract_scalar(std::shared_ptr<fib_data> handle,unsigned int index_num) const
+{
+    std::lock_guard<std::mutex> lock(scalar_cache_mutex);
+    auto key = std::make_pair(static_cast<const fib_data*>(handle.get()),handle->view_item[index_num].name);
+    auto& cache = scalar_cache[key];
+    const auto& image = handle->view_item[index_num];
+    if(!cache.get() || cache->offset.size() > tract_data.size()+1 ||
+       cache->image_generation != image.generation ||
+       !std::equal(image.iT.begin(),image.iT.end(),cache->iT.begin()))
+    {
+        cache = std::make_shared<tract_scalar>();
+        cache->image_generation = image.generation;
+        cache->iT = image.iT;
+    }
+    cache->last_use = ++scalar_cache_tick;
+    size_t from = cache->offset.size()-1;
+    if(from == tract_data.size())
+        return cache;
+    // sample the appended tracts into a new copy, leaving the old one to its readers
+    auto new_cache = std::make_shared<tract_scalar>(*cache);
+    for(size_t i = from;i < tract_data.size();++i)
+        new_cache->offset.push_back(new_cache->offset.back()+tract_data[i].size()/3);
+    new_cache->values.resize(new_cache->offset.back());
+    tipl::par_for(tract_data.size()-from,[&](size_t i)
+    {
+        i += from;
+        if(!tract_data[i].empty())
+            sample_tract_data(handle,uint32_t(i),index_num,&new_cache->values[new_cache->offset[i]]);
+    });
+    cache = new_cache;
+    // drop the least recently used indices beyond the count and memory limits
+    const size_t max_cache_count = 8;
+    const size_t max_cache_bytes = size_t(512) << 20;
+    auto cache_bytes = [](const std::shared_ptr<tract_scalar>& each)
+    {
+        return each->values.size()*sizeof(float)+each->offset.size()*sizeof(size_t);
+    };
+    if(cache_bytes(new_cache) > max_cache_bytes)
+    {
+        // too large to keep: hand it to the caller only
+        scalar_cache.erase(key);
+        return new_cache;
+    }
+    size_t total_bytes = 0;
+    for(const auto& each : scalar_cache)
+        total_bytes += cache_bytes(each.second);
+    while(scalar_cache.size() > max_cache_count || total_bytes > max_cache_bytes)
+    {
+        auto lru = scalar_cache.end();
+        for(auto iter = scalar_cache.begin();iter != scalar_cache.end();++iter)
+            if(iter->first != key && (lru == scalar_cache.end() || iter->second->last_use < lru->second->last_use))
+                lru = iter;
+        if(lru == scalar_cache.end())
+            break;
+        total_bytes -= cache_bytes(lru->second);
+        scalar_cache.erase(lru);
+    }
+    return new_cache;
+}
 void TractModel::get_tract_data(std::shared_ptr<fib_data> handle,unsigned int fiber_index,unsigned int index_num,std::vector<float>& data) const
 {
-    data.clear();
-    if(tract_data[fiber_index].empty())
+    // a single tract is sampled directly unless all tracts are already cached
+    if(auto cache = find_tract_scalar(handle,index_num))
+    {
+        data.assign(cache->values.begin()+int64_t(cache->offset[fiber_index]),
+                    cache->values.begin()+int64_t(cache->offset[fiber_index+1]));
         return;
+    }
+    data.resize(tract_data[fiber_index].size()/3);
+    if(!data.empty())
+        sample_tract_data(handle,fiber_index,index_num,&data[0]);
+}
+void TractModel::sample_tract_data(std::shared_ptr<fib_data> handle,unsigned int fiber_index,unsigned int index_num,float* data) const
+{
     unsigned int count = uint32_t(tract_data[fiber_index].size()/3);
-    data.resize(count);
     // track specific index
     if(index_num < handle->dir.index_data.size())
     {
@@ -3120,32 +4614,94 @@ bool TractModel::get_tracts_data(std::shared_ptr<fib_data> handle,
     unsigned int index_num = handle->get_name_index(index_name);
     if(index_num == handle->view_item.size())
         return false;
+    auto cache = get_tract_scalar(handle,index_num);
     data.clear();
     data.resize(tract_data.size());
     tipl::par_for(tract_data.size(),[&](unsigned int i)
     {
-         get_tract_data(handle,i,index_num,data[i]);
+        data[i].assign(cache->values.begin()+int64_t(cache->offset[i]),
+                       cache->values.begin()+int64_t(cache->offset[i+1]));
     });
     return true;
 }
 void TractModel::get_tracts_data(std::shared_ptr<fib_data> handle,unsigned int data_index,float& mean) const
 {
-    double sum_data = 0.0;
-    size_t total = 0;
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    // the mean of every index is needed only once, so it does not fill the cache
+    double sum = 0.0;
+    size_t count = 0;
+    if(auto cache = find_tract_scalar(handle,data_index))
     {
-        std::vector<float> data;
-        get_tract_data(handle,i,data_index,data);
-        sum_data += std::accumulate(data.begin(),data.end(),0.0);
-        total += data.size();
+        sum = std::accumulate(cache->values.begin(),cache->values.end(),0.0);
+        count = cache->values.size();
     }
-    if(total == 0)
-        mean = 0.0f;
     else
-        mean = float(sum_data/double(total));
+    {
+        std::mutex sum_mutex;
+        tipl::par_for(tract_data.size(),[&](size_t i)
+        {
+            if(tract_data[i].empty())
+                return;
+            std::vector<float> data(tract_data[i].size()/3);
+            sample_tract_data(handle,uint32_t(i),data_index,&data[0]);
+            double tract_sum = std::accumulate(data.begin(),data.end(),0.0);
+            std::lock_guard<std::mutex> lock(sum_mutex);
+            sum += tract_sum;
+            count += data.size();
+        });
+    }
+    mean = count ? float(sum/double(count)) : 0.0f;
+}
+
+void get_tract_passing_regions(const std::vector<float>& tract,
+                               const tipl::geometry<3>& geo,
+                               const region_label_map& region_map,
+                               std::vector<unsigned char>& has_region,
+                               std::vector<short>& regions)
+{
+    regions.clear();
+    if(tract.size() < 6)
+        return;
+    std::fill(has_region.begin(),has_region.end(),0);
+    for(unsigned int ptr = 0;ptr < tract.size();ptr += 3)
+    {
+        tipl::pixel_index<3> pos(std::round(tract[ptr]),
+                                    std::round(tract[ptr+1]),
+                                    std::round(tract[ptr+2]),geo);
+        if(!geo.is_valid(pos))
+            continue;
+        region_map.for_each_region(pos.index(),[&](short region)
+        {
+            if(uint32_t(region) < has_region.size())
+                has_region[uint32_t(region)] = 1;
+        });
+    }
+    for(unsigned int i = 0;i < has_region.size();++i)
+        if(has_region[i])
+            regions.push_back(short(i));
+}
+void get_tract_end_regions(const std::vector<float>& tract,
+                           const tipl::geometry<3>& geo,
+                           const region_label_map& region_map,
+                           std::vector<short>& end1_regions,
+                           std::vector<short>& end2_regions)
+{
+    end1_regions.clear();
+    end2_regions.clear();
+    if(tract.size() < 6)
+        return;
+    tipl::pixel_index<3> end1(std::round(tract[0]),
+                                std::round(tract[1]),
+                                std::round(tract[2]),geo);
+    tipl::pixel_index<3> end2(std::round(tract[tract.size()-3]),
+                                std::round(tract[tract.size()-2]),
+                                std::round(tract[tract.size()-1]),geo);
+    if(!geo.is_valid(end1) || !geo.is_valid(end2))
+        return;
+    region_map.get_regions(end1.index(),end1_regions);
+    region_map.get_regions(end2.index(),end2_regions);
 }
 
-void TractModel::get_passing_list(const std::vector<std::vector<short> >& region_map,
+void TractModel::get_passing_list(const region_label_map& region_map,
                                   unsigned int region_count,
                                   std::vector<std::vector<short> >& passing_list1,
                                   std::vector<std::vector<short> >& passing_list2) const
@@ -3154,34 +4710,17 @@ void TractModel::get_passing_list(const std::vector<std::vector<short> >& region
     passing_list1.resize(tract_data.size());
     passing_list2.clear();
     passing_list2.resize(tract_data.size());
-    // create regions maps
-
+    if(region_map.label.geometry() != geo)
+        return;
     tipl::par_for(tract_data.size(),[&](unsigned int index)
     {
-        if(tract_data[index].size() < 6)
-            return;
         std::vector<unsigned char> has_region(region_count);
-        for(unsigned int ptr = 0;ptr < tract_data[index].size();ptr += 3)
-        {
-            tipl::pixel_index<3> pos(std::round(tract_data[index][ptr]),
-                                        std::round(tract_data[index][ptr+1]),
-                                        std::round(tract_data[index][ptr+2]),geo);
-            if(!geo.is_valid(pos))
-                continue;
-            unsigned int pos_index = uint32_t(pos.index());
-            for(unsigned int j = 0;j < region_map[pos_index].size();++j)
-                has_region[uint32_t(region_map[pos_index][j])] = 1;
-        }
-        for(unsigned int i = 0;i < has_region.size();++i)
-            if(has_region[i])
-            {
-                passing_list1[index].push_back(short(i));
-                passing_list2[index].push_back(short(i));
-            }
+        get_tract_passing_regions(tract_data[index],geo,region_map,has_region,passing_list1[index]);
+        passing_list2[index] = passing_list1[index];
     });
 }
 
-void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map,
+void TractModel::get_end_list(const region_label_map& region_map,
                               std::vector<std::vector<short> >& end_pair1,
                               std::vector<std::vector<short> >& end_pair2) const
 {
@@ -3189,20 +4728,11 @@ void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map
     end_pair1.resize(tract_data.size());
     end_pair2.clear();
     end_pair2.resize(tract_data.size());
+    if(region_map.label.geometry() != geo)
+        return;
     tipl::par_for(tract_data.size(),[&](unsigned int index)
     {
-        if(tract_data[index].size() < 6)
-            return;
-        tipl::pixel_index<3> end1(std::round(tract_data[index][0]),
-                                    std::round(tract_data[index][1]),
-                                    std::round(tract_data[index][2]),geo);
-        tipl::pixel_index<3> end2(std::round(tract_data[index][tract_data[index].size()-3]),
-                                    std::round(tract_data[index][tract_data[index].size()-2]),
-                                    std::round(tract_data[index][tract_data[index].size()-1]),geo);
-        if(!geo.is_valid(end1) || !geo.is_valid(end2))
-            return;
-        end_pair1[index] = region_map[end1.index()];
-        end_pair2[index] = region_map[end2.index()];
+        get_tract_end_regions(tract_data[index],geo,region_map,end_pair1[index],end_pair2[index]);
     });
 }
 
@@ -3210,7 +4740,7 @@ void TractModel::get_end_list(const std::vector<std::vector<short> >& region_map
 void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_count,float detail)
 {
     float param[4] = {0};
-    if(method_id)// k-means or EM
+    if(method_id == 1 || method_id == 2)// k-means or EM
         param[0] = cluster_count;
     else
     {
@@ -3224,17 +4754,20 @@ void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_cou
         c.reset(new TractCluster(param));
         break;
     case 1:
-        c.reset(new FeatureBasedClutering<tipl::ml::k_means<double,unsigned char> >(param));
+        c.reset(new FeatureBasedClutering<tipl::ml::k_means<double,unsigned int> >(param));
         break;
     case 2:
-        c.reset(new FeatureBasedClutering<tipl::ml::expectation_maximization<double,unsigned char> >(param));
+        c.reset(new FeatureBasedClutering<tipl::ml::expectation_maximization<double,unsigned int> >(param));
+        break;
+    case 3:
+        c.reset(new QuickBundleCluster(param));
         break;
     }
 
     c->add_tracts(tract_data);
     c->run_clustering();
     {
-        cluster_count = method_id ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
+        cluster_count = (method_id == 1 || method_id == 2) ? c->get_cluster_count() : std::min<float>(c->get_cluster_count(),cluster_count);
         tract_cluster.resize(tract_data.size());
         std::fill(tract_cluster.begin(),tract_cluster.end(),cluster_count);
         for(int index = 0;index < cluster_count;++index)
@@ -3317,32 +4850,48 @@ void ConnectivityMatrix::set_regions(const tipl::geometry<3>& geo,
                                      const std::vector<std::shared_ptr<ROIRegion> >& regions)
 {
     region_count = regions.size();
-    region_map.clear();
-    region_map.resize(geo.size());
+    region_map.resize(geo);
 
-    std::vector<std::set<uint16_t> > regions_set(geo.size());
+    // voxels shared by more than one region are collected here, keyed by position
+    std::map<uint32_t,std::vector<short> > overlap;
     for(size_t roi = 0;roi < regions.size();++roi)
     {
-        std::vector<tipl::vector<3,short> > points;
-        regions[roi]->get_region_voxels(points);
+        // read the stored voxels directly unless they need rescaling
+        std::vector<tipl::vector<3,short> > scaled_points;
+        if(regions[roi]->resolution_ratio != 1.0f)
+            regions[roi]->get_region_voxels(scaled_points);
+        const auto& points = (regions[roi]->resolution_ratio != 1.0f ? scaled_points : regions[roi]->get_region_voxels_raw());
         for(size_t index = 0;index < points.size();++index)
         {
             tipl::vector<3,short> pos = points[index];
-            if(geo.is_valid(pos))
-                regions_set[tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index()].insert(uint16_t(roi));
+            if(!geo.is_valid(pos))
+                continue;
+            auto pos_index = uint32_t(tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index());
+            auto& label = region_map.label[pos_index];
+            if(!label)
+            {
+                label = uint16_t(roi+1);
+                continue;
+            }
+            if(label == uint16_t(roi+1))
+                continue;
+            if(label != region_label_map::overflow_label)
+            {
+                overlap[pos_index].push_back(short(label-1));
+                label = region_label_map::overflow_label;
+            }
+            auto& list = overlap[pos_index];
+            if(list.back() != short(roi))
+                list.push_back(short(roi));
         }
     }
-    unsigned int overlap_count = 0,total_count = 0;
-    for(unsigned int index = 0;index < geo.size();++index)
-        if(!regions_set[index].empty())
-        {
-            for(auto i : regions_set[index])
-                region_map[index].push_back(short(i));
-            ++total_count;
-            if(region_map[index].size() > 1)
-                ++overlap_count;
-        }
-    overlap_ratio = float(overlap_count)/float(total_count);
+    std::vector<std::vector<std::pair<uint32_t,std::vector<short> > > > overflow(1);
+    for(auto& each : overlap)
+        overflow[0].push_back(std::make_pair(each.first,std::move(each.second)));
+    region_map.set_overflow(overflow);
+
+    size_t total_count = region_map.labeled_count();
+    overlap_ratio = total_count ? float(region_map.overflow_pos.size())/float(total_count) : 0.0f;
     atlas_name = "roi";
 }
 
@@ -3350,33 +4899,29 @@ void ConnectivityMatrix::set_atlas(std::shared_ptr<atlas> data,const tipl::image
 {
     if(mni_position.empty())
         return;
-    tipl::geometry<3> geo(mni_position.geometry());
-    tipl::vector<3> null;
     region_count = data->get_list().size();
     region_name.clear();
     for (unsigned int label_index = 0; label_index < region_count; ++label_index)
         region_name.push_back(data->get_list()[label_index]);
-    data->is_labeled_as(mni_position.front(),0);// trigger load from file
 
-    region_map.clear();
-    region_map.resize(geo.size());
-    for(unsigned int i = 0;i < region_count;++i)
-    {
-        mni_position.for_each_mt([&](const tipl::vector<3,float>& mni,const tipl::pixel_index<3>& index)
-        {
-            if(mni != null && data->is_labeled_as(mni,i))
-                region_map[index.index()].push_back(short(i));
-        });
-    }
-    unsigned int overlap_count = 0,total_count = 0;
-    for(unsigned int index = 0;index < geo.size();++index)
-        if(!region_map[index].empty())
-        {
-            ++total_count;
-            if(region_map[index].size() > 1)
-                ++overlap_count;
-        }
-    overlap_ratio = float(overlap_count)/float(total_count);
+    // warp the atlas into subject space once instead of scanning the volume for each region
+    data->get_label_map(mni_position,region_map);
+
+    size_t total_count = region_map.labeled_count();
+    overlap_ratio = total_count ? float(region_map.overflow_pos.size())/float(total_count) : 0.0f;
+    atlas_name = data->name;
+}
+
+void ConnectivityMatrix::set_atlas(std::shared_ptr<atlas> data,std::shared_ptr<fib_data> handle)
+{
+    auto label_map = handle->get_atlas_label_map(data);
+    if(!label_map.get())
+        return;
+    region_count = data->get_list().size();
+    region_name = data->get_list();
+    region_map = *label_map;
+    size_t total_count = region_map.labeled_count();
+    overlap_ratio = total_count ? float(region_map.overflow_pos.size())/float(total_count) : 0.0f;
     atlas_name = data->name;
 }
 
@@ -3389,27 +4934,30 @@ void init_matrix(m_type& m,unsigned int size)
         m[i].resize(size);
 }
 
+template<class T,class fun_type>
+void for_each_region_pair(unsigned int index,const T& r1,const T& r2,fun_type&& lambda_fun)
+{
+    for(unsigned int i = 0;i < r1.size();++i)
+        for(unsigned int j = 0;j < r2.size();++j)
+            if(r1[i] != r2[j])
+            {
+                lambda_fun(index,uint32_t(r1[i]),uint32_t(r2[j]));
+                lambda_fun(index,uint32_t(r2[j]),uint32_t(r1[i]));
+            }
+}
+
 template<class T,class fun_type>
 void for_each_connectivity(const T& end_list1,
                            const T& end_list2,
                            fun_type lambda_fun)
 {
     for(unsigned int index = 0;index < end_list1.size();++index)
-    {
-        const auto& r1 = end_list1[index];
-        const auto& r2 = end_list2[index];
-        for(unsigned int i = 0;i < r1.size();++i)
-            for(unsigned int j = 0;j < r2.size();++j)
-                if(r1[i] != r2[j])
-                {
-                    lambda_fun(index,uint32_t(r1[i]),uint32_t(r2[j]));
-                    lambda_fun(index,uint32_t(r2[j]),uint32_t(r1[i]));
-                }
-    }
+        for_each_region_pair(index,end_list1[index],end_list2[index],lambda_fun);
 }
 
 bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
-                                   TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold)
+                                   TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold,
+                                   const std::string& trk_file_prefix)
 {
     if(region_count == 0)
     {
@@ -3437,7 +4985,7 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
             {
                 if(region_passing_list[i][j].empty())
                     continue;
-                std::string file_name = region_name[i]+"_"+region_name[j]+".tt.gz";
+                std::string file_name = trk_file_prefix+region_name[i]+"_"+region_name[j]+".tt.gz";
                 TractModel tm(tract_model.geo,tract_model.vs);
                 tm.report = tract_model.report;
                 tm.trans_to_mni = tract_model.trans_to_mni;
@@ -3452,19 +5000,20 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
     }
     matrix_value.clear();
     matrix_value.resize(tipl::geometry<2>(uint32_t(region_count),uint32_t(region_count)));
-    std::vector<std::vector<unsigned int> > count;
+    // tracts are counted by their weights, which are 1 unless seeds were importance-sampled
+    std::vector<std::vector<float> > count;
     init_matrix(count,uint32_t(region_count));
 
     for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int,unsigned int i,unsigned int j){
-        ++count[i][j];
+                          [&](unsigned int index,unsigned int i,unsigned int j){
+        count[i][j] += tract_model.get_tract_weight(index);
     });
 
     // determine the threshold for counting the connectivity
-    unsigned int threshold_count = 0;
+    float threshold_count = 0.0f;
     for(unsigned int i = 0,index = 0;i < count.size();++i)
         for(unsigned int j = 0;j < count[i].size();++j,++index)
-            threshold_count = std::max<unsigned int>(threshold_count,count[i][j]);
+            threshold_count = std::max<float>(threshold_count,count[i][j]);
     threshold_count *= threshold;
 
     if(matrix_value_type == "count")
@@ -3507,14 +5056,15 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
 
     if(matrix_value_type == "mean_length")
     {
-        std::vector<std::vector<unsigned int> > sum_length,sum_n;
+        std::vector<std::vector<float> > sum_length,sum_n;
         init_matrix(sum_length,uint32_t(region_count));
         init_matrix(sum_n,uint32_t(region_count));
 
         for_each_connectivity(end_list1,end_list2,
                               [&](unsigned int index,unsigned int i,unsigned int j){
-            sum_length[i][j] += tract_model.get_tract_length(index);
-            ++sum_n[i][j];
+            float w = tract_model.get_tract_weight(index);
+            sum_length[i][j] += w*float(tract_model.get_tract_length(index));
+            sum_n[i][j] += w;
         });
 
         for(unsigned int i = 0,index = 0;i < count.size();++i)
@@ -3540,43 +5090,332 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
 
     for_each_connectivity(end_list1,end_list2,
                           [&](unsigned int index,unsigned int i,unsigned int j){
-        sum[i][j] += m[index];
+        sum[i][j] += tract_model.get_tract_weight(index)*m[index];
     });
 
 
     for(unsigned int i = 0,index = 0;i < count.size();++i)
         for(unsigned int j = 0;j < count[i].size();++j,++index)
-            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/float(count[i][j]) : 0.0f);
+            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/count[i][j] : 0.0f);
     return true;
 
 }
-template<class matrix_type>
-void distance_bin(const matrix_type& bin,tipl::image<float,2>& D)
+
+// partial sums of one region set and one counting type (end/pass) from one thread.
+// every sum is weighted by the tract weight, so count is a weighted count.
+struct connectivity_partial{
+    std::vector<double> count,sum_length;
+    std::vector<double> sum_inv_length;
+    std::vector<std::vector<double> > sum_index;
+    void init(size_t n,size_t index_count)
+    {
+        count.resize(n*n);
+        sum_length.resize(n*n);
+        sum_inv_length.resize(n*n);
+        sum_index.resize(index_count);
+        for(auto& each : sum_index)
+            each.resize(n*n);
+    }
+    void add(const connectivity_partial& rhs)
+    {
+        tipl::add(count,rhs.count);
+        tipl::add(sum_length,rhs.sum_length);
+        tipl::add(sum_inv_length,rhs.sum_inv_length);
+        for(size_t i = 0;i < sum_index.size();++i)
+            tipl::add(sum_index[i],rhs.sum_index[i]);
+    }
+};
+
+bool ConnectivityMatrix::calculate_all(std::shared_ptr<fib_data> handle,
+                                       TractModel& tract_model,
+                                       std::vector<std::shared_ptr<ConnectivityMatrix> >& matrices,
+                                       const std::vector<std::string>& value_types,
+                                       bool use_end,bool use_pass,float threshold,
+                                       std::string& error_msg)
 {
-    unsigned int n = bin.width();
-    tipl::image<unsigned int,2> A,Lpath;
-    A = bin;
-    Lpath = bin;
-    D = bin;
-    for(unsigned int l = 2;1;++l)
-    {
-        tipl::image<unsigned int,2> t(A.geometry());
-        tipl::mat::product(Lpath.begin(),A.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        std::swap(Lpath,t);
-        bool con = false;
-        for(unsigned int i = 0;i < D.size();++i)
-            if(Lpath[i] != 0 && D[i] == 0)
+    bool fetched = false;
+    return calculate_all(handle,[&](void)->TractModel*
+    {
+        if(fetched)
+            return nullptr;
+        fetched = true;
+        return &tract_model;
+    },matrices,value_types,use_end,use_pass,threshold,error_msg);
+}
+bool ConnectivityMatrix::calculate_all(std::shared_ptr<fib_data> handle,
+                                       std::function<TractModel*(void)> next_chunk,
+                                       std::vector<std::shared_ptr<ConnectivityMatrix> >& matrices,
+                                       const std::vector<std::string>& value_types,
+                                       bool use_end,bool use_pass,float threshold,
+                                       std::string& error_msg)
+{
+    // value types that accumulate a per-tract mean of an index
+    std::vector<std::string> index_name;
+    std::vector<unsigned int> index_num;
+    bool need_length_list = false;
+    for(const auto& value_type : value_types)
+    {
+        if(value_type == "count" || value_type == "ncount2" || value_type == "mean_length")
+            continue;
+        if(value_type == "ncount")
+        {
+            need_length_list = true;
+            continue;
+        }
+        unsigned int num = uint32_t(handle->get_name_index(value_type));
+        if(num == handle->view_item.size())
+        {
+            error_msg = "Cannot quantify matrix value using ";
+            error_msg += value_type;
+            return false;
+        }
+        if(num >= handle->dir.index_data.size())
+            handle->view_item[num].get_image(); // load image before the multi-thread access
+        index_name.push_back(value_type);
+        index_num.push_back(num);
+    }
+    for(auto& each : matrices)
+        if(each->region_count == 0)
+        {
+            error_msg = "No region information. Please assign regions";
+            return false;
+        }
+
+    // partial[slot][matrix*2+type], type 0: end 1: pass
+    // a slot holds n-by-n sums of every region set, so the slot count is capped by
+    // a memory budget and threads beyond it share slots under a lock.
+    // the (matrix position, length) lists for ncount grow with the tracts rather than
+    // the slots, so there is one list per region set and type outside the slots.
+    std::vector<std::vector<std::pair<uint32_t,uint32_t> > > length_list(need_length_list ? matrices.size()*2 : 0);
+    std::vector<std::mutex> length_list_mutex(length_list.size());
+    size_t slot_size = 0;
+    for(auto& each : matrices)
+        slot_size += size_t(each->region_count)*size_t(each->region_count)*
+                     (3+index_num.size())*sizeof(double)*
+                     ((use_end ? 1:0)+(use_pass ? 1:0));
+    const size_t partial_memory_budget = size_t(1) << 30;
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    unsigned int slot_count = uint32_t(std::max<size_t>(1,std::min<size_t>(thread_count,
+                                       partial_memory_budget/std::max<size_t>(1,slot_size))));
+    std::vector<std::vector<connectivity_partial> > partial(slot_count);
+    std::vector<std::mutex> slot_mutex(slot_count);
+    for(auto& thread_partial : partial)
+    {
+        thread_partial.resize(matrices.size()*2);
+        for(size_t m = 0;m < matrices.size();++m)
+        {
+            if(use_end)
+                thread_partial[m*2].init(matrices[m]->region_count,index_num.size());
+            if(use_pass)
+                thread_partial[m*2+1].init(matrices[m]->region_count,index_num.size());
+        }
+    }
+
+    // the partial sums are additive, so chunks of tracts accumulate into them one after another
+    for(TractModel* chunk = next_chunk();chunk;chunk = next_chunk())
+    {
+        TractModel& tract_model = *chunk;
+        std::vector<std::shared_ptr<const TractModel::tract_scalar> > scalar;
+        for(auto i : index_num)
+            scalar.push_back(tract_model.get_tract_scalar(handle,i));
+        const auto& tracts = tract_model.get_tracts();
+        const auto& geo = tract_model.geo;
+        tipl::par_for2(tracts.size(),[&](size_t index,unsigned int thread)
+        {
+            const auto& tract = tracts[index];
+            if(tract.size() < 6)
+                return;
+            // sample each index once and share it with all region sets
+            std::vector<float> mean_index(index_num.size());
+            for(size_t i = 0;i < index_num.size();++i)
+                if(scalar[i]->begin(index) != scalar[i]->end(index))
+                    mean_index[i] = float(tipl::mean(scalar[i]->begin(index),scalar[i]->end(index)));
+            auto length = uint32_t(tract.size());
+            double weight = double(tract_model.get_tract_weight(uint32_t(index)));
+            // look up the regions of every region set before taking the slot
+            std::vector<std::vector<short> > r1(matrices.size()*2),r2(matrices.size()*2);
+            for(size_t m = 0;m < matrices.size();++m)
             {
-                D[i] = l;
-                con = true;
+                const auto& region_map = matrices[m]->region_map;
+                if(region_map.label.geometry() != geo)
+                    continue;
+                if(use_end)
+                    get_tract_end_regions(tract,geo,region_map,r1[m*2],r2[m*2]);
+                if(use_pass)
+                {
+                    std::vector<unsigned char> has_region(uint32_t(matrices[m]->region_count));
+                    get_tract_passing_regions(tract,geo,region_map,has_region,r1[m*2+1]);
+                    r2[m*2+1] = r1[m*2+1];
+                }
             }
-        if(!con)
-            break;
+            unsigned int slot = thread % slot_count;
+            {
+                std::unique_lock<std::mutex> lock(slot_mutex[slot],std::defer_lock);
+                if(slot_count < thread_count)
+                    lock.lock();
+                for(size_t m = 0;m < matrices.size()*2;++m)
+                {
+                    auto n = uint32_t(matrices[m/2]->region_count);
+                    auto& p = partial[slot][m];
+                    for_each_region_pair(uint32_t(index),r1[m],r2[m],[&](unsigned int,unsigned int i,unsigned int j)
+                    {
+                        size_t pos = i*n+j;
+                        p.count[pos] += weight;
+                        p.sum_length[pos] += weight*double(length);
+                        p.sum_inv_length[pos] += weight/double(length);
+                        for(size_t k = 0;k < mean_index.size();++k)
+                            p.sum_index[k][pos] += weight*double(mean_index[k]);
+                    });
+                }
+            }
+            if(need_length_list)
+                for(size_t m = 0;m < matrices.size()*2;++m)
+                {
+                    auto n = uint32_t(matrices[m/2]->region_count);
+                    std::vector<std::pair<uint32_t,uint32_t> > pairs;
+                    for_each_region_pair(uint32_t(index),r1[m],r2[m],[&](unsigned int,unsigned int i,unsigned int j)
+                    {
+                        pairs.push_back(std::make_pair(uint32_t(i*n+j),length));
+                    });
+                    if(pairs.empty())
+                        continue;
+                    std::lock_guard<std::mutex> lock(length_list_mutex[m]);
+                    length_list[m].insert(length_list[m].end(),pairs.begin(),pairs.end());
+                }
+        });
+    }
+
+    for(size_t m = 0;m < matrices.size();++m)
+    {
+        auto& matrix = *matrices[m];
+        auto n = uint32_t(matrix.region_count);
+        matrix.matrix_values.clear();
+        for(unsigned int type = 0;type < 2;++type)
+        {
+            if((type == 0 && !use_end) || (type == 1 && !use_pass))
+                continue;
+            connectivity_partial& sum = partial[0][m*2+type];
+            for(size_t t = 1;t < partial.size();++t)
+            {
+                sum.add(partial[t][m*2+type]);
+                partial[t][m*2+type] = connectivity_partial();
+            }
+            double threshold_count = *std::max_element(sum.count.begin(),sum.count.end());
+            threshold_count *= double(threshold);
+
+            std::vector<std::vector<unsigned int> > length_matrix;
+            if(need_length_list)
+            {
+                length_matrix.resize(size_t(n)*n);
+                for(const auto& each : length_list[m*2+type])
+                    length_matrix[each.first].push_back(each.second);
+                std::vector<std::pair<uint32_t,uint32_t> >().swap(length_list[m*2+type]);
+            }
+            for(const auto& value_type : value_types)
+            {
+                tipl::image<float,2> value(tipl::geometry<2>(n,n));
+                if(value_type == "count")
+                {
+                    for(size_t i = 0;i < value.size();++i)
+                        value[i] = (sum.count[i] > threshold_count ? float(sum.count[i]) : 0.0f);
+                }
+                else
+                if(value_type == "ncount" || value_type == "ncount2")
+                {
+                    for(size_t i = 0;i < value.size();++i)
+                        if(sum.count[i] && sum.count[i] >= threshold_count)
+                            value[i] = float(sum.count[i])*(value_type == "ncount" ?
+                                1.0f/tipl::median(length_matrix[i].begin(),length_matrix[i].end()) :
+                                float(sum.sum_inv_length[i]));
+                }
+                else
+                if(value_type == "mean_length")
+                {
+                    for(size_t i = 0;i < value.size();++i)
+                        if(sum.count[i] && sum.count[i] > threshold_count)
+                            value[i] = float(sum.sum_length[i])/float(sum.count[i])/3.0f;
+                }
+                else
+                {
+                    size_t k = size_t(std::find(index_name.begin(),index_name.end(),value_type)-index_name.begin());
+                    for(size_t i = 0;i < value.size();++i)
+                        value[i] = (sum.count[i] > threshold_count ? float(sum.sum_index[k][i])/float(sum.count[i]) : 0.0f);
+                }
+                matrix.matrix_values[value_type + (type == 0 ? ".end":".pass")].swap(value);
+            }
+            sum = connectivity_partial();
+        }
+    }
+    return true;
+}
+
+bool ConnectivityMatrix::set_matrix_value(const std::string& value_type,bool use_end_only)
+{
+    auto iter = matrix_values.find(value_type + (use_end_only ? ".end":".pass"));
+    if(iter == matrix_values.end())
+        return false;
+    matrix_value = iter->second;
+    return true;
+}
+
+template<class matrix_type>
+void distance_bin(const matrix_type& bin,tipl::image<float,2>& D,bool multithread = true)
+{
+    unsigned int n = bin.width();
+    D.clear();
+    D.resize(bin.geometry());
+    std::vector<std::vector<unsigned int> > neighbors(n);
+    for(unsigned int i = 0,index = 0;i < n;++i)
+        for(unsigned int j = 0;j < n;++j,++index)
+            if(bin[index] != 0)
+                neighbors[i].push_back(j);
+    // breadth-first search from every source gives the hop count
+    auto search = [&](unsigned int i)
+    {
+        float* d = &D[0] + size_t(i)*n;
+        std::vector<unsigned char> visited(n);
+        std::vector<unsigned int> front,next;
+        visited[i] = 1;
+        front.push_back(i);
+        for(unsigned int l = 1;!front.empty();++l)
+        {
+            next.clear();
+            for(auto v : front)
+                for(auto k : neighbors[v])
+                    if(!visited[k])
+                    {
+                        visited[k] = 1;
+                        d[k] = l;
+                        next.push_back(k);
+                    }
+            front.swap(next);
+        }
+    };
+    if(multithread)
+        tipl::par_for(n,search);
+    else
+        for(unsigned int i = 0;i < n;++i)
+            search(i);
+    // the diagonal is the shortest closed walk, as in the matrix power formulation
+    std::vector<float> closed_walk(n);
+    for(unsigned int i = 0;i < n;++i)
+    {
+        float min_d = std::numeric_limits<float>::max();
+        for(auto k : neighbors[i])
+        {
+            float d = (k == i) ? 0.0f : D[size_t(k)*n+i];
+            if(k != i && d == 0.0f)
+                continue;
+            min_d = std::min<float>(min_d,d+1.0f);
+        }
+        closed_walk[i] = (min_d == std::numeric_limits<float>::max()) ? 0.0f : min_d;
     }
+    for(unsigned int i = 0,dg = 0;i < n;++i,dg += n + 1)
+        D[dg] = closed_walk[i];
     std::replace(D.begin(),D.end(),(float)0,std::numeric_limits<float>::max());
 }
 template<class matrix_type>
-void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
+void distance_wei(const matrix_type& W_,tipl::image<float,2>& D,bool multithread = true)
 {
     tipl::image<float,2> W(W_);
     for(unsigned int i = 0;i < W.size();++i)
@@ -3587,28 +5426,25 @@ void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
     std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
     for(unsigned int i = 0,dg = 0;i < n;++i,dg += n + 1)
         D[dg] = 0;
-    for(unsigned int i = 0,in = 0;i < n;++i,in += n)
+    // Dijkstra from every source, each writing its own row of D
+    auto search = [&](unsigned int i)
     {
+        unsigned int in = i*n;
         std::vector<unsigned char> S(n);
-        tipl::image<float,2> W1(W);
-
         std::vector<unsigned int> V;
         V.push_back(i);
         while(1)
         {
+            // edges into visited nodes are ignored
             for(unsigned int j = 0;j < V.size();++j)
-            {
                 S[V[j]] = 1;
-                for(unsigned int k = V[j];k < W1.size();k += n)
-                    W1[k] = 0;
-            }
             for(unsigned int j = 0;j < V.size();++j)
             {
                 unsigned int v = V[j];
                 unsigned int vn = v*n;
                 for(unsigned int k = 0;k < n;++k)
-                if(W1[vn+k] > 0)
-                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W1[vn+k]);
+                if(!S[k] && W[vn+k] > 0)
+                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W[vn+k]);
             }
             float minD = std::numeric_limits<float>::max();
             for(unsigned int j = 0;j < n;++j)
@@ -3621,7 +5457,12 @@ void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
                 if(D[in+j]  == minD)
                     V.push_back(j);
         }
-    }
+    };
+    if(multithread)
+        tipl::par_for(n,search);
+    else
+        for(unsigned int i = 0;i < n;++i)
+            search(i);
     std::replace(D.begin(),D.end(),(float)0.0,std::numeric_limits<float>::max());
 }
 template<class matrix_type>
@@ -3671,16 +5512,18 @@ void ConnectivityMatrix::network_property(std::string& report)
         strength[i] = std::accumulate(norm_matrix.begin()+i*n,norm_matrix.begin()+(i+1)*n,0.0);
     // calculate clustering coefficient
     std::vector<float> cluster_co(n);
-    for(unsigned int i = 0,posi = 0;i < n;++i,posi += n)
-    if(degree[i] >= 2)
+    tipl::par_for(n,[&](unsigned int i)
     {
+        if(degree[i] < 2)
+            return;
+        unsigned int posi = i*n;
         for(unsigned int j = 0,index = 0;j < n;++j)
             for(unsigned int k = 0;k < n;++k,++index)
                 if(binary_matrix[posi + j] && binary_matrix[posi + k])
                     cluster_co[i] += binary_matrix[index];
         float d = degree[i];
         cluster_co[i] /= (d*d-d);
-    }
+    });
     float cc_bin = tipl::mean(cluster_co.begin(),cluster_co.end());
     out << "clustering_coeff_average(binary)\t" << cc_bin << std::endl;
 
@@ -3767,12 +5610,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> local_efficiency_bin(n);
     //claculate local efficiency
     {
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -3784,21 +5628,21 @@ void ConnectivityMatrix::network_property(std::string& report)
                         ++pos;
                     }
             tipl::image<float,2> invD;
-            distance_bin(newA,invD);
+            distance_bin(newA,invD,false);
             inv_dis(invD,invD);
             local_efficiency_bin[i] = std::accumulate(invD.begin(),invD.end(),0.0)/(new_n*new_n-new_n);
-        }
+        });
     }
 
     std::vector<float> local_efficiency_wei(n);
     {
-
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -3814,14 +5658,14 @@ void ConnectivityMatrix::network_property(std::string& report)
                 if(binary_matrix[ipos+j])
                     sw.push_back(std::pow(norm_matrix[ipos+j],(float)(1.0/3.0)));
             tipl::image<float,2> invD;
-            distance_wei(newA,invD);
+            distance_wei(newA,invD,false);
             inv_dis(invD,invD);
             float numer = 0.0;
             for(unsigned int j = 0,index = 0;j < new_n;++j)
                 for(unsigned int k = 0;k < new_n;++k,++index)
                     numer += std::pow(invD[index],(float)(1.0/3.0))*sw[j]*sw[k];
             local_efficiency_wei[i] = numer/(new_n*new_n-new_n);
-        }
+        });
     }
 
 
@@ -3968,24 +5812,28 @@ void ConnectivityMatrix::network_property(std::string& report)
     }
     std::vector<float> betweenness_wei(n);
     {
-        for(unsigned int i = 0;i < n;++i)
+        // per suggestion from Mikail Rubinov, the matrix has to be "granulated"
+        tipl::image<float,2> granulated_matrix(norm_matrix);
+        {
+            float eps = max_value*0.001f;
+            for(size_t i = 0;i < granulated_matrix.size();++i)
+                if(granulated_matrix[i] > 0.0f && granulated_matrix[i] < eps)
+                    granulated_matrix[i] = eps;
+        }
+        // contribution of each source node, summed in source order afterward
+        std::vector<std::vector<float> > source_betweenness(n);
+        tipl::par_for(n,[&](unsigned int i)
         {
             std::vector<float> D(n),NP(n);
             std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
             D[i] = 0;
             NP[i] = 1;
-            std::vector<unsigned char> S(n),Q(n);
+            std::vector<unsigned char> S(n);
+            std::vector<unsigned int> Q(n);
             int q = n-1;
             std::fill(S.begin(),S.end(),1);
             tipl::image<unsigned char,2> P(binary_matrix.geometry());
-            tipl::image<float,2> G1(norm_matrix);
-            // per suggestion from Mikail Rubinov, the matrix has to be "granulated"
-            {
-                float eps = max_value*0.001f;
-                for(size_t i = 0;i < G1.size();++i)
-                    if(G1[i] > 0.0f && G1[i] < eps)
-                        G1[i] = eps;
-            }
+            tipl::image<float,2> G1(granulated_matrix);
             std::vector<unsigned int> V;
             V.push_back(i);
             while(q >= V.size())
@@ -4037,16 +5885,20 @@ void ConnectivityMatrix::network_property(std::string& report)
             }
 
             std::vector<float> DP(n);
+            source_betweenness[i].resize(n);
             for(unsigned int j = 0;j < n-1;++j)
             {
                 unsigned int w=Q[j];
                 unsigned int w_row = w*n;
-                betweenness_wei[w] += DP[w];
+                source_betweenness[i][w] += DP[w];
                 for(unsigned int k = 0;k < n;++k)
                     if(P[w_row+k])
                         DP[k] += (1.0+DP[w])*NP[k]/NP[w];
             }
-        }
+        });
+        for(unsigned int i = 0;i < n;++i)
+            for(unsigned int w = 0;w < n;++w)
+                betweenness_wei[w] += source_betweenness[i][w];
     }
 
 
@@ -1,11 +1,21 @@
 #ifndef TRACT_MODEL_HPP
 #define TRACT_MODEL_HPP
 #include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <tuple>
+#include <limits>
+#include <fstream>
+#include <thread>
+#include <functional>
 #include <iosfwd>
 #include "tipl/tipl.hpp"
 #include "fib_data.hpp"
 
 class RoiMgr;
+class QFile;
 void initial_LPS_nifti_srow(tipl::matrix<4,4,float>& T,const tipl::geometry<3>& geo,const tipl::vector<3>& vs);
 class TractModel{
 public:
@@ -13,6 +23,19 @@ public:
         std::string parameter_id;
         bool saved = true;
         bool color_changed = false;
+        // renewed whenever the tracts or their colors change and unique across
+        // models, so that caches keyed on it never mistake one state for another
+        uint64_t generation = new_generation();
+        static uint64_t new_generation(void);
+private:
+        // (generation, from, to) of recent changes, so that a cache built at an
+        // earlier generation can tell whether its range of tracts was touched
+        std::deque<std::tuple<uint64_t,size_t,size_t> > change_log;
+        uint64_t dropped_change_generation = 0;
+public:
+        // renews the generation; tracts at or after "to" are renumbered when to is max
+        void set_changed(size_t from = 0,size_t to = std::numeric_limits<size_t>::max());
+        bool is_unchanged(size_t from,size_t to,uint64_t since) const;
 public:
         tipl::geometry<3> geo;
         tipl::vector<3> vs;
@@ -22,18 +45,41 @@ private:
         std::vector<std::vector<float> > deleted_tract_data;
         std::vector<unsigned int> tract_color;
         std::vector<unsigned int> tract_tag;
+        std::vector<float> tract_weight;
         std::vector<unsigned int> deleted_tract_color;
         std::vector<unsigned int> deleted_tract_tag;
+        std::vector<float> deleted_tract_weight;
         std::vector<unsigned int> deleted_count;
         std::vector<char> is_cut;
         unsigned int cur_cut_id = 1;
         std::vector<std::pair<unsigned int,unsigned int> > redo_size;
         // offset, size
         void erase_empty(void);
+private:
+        // per-axis index of point runs [from,to) that round to the same slice,
+        // built lazily for get_in_slice_tracts and extended as tracts are appended
+        struct slice_run{uint32_t tract,from,to;};
+        std::map<int,std::vector<slice_run> > slice_index[3];
+        size_t slice_indexed_count[3] = {0,0,0};
+        void update_slice_index(unsigned char dim);
+        void clear_tract_index(void);
+private:
+        // level of detail: the Douglas-Peucker tolerance below which each point is kept,
+        // and the rank of each tract in a spatially stratified order for subsampling
+        std::vector<std::vector<float> > tract_lod;
+        std::vector<float> tract_rank;
+public:
+        void update_lod(void);
+        void update_rank(void);
+        const std::vector<float>& get_tract_lod(unsigned int index) const{return tract_lod[index];}
+        float get_tract_rank(unsigned int index) const{return tract_rank[index];}
+        void get_lod_tract(unsigned int index,float tolerance,std::vector<float>& points) const;
 private:
         // for loading multiple clusters
         std::vector<unsigned int> tract_cluster;
 public:
+        // save .tt.gz in the chunked layout (see ChunkedTTWriter)
+        static bool save_chunked_tt;
         static bool save_all(const char* file_name,
                              const std::vector<std::shared_ptr<TractModel> >& all,
                              const std::vector<std::string>& name_list);
@@ -70,8 +116,11 @@ public:
             tract_data = rhs.tract_data;
             tract_color = rhs.tract_color;
             tract_tag = rhs.tract_tag;
+            tract_weight = rhs.tract_weight;
             report = rhs.report;
+            clear_tract_index();
             saved = true;
+            set_changed();
             return *this;
         }
         void add(const TractModel& rhs);
@@ -88,7 +137,8 @@ public:
                        unsigned char tract_color_style,
                        float tube_diameter,
                        unsigned char tract_tube_detail,
-                       const std::string& surface_text);
+                       const std::string& surface_text,
+                       float lod_tolerance = 0.0f);
         bool save_data_to_file(std::shared_ptr<fib_data> handle,const char* file_name,const std::string& index_name);
         bool save_end_points(const char* file_name) const;
 
@@ -100,6 +150,7 @@ public:
         void clear(void);
         void add_tracts(std::vector<std::vector<float> >& new_tracks);
         void add_tracts(std::vector<std::vector<float> >& new_tracks,tipl::rgb color);
+        void add_tracts(std::vector<std::vector<float> >& new_tracks,const std::vector<float>& weights);
         void add_tracts(std::vector<std::vector<float> >& new_tracks,unsigned int length_threshold,tipl::rgb color);
         void filter_by_roi(std::shared_ptr<RoiMgr> roi_mgr);
         void reconnect_track(float distance,float angular_threshold);
@@ -113,8 +164,8 @@ public:
         void paint(float select_angle,const std::vector<tipl::vector<3,float> > & dirs,
                   const tipl::vector<3,float>& from_pos,
                   unsigned int color);
-        void set_color(unsigned int color){std::fill(tract_color.begin(),tract_color.end(),color);color_changed = true;}
-        void set_tract_color(std::vector<unsigned int>& new_color){tract_color = new_color;color_changed = true;}
+        void set_color(unsigned int color){std::fill(tract_color.begin(),tract_color.end(),color);color_changed = true;set_changed(0,tract_color.size());}
+        void set_tract_color(std::vector<unsigned int>& new_color);
         void cut_by_mask(const char* file_name);
         void clear_deleted(void);
         void undo(void);
@@ -139,8 +190,17 @@ public:
         const std::vector<float>& get_tract(unsigned int index) const{return tract_data[index];}
         const std::vector<std::vector<float> >& get_tracts(void) const{return tract_data;}
         std::vector<std::vector<float> >& get_deleted_tracts(void) {return deleted_tract_data;}
+        std::vector<float>& get_deleted_tract_weight(void) {return deleted_tract_weight;}
         std::vector<std::vector<float> >& get_tracts(void) {return tract_data;}
         unsigned int get_tract_color(unsigned int index) const{return tract_color[index];}
+        // importance weight of each tract, 1 unless its seed was importance-sampled.
+        // density and connectivity counts add up the weights instead of the tracts.
+        float get_tract_weight(unsigned int index) const{return tract_weight[index];}
+        const std::vector<float>& get_tract_weights(void) const{return tract_weight;}
+        bool is_weighted(void) const
+        {
+            return std::find_if(tract_weight.begin(),tract_weight.end(),[](float w){return w != 1.0f;}) != tract_weight.end();
+        }
         size_t get_tract_length(unsigned int index) const{return tract_data[index].size();}
 
 public:
@@ -148,6 +208,15 @@ public:
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
         void get_density_map(tipl::image<tipl::rgb,3>& mapping,
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
+        static void get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+             tipl::image<unsigned int,3>& mapping,
+             const tipl::matrix<4,4,float>& transformation,bool endpoint);
+        static void get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+             tipl::image<float,3>& mapping,
+             const tipl::matrix<4,4,float>& transformation,bool endpoint);
+        static void get_density_map(const std::vector<std::shared_ptr<TractModel> >& tract_models,
+             tipl::image<tipl::rgb,3>& mapping,
+             const tipl::matrix<4,4,float>& transformation,bool endpoint);
         static bool export_tdi(const char* file_name,
                           std::vector<std::shared_ptr<TractModel> > tract_models,
                           tipl::geometry<3>& dim,
@@ -167,6 +236,29 @@ public:
                         std::vector<float>& data_ci2);
 
 public:
+        // index values sampled along the tracts, stored flat: values of tract i are in
+        // [offset[i],offset[i+1]). Kept per index and extended as tracts are appended,
+        // and resampled when the image or its transformation changes. Loops over tracts
+        // should get it once from get_tract_scalar instead of calling get_tract_data.
+        // The least recently used indices are dropped beyond 8 indices or 512 MB.
+        struct tract_scalar{
+            uint64_t image_generation = 0;
+            mutable uint64_t last_use = 0;
+            tipl::matrix<4,4,float> iT;
+            std::vector<float> values;
+            std::vector<size_t> offset = {0};
+            const float* begin(size_t i) const{return values.data()+offset[i];}
+            const float* end(size_t i) const{return values.data()+offset[i+1];}
+        };
+private:
+        mutable std::map<std::pair<const fib_data*,std::string>,std::shared_ptr<tract_scalar> > scalar_cache;
+        mutable std::mutex scalar_cache_mutex;
+        mutable uint64_t scalar_cache_tick = 0;
+        std::shared_ptr<const tract_scalar> find_tract_scalar(std::shared_ptr<fib_data> handle,unsigned int index_num) const;
+        void sample_tract_data(std::shared_ptr<fib_data> handle,unsigned int fiber_index,
+                               unsigned int index_num,float* data) const;
+public:
+        std::shared_ptr<const tract_scalar> get_tract_scalar(std::shared_ptr<fib_data> handle,unsigned int index_num) const;
         void get_tract_data(std::shared_ptr<fib_data> handle,
                             unsigned int fiber_index,
                             unsigned int index_num,
@@ -177,17 +269,113 @@ public:
         void get_tracts_data(std::shared_ptr<fib_data> handle,unsigned int index_num,float& mean) const;
 public:
 
-        void get_passing_list(const std::vector<std::vector<short> >& region_map,
+        void get_passing_list(const region_label_map& region_map,
                               unsigned int region_count,
                                      std::vector<std::vector<short> >& passing_list1,
                                      std::vector<std::vector<short> >& passing_list2) const;
-        void get_end_list(const std::vector<std::vector<short> >& region_map,
+        void get_end_list(const region_label_map& region_map,
                                      std::vector<std::vector<short> >& end_list1,
                                      std::vector<std::vector<short> >& end_list2) const;
         void run_clustering(unsigned char method_id,unsigned int cluster_count,float param);
 
 };
 
+// The chunked .tt.gz layout: blocks of tracts are compressed independently as gzip members
+// and listed in a block directory, which allows parallel writing, parallel loading,
+// and reading a range of tracts without decompressing the whole file.
+class ChunkedTTWriter{
+    std::ofstream out;
+    uint64_t pos = 0;
+    std::vector<uint64_t> dir; // offset, compressed size, raw size, and tract count of each block
+public:
+    bool open(const char* file_name,const tipl::geometry<3>& geo,const tipl::vector<3>& vs,
+              const std::string& report,const std::string& parameter_id,unsigned int color);
+    // blocks are [bound[i],bound[i+1]) of buf, each holding count[i] tract records
+    bool add_chunks(const char* buf,const std::vector<size_t>& bound,const std::vector<size_t>& count);
+    bool close(const std::vector<uint16_t>& cluster);
+};
+class ChunkedTTReader{
+    std::ifstream in;
+    std::vector<uint64_t> dir;
+    std::vector<uint64_t> first_track;
+    bool read_member(uint64_t offset,uint64_t size,std::vector<char>& buf);
+public:
+    tipl::geometry<3> geo;
+    tipl::vector<3> vs;
+    unsigned int color = 0;
+    std::string report,parameter_id;
+    std::vector<uint16_t> cluster;
+public:
+    static bool is_chunked(const char* file_name);
+    bool open(const char* file_name);
+    size_t block_count(void) const{return dir.size()/4;}
+    size_t track_count(void) const{return first_track.empty() ? 0 : size_t(first_track.back());}
+    bool read_blocks(size_t from,size_t to,std::vector<std::vector<float> >& tracts);
+    bool read_tracts(size_t from,size_t count,std::vector<std::vector<float> >& tracts);
+};
+
+// Out-of-core access to a tract file without loading all tracts. Uncompressed .trk/.tck files are
+// memory mapped and indexed by a first scan (cached in the user cache folder for large files), and chunked
+// .tt.gz files are read block by block. Tracts are in voxel coordinates as loaded by TractModel.
+class TractFileView{
+    std::string file_name;
+    tipl::vector<3> vs;
+    std::shared_ptr<ChunkedTTReader> tt;
+    std::shared_ptr<QFile> file;
+    const unsigned char* data = nullptr;
+    size_t data_size = 0;
+    std::vector<uint64_t> offset; // start of each tract and the end of the last one
+    bool is_trk = false;
+    int n_scalars = 0,n_properties = 0;
+    short dim[3] = {0,0,0};
+    bool flip_x = false,flip_y = false;
+    bool load_index(void);
+    void save_index(void) const;
+    void build_index(size_t begin,size_t n_count);
+    void decode(size_t index,std::vector<float>& tract) const;
+public:
+    std::string error_msg;
+    std::string report,parameter_id;
+    bool open(const char* file_name,const tipl::vector<3>& vs);
+    size_t size(void) const{return tt.get() ? tt->track_count() : (offset.empty() ? 0 : offset.size()-1);}
+    bool read(size_t from,size_t count,std::vector<std::vector<float> >& tracts);
+    // calls fun(first index,tracts) on consecutive chunks, stops when it returns false
+    bool for_each_chunk(size_t chunk_size,std::function<bool(size_t,std::vector<std::vector<float> >&)> fun);
+};
+
+// Writes tracts to a .tt.gz/.trk/.trk.gz/.tck file on a background thread while tracking is running.
+// push() blocks once max_queued_size coordinates are waiting, which bounds the memory use.
+class TractStreamWriter{
+    std::string ext;
+    tipl::geometry<3> tck_geo;
+    tipl::vector<3> vs;
+    std::shared_ptr<gz_mat_write> tt_out;
+    std::shared_ptr<ChunkedTTWriter> tt_chunk_out;
+    std::shared_ptr<gz_ostream> trk_out;
+    std::shared_ptr<std::ofstream> tck_out;
+    std::vector<char> tt_buf;
+    unsigned int tt_block = 0;
+    std::deque<std::vector<std::vector<float> > > queue;
+    size_t queued_size = 0;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    bool closing = false;
+    bool failed = false;
+    std::thread writer;
+    size_t count = 0;
+    void write(const std::vector<std::vector<float> >& tracts);
+    void flush_tt(void);
+public:
+    size_t max_queued_size = size_t(1) << 26;
+    ~TractStreamWriter(void){close();}
+    static bool supported(const std::string& file_name);
+    bool open(const std::string& file_name,const tipl::geometry<3>& geo,const tipl::vector<3>& vs_,
+              const std::string& report,const std::string& parameter_id);
+    void push(std::vector<std::vector<float> >& tracts);
+    bool close(void);
+    size_t get_count(void) const{return count;}
+};
+
 
 
 
@@ -198,12 +386,13 @@ public:
 
     tipl::image<float,2> matrix_value;
 public:
-    std::vector<std::vector<short> > region_map;
+    region_label_map region_map;
     size_t region_count = 0;
     std::vector<std::string> region_name;
     std::string error_msg,atlas_name;
-    float overlap_ratio;
+    float overlap_ratio = 0.0f;
     void set_atlas(std::shared_ptr<atlas> data,const tipl::image<tipl::vector<3,float>,3 >& mni_position);
+    void set_atlas(std::shared_ptr<atlas> data,std::shared_ptr<fib_data> handle);
     void set_regions(const tipl::geometry<3>& geo,
                      const std::vector<std::shared_ptr<ROIRegion> >& regions);
 public:
@@ -211,7 +400,27 @@ public:
     void save_to_file(const char* file_name);
     void save_to_connectogram(const char* file_name);
     void save_to_text(std::string& text);
-    bool calculate(std::shared_ptr<fib_data> handle,TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold);
+    bool calculate(std::shared_ptr<fib_data> handle,TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold,
+                   const std::string& trk_file_prefix = std::string());
+public:
+    // all value types and counting types of several region sets in one traversal of the tracts
+    // results are keyed by value type + ".end" or ".pass"
+    std::map<std::string,tipl::image<float,2> > matrix_values;
+    static bool calculate_all(std::shared_ptr<fib_data> handle,
+                              TractModel& tract_model,
+                              std::vector<std::shared_ptr<ConnectivityMatrix> >& matrices,
+                              const std::vector<std::string>& value_types,
+                              bool use_end,bool use_pass,float threshold,
+                              std::string& error_msg);
+    // tracts are supplied in chunks by next_chunk, which returns nullptr after the last one
+    static bool calculate_all(std::shared_ptr<fib_data> handle,
+                              std::function<TractModel*(void)> next_chunk,
+                              std::vector<std::shared_ptr<ConnectivityMatrix> >& matrices,
+                              const std::vector<std::string>& value_types,
+                              bool use_end,bool use_pass,float threshold,
+                              std::string& error_msg);
+    bool set_matrix_value(const std::string& value_type,bool use_end_only);
+public:
     void network_property(std::string& report);
 };
 
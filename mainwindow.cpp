@@ -314,6 +314,7 @@ void MainWindow::loadFib(QString filename,bool presentation_mode)
         {
             tipl::geometry<3> geo;
             shift_track_for_tck(tracking_windows.back()->tractWidget->tract_models.back()->get_tracts(),geo);
+            tracking_windows.back()->tractWidget->tract_models.back()->set_changed();
         }
     }
 
@@ -614,6 +615,8 @@ void MainWindow::on_averagefib_clicked()
 bool parse_dwi(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
 bool find_bval_bvec(const char* file_name,QString& bval,QString& bvec);
 bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec);
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,bool need_bvalbvec,
+                 tipl::geometry<3>& geo,std::function<bool(unsigned int,tipl::image<unsigned short,3>&)>& read_volume);
 QString get_dicom_output_name(QString file_name,QString file_extension,bool add_path);
 
 
@@ -961,13 +964,15 @@ extern std::string src_error_msg;
 void nii2src(std::string nii_name,std::string src_name,std::ostream& out)
 {
     std::vector<std::shared_ptr<DwiHeader> > dwi_files;
-    if(!load_4d_nii(nii_name.c_str(),dwi_files,true))
+    tipl::geometry<3> geo;
+    std::function<bool(unsigned int,tipl::image<unsigned short,3>&)> read_volume;
+    if(!load_4d_nii(nii_name.c_str(),dwi_files,true,geo,read_volume))
     {
         out << "ERROR: " << src_error_msg << std::endl;
         return;
     }
     out << std::filesystem::path(src_name).filename().string() << std::endl;
-    if(!DwiHeader::output_src(src_name.c_str(),dwi_files,0,false))
+    if(!DwiHeader::output_src(src_name.c_str(),dwi_files,geo,0,read_volume))
         out << "ERROR: " << src_error_msg << std::endl;
 }
 void MainWindow::on_nii2src_bids_clicked()
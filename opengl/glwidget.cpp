@@ -7,6 +7,9 @@
 #include <QTimer>
 #include <QClipboard>
 #include <vector>
+#include <map>
+#include <sstream>
+#include <numeric>
 #include "glwidget.h"
 #include "tracking/tracking_window.h"
 #include "ui_tracking_window.h"
@@ -99,9 +102,8 @@ void GLWidget::clean_up(void)
 {
     makeCurrent();
     slice_texture.clear();
-    if(tracts)
-        glDeleteLists(tracts, 1);
-    tracts = 0;
+    tract_chunks.clear();
+    tracts = false;
     doneCurrent();
     //std::cout << __FUNCTION__ << " " << __FILE__ << std::endl;
 }
@@ -432,7 +434,7 @@ void GLWidget::initializeGL()
     glEnable(GL_NORMALIZE);
     glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
     glBlendFunc (GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    tracts = glGenLists(1);
+    tracts = true;
     tract_alpha = -1; // ensure that make_track is called
     odf_position = 255;//ensure ODFs is renderred
     no_update = false;
@@ -745,6 +747,20 @@ void GLWidget::renderLR()
            check_change("tract_shader",tract_shader) ||     
            check_change("end_point_shift",end_point_shift))
             changed = true;
+        {
+            // simplify tracts to a fraction of a voxel at the current zoom level
+            float lod_tolerance = 0.0f;
+            if(get_param("tract_lod"))
+            {
+                float zoom = std::max<float>(0.01f,float(std::pow(std::fabs(transformation_matrix.det()),1.0/3.0)));
+                lod_tolerance = std::min<float>(0.8f,std::max<float>(0.0125f,0.1f*std::pow(2.0f,std::round(std::log2(1.0f/zoom)))));
+            }
+            if(lod_tolerance != tract_lod_tolerance)
+            {
+                tract_lod_tolerance = lod_tolerance;
+                changed = true;
+            }
+        }
         if(changed)
             makeTracts();
 
@@ -760,7 +776,45 @@ void GLWidget::renderLR()
             glDisable(GL_BLEND);
             glDepthMask(true);
         }
-        glCallList(tracts);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        if(tract_style)
+            glEnableClientState(GL_NORMAL_ARRAY);
+        for(const auto& chunk : tract_chunks)
+        {
+            if(chunk->first.empty())
+                continue;
+            if(!chunk->buffer)
+            {
+                chunk->color_offset = chunk->vertices.size()*sizeof(float);
+                chunk->normal_offset = chunk->color_offset+chunk->colors.size()*sizeof(float);
+                chunk->buffer = std::make_shared<QOpenGLBuffer>(QOpenGLBuffer::VertexBuffer);
+                chunk->buffer->create();
+                chunk->buffer->setUsagePattern(QOpenGLBuffer::StaticDraw);
+                chunk->buffer->bind();
+                chunk->buffer->allocate(int(chunk->normal_offset+chunk->normals.size()*sizeof(float)));
+                chunk->buffer->write(0,&chunk->vertices[0],int(chunk->color_offset));
+                chunk->buffer->write(int(chunk->color_offset),&chunk->colors[0],int(chunk->normal_offset-chunk->color_offset));
+                if(!chunk->normals.empty())
+                    chunk->buffer->write(int(chunk->normal_offset),&chunk->normals[0],int(chunk->normals.size()*sizeof(float)));
+                // the geometry now lives in video memory
+                std::vector<float>().swap(chunk->vertices);
+                std::vector<float>().swap(chunk->colors);
+                std::vector<float>().swap(chunk->normals);
+            }
+            else
+                chunk->buffer->bind();
+            glVertexPointer(3, GL_FLOAT, 0, nullptr);
+            glColorPointer(4, GL_FLOAT, 0, reinterpret_cast<const GLvoid*>(chunk->color_offset));
+            if(tract_style)
+                glNormalPointer(GL_FLOAT, 0, reinterpret_cast<const GLvoid*>(chunk->normal_offset));
+            for(size_t i = 0;i < chunk->first.size();++i)
+                glDrawArrays((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP,chunk->first[i],chunk->count[i]);
+        }
+        QOpenGLBuffer::release(QOpenGLBuffer::VertexBuffer);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_NORMAL_ARRAY);
         glPopMatrix();
         glDisable(GL_COLOR_MATERIAL);
         glDisable(GL_BLEND);
@@ -1447,14 +1501,6 @@ void GLWidget::add_odf(const std::vector<tipl::pixel_index<3> >& odf_pos_)
             iter2->normalize();
     });
 }
-void myglColor(const tipl::vector<3,float>& color,float alpha)
-{
-    if(alpha == 1.0)
-        glColor3fv(color.begin());
-    else
-        glColor4f(color[0],color[1],color[2],alpha);
-}
-
 template<typename fun_type>
 void for_each_track(TractTableWidget* trackWidget,fun_type fun)
 {
@@ -1471,6 +1517,14 @@ void for_each_track(TractTableWidget* trackWidget,fun_type fun)
     }
 
 }
+template<typename fun_type>
+void for_each_model(TractTableWidget* trackWidget,fun_type fun)
+{
+    for (int i = 0;i < trackWidget->rowCount();++i)
+        if(trackWidget->item(i,0)->checkState() == Qt::Checked)
+            fun(trackWidget->tract_models[size_t(i)]);
+}
+const size_t tract_chunk_size = 4096;
 
 void GLWidget::makeTracts(void)
 {
@@ -1478,9 +1532,8 @@ void GLWidget::makeTracts(void)
         return;
     if(cur_tracking_window["roi_track"].toInt())
         cur_tracking_window.slice_need_update = true;
+    // the vertex buffers of replaced chunks are released in this context
     makeCurrent();
-    glDeleteLists(tracts, 1);
-    glNewList(tracts, GL_COMPILE);
     float alpha = (tract_alpha_style == 0)? tract_alpha/2.0f:tract_alpha;
     float tract_color_saturation_base = tract_color_brightness*(1.0f-tract_color_saturation);
     const float detail_option[] = {1.0f,0.5f,0.25f,0.0f,0.0f};
@@ -1489,8 +1542,6 @@ void GLWidget::makeTracts(void)
     bool show_end_points = tract_style >= 2;
     float tube_detail = tube_diameter*detail_option[tract_tube_detail]*4.0f;
     float tract_shaderf = 0.01f*float(tract_shader);
-    std::vector<float> mean_fa;
-    unsigned int mean_fa_index = 0;
     unsigned int track_num_index = cur_tracking_window.handle->get_name_index(cur_tracking_window.color_bar->get_tract_color_name().toStdString());
     // show tract by index value
     auto trackWidget = cur_tracking_window.tractWidget;
@@ -1506,31 +1557,32 @@ void GLWidget::makeTracts(void)
             skip_rate = float(get_param("tract_visible_tract"))/float(total_tracts);
     }
 
-
-    if (tract_color_style > 1)
-    {
-        if(tract_color_style == 3 || tract_color_style == 5)// mean value
-        {
-            for_each_track(trackWidget,[&](std::shared_ptr<TractModel>& active_tract_model,unsigned int data_index)
-            {
-                unsigned int vertex_count = active_tract_model->get_tract_length(data_index)/3;
-                if (vertex_count <= 1)
-                    return;
-                std::vector<float> fa_values;
-                active_tract_model->get_tract_data(cur_tracking_window.handle,
-                                                   data_index,track_num_index,fa_values);
-                if(tract_color_style == 3)
-                {
-                    float sum = std::accumulate(fa_values.begin(),fa_values.end(),0.0f);
-                    sum /= (float)fa_values.size();
-                    mean_fa.push_back(sum);
-                }
-                if(tract_color_style == 5)
-                    mean_fa.push_back(*std::max_element(fa_values.begin(),fa_values.end()));
-            });
-
-        }
-    }
+    // any change in the rendering setting invalidates all chunks
+    {
+        std::ostringstream out;
+        out << alpha << " " << int(tract_style) << " " << int(tract_color_style) << " "
+            << tract_color_saturation << " " << tract_color_brightness << " " << tube_diameter << " "
+            << int(tract_tube_detail) << " " << int(tract_variant_size) << " " << int(tract_variant_color) << " "
+            << int(end_point_shift) << " " << skip_rate << " " << tract_lod_tolerance << " " << track_num_index << " "
+            << cur_tracking_window.color_bar->get_tract_color_name().toStdString();
+        if(track_num_index < cur_tracking_window.handle->view_item.size())
+            out << " " << cur_tracking_window.handle->view_item[track_num_index].generation;
+        // the shading maps depend on all tracts
+        if(tract_shader || out.str() != tract_chunk_setting)
+            tract_chunks.clear();
+        tract_chunk_setting = out.str();
+    }
+    std::map<const TractModel*,std::shared_ptr<const TractModel::tract_scalar> > tract_scalar;
+    for_each_model(trackWidget,[&](std::shared_ptr<TractModel>& active_tract_model)
+    {
+        // the point tolerances and the subsampling order are built only when used
+        if(tract_lod_tolerance > 0.0f)
+            active_tract_model->update_lod();
+        if(skip_rate < 1.0f)
+            active_tract_model->update_rank();
+        if(tract_color_style == 2 || tract_color_style == 3 || tract_color_style == 5)
+            tract_scalar[active_tract_model.get()] = active_tract_model->get_tract_scalar(cur_tracking_window.handle,track_num_index);
+    });
 
     tipl::image<float,2> max_z_map, min_z_map, max_x_map, min_x_map, min_y_map, max_y_map;
 
@@ -1549,10 +1601,9 @@ void GLWidget::makeTracts(void)
         std::fill(min_x_map.begin(),min_x_map.end(),cur_tracking_window.handle->dim.width());
         std::fill(min_y_map.begin(),min_y_map.end(),cur_tracking_window.handle->dim.height());
         std::fill(min_z_map.begin(),min_z_map.end(),cur_tracking_window.handle->dim.depth());
-        tipl::uniform_dist<float> uniform_gen(0.0f,1.0f);
         for_each_track(trackWidget,[&](std::shared_ptr<TractModel>& active_tract_model,unsigned int data_index)
         {
-            if(skip_rate < 1.0f && uniform_gen() > skip_rate)
+            if(skip_rate < 1.0f && active_tract_model->get_tract_rank(data_index) >= skip_rate)
                 return;
             unsigned int vertex_count =
                     active_tract_model->get_tract_length(data_index)/3;
@@ -1595,52 +1646,90 @@ void GLWidget::makeTracts(void)
         }
     }
 
-    std::vector<tipl::vector<3,float> > points(8),previous_points(8),
-                                      normals(8),previous_normals(8);
-    tipl::rgb paint_color;
-    tipl::vector<3,float> paint_color_f;
-    std::vector<float> color;
-
-
-
-
-
-
-    tipl::uniform_dist<float> uniform_gen(0.0f,1.0f),random_size(-0.5f,0.5f),random_color(-0.05f,0.05f);
-    for_each_track(trackWidget,[&](std::shared_ptr<TractModel>& active_tract_model,unsigned int data_index)
+    auto add_tract = [&](tract_chunk& chunk,const TractModel& active_tract_model,unsigned int data_index)
     {
-        if(skip_rate < 1.0f && uniform_gen() > skip_rate)
-        {
-            mean_fa_index++;
-            return;
-        }
         unsigned int vertex_count =
-                active_tract_model->get_tract_length(data_index)/3;
+                active_tract_model.get_tract_length(data_index)/3;
         if (vertex_count <= 1)
             return;
 
-        const float* data_iter = &*(active_tract_model->get_tract(data_index).begin());
+        const float* data_iter = &*(active_tract_model.get_tract(data_index).begin());
+        tipl::vector<3,float> paint_color_f;
+        std::vector<float> color;
 
         switch(tract_color_style)
         {
         case 1:
-            paint_color = active_tract_model->get_tract_color(data_index);
-            paint_color_f = tipl::vector<3,float>(paint_color.r,paint_color.g,paint_color.b);
-            paint_color_f /= 255.0;
+            {
+                tipl::rgb paint_color = active_tract_model.get_tract_color(data_index);
+                paint_color_f = tipl::vector<3,float>(paint_color.r,paint_color.g,paint_color.b);
+                paint_color_f /= 255.0;
+            }
             break;
         case 2:// local
-            active_tract_model->get_tract_data(cur_tracking_window.handle,data_index,track_num_index,color);
+            {
+                const auto& scalar = *tract_scalar.find(&active_tract_model)->second;
+                color.assign(scalar.begin(data_index),scalar.end(data_index));
+            }
             break;
         case 3:// mean
         case 5:// max
-            paint_color_f = cur_tracking_window.color_bar->get_color(mean_fa[mean_fa_index++]);
+            {
+                const auto& scalar = *tract_scalar.find(&active_tract_model)->second;
+                color.assign(scalar.begin(data_index),scalar.end(data_index));
+            }
+            paint_color_f = cur_tracking_window.color_bar->get_color(tract_color_style == 3 ?
+                                std::accumulate(color.begin(),color.end(),0.0f)/float(color.size()) :
+                                *std::max_element(color.begin(),color.end()));
             break;
         }
+        // keep the points needed within the tolerance
+        std::vector<float> lod_tract;
+        if(tract_lod_tolerance > 0.0f)
+        {
+            const auto& lod = active_tract_model.get_tract_lod(data_index);
+            unsigned int lod_count = 0;
+            for(unsigned int i = 0;i < vertex_count;++i)
+                if(lod[i] >= tract_lod_tolerance)
+                {
+                    lod_tract.insert(lod_tract.end(),data_iter+i*3,data_iter+i*3+3);
+                    if(i < color.size())
+                        color[lod_count] = color[i];
+                    ++lod_count;
+                }
+            if(!color.empty())
+                color.resize(lod_count);
+            data_iter = lod_tract.data();
+            vertex_count = lod_count;
+        }
+        auto begin_strip = [&](void)
+        {
+            chunk.first.push_back(GLint(chunk.vertices.size()/3));
+        };
+        auto end_strip = [&](void)
+        {
+            GLsizei count = GLsizei(chunk.vertices.size()/3)-chunk.first.back();
+            if(count)
+                chunk.count.push_back(count);
+            else
+                chunk.first.pop_back();
+        };
+        auto add_vertex = [&](const tipl::vector<3,float>& c,const tipl::vector<3,float>& n,const tipl::vector<3,float>& p)
+        {
+            chunk.vertices.insert(chunk.vertices.end(),p.begin(),p.end());
+            chunk.colors.insert(chunk.colors.end(),c.begin(),c.end());
+            chunk.colors.push_back(alpha);
+            if(tract_style)
+                chunk.normals.insert(chunk.normals.end(),n.begin(),n.end());
+        };
+
+        std::vector<tipl::vector<3,float> > points(8),previous_points(8),
+                                          normals(8),previous_normals(8);
         tipl::vector<3,float> last_pos(data_iter),pos,
             vec_a(1,0,0),vec_b(0,1,0),
             vec_n,prev_vec_n,vec_ab,vec_ba,cur_color,previous_color;
 
-        glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
+        begin_strip();
         for (unsigned int j = 0, index = 0; index < vertex_count;j += 3, data_iter += 3, ++index)
         {
             // skip straight line!
@@ -1786,38 +1875,25 @@ void GLWidget::makeTracts(void)
             // add end
             if (index == 0)
             {
-                /*
-                glColor3fv(cur_color.begin());
-                glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                for (unsigned int k = 0;k < 8;++k)
-                    glVertex3fv(points[end_sequence[k]].begin());
-                if(show_end_points)
-                    glEnd();*/
                 if(show_end_points)
                 {
                     if(tract_style != 3)
                     {
-                        myglColor(cur_color,alpha);
-                        glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
                         tipl::vector<3,float> shift(vec_n);
                         shift *= -(int)end_point_shift;
                         for (unsigned int k = 0;k < 8;++k)
                         {
                             tipl::vector<3,float> cur_point = points[end_sequence[k]];
                             cur_point += shift;
-                            glVertex3fv(cur_point.begin());
+                            add_vertex(cur_color,-vec_n,cur_point);
                         }
                     }
-                    glEnd();
+                    end_strip();
                 }
                 else
                 {
-                    myglColor(cur_color,alpha);
                     for (unsigned int k = 0;k < 8;++k)
-                    {
-                        glNormal3fv(normals[end_sequence[k]].begin());
-                        glVertex3fv(points[end_sequence[k]].begin());
-                    }
+                        add_vertex(cur_color,normals[end_sequence[k]],points[end_sequence[k]]);
                 }
             }
             else
@@ -1826,50 +1902,35 @@ void GLWidget::makeTracts(void)
 
                 if(!show_end_points)
                 {
-                    myglColor(cur_color,alpha);
-                    glNormal3fv(normals[0].begin());
-                    glVertex3fv(points[0].begin());
+                    add_vertex(cur_color,normals[0],points[0]);
                     for (unsigned int k = 1;k < 8;++k)
                     {
-                       myglColor(previous_color,alpha);
-                       glNormal3fv(previous_normals[k].begin());
-                       glVertex3fv(previous_points[k].begin());
-
-                       myglColor(cur_color,alpha);
-                       glNormal3fv(normals[k].begin());
-                       glVertex3fv(points[k].begin());
+                       add_vertex(previous_color,previous_normals[k],previous_points[k]);
+                       add_vertex(cur_color,normals[k],points[k]);
                     }
-                    myglColor(cur_color,alpha);
-                    glNormal3fv(normals[0].begin());
-                    glVertex3fv(points[0].begin());
+                    add_vertex(cur_color,normals[0],points[0]);
                 }
                 if(index +1 == vertex_count)
                 {
                     if(show_end_points)
                     {
-                        glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
+                        begin_strip();
                         if(tract_style != 4)
                         {
-                            myglColor(cur_color,alpha);
-                            glNormal3fv(vec_n.begin());
                             tipl::vector<3,float> shift(vec_n);
                             shift *= (int)end_point_shift;
                             for (unsigned int k = 0;k < 8;++k)
                             {
                                 tipl::vector<3,float> cur_point = points[end_sequence2[k]];
                                 cur_point += shift;
-                                glVertex3fv(cur_point.begin());
+                                add_vertex(cur_color,vec_n,cur_point);
                             }
                         }
                     }
                     else
                     {
-                        myglColor(cur_color,alpha);
                         for (unsigned int k = 2;k < 8;++k) // skip 0 and 1 because the tubes have them
-                        {
-                            glNormal3fv(normals[end_sequence2[k]].begin());
-                            glVertex3fv(points[end_sequence2[k]].begin());
-                        }
+                            add_vertex(cur_color,normals[end_sequence2[k]],points[end_sequence2[k]]);
                     }
                 }
 
@@ -1882,18 +1943,56 @@ void GLWidget::makeTracts(void)
             last_pos = pos;
             }
             else
+                add_vertex(cur_color,vec_n,pos);
+        }
+        end_strip();
+    };
+
+    // reuse the chunks whose tracts are unchanged and rebuild the others in parallel
+    std::map<std::pair<const TractModel*,size_t>,std::shared_ptr<tract_chunk> > cached_chunks;
+    for(auto& chunk : tract_chunks)
+        if(auto model = chunk->model.lock())
+            cached_chunks[std::make_pair(model.get(),chunk->from)] = chunk;
+    std::vector<std::shared_ptr<tract_chunk> > new_chunks,chunks_to_build;
+    std::vector<std::shared_ptr<TractModel> > chunk_models;
+    for (int i = 0;i < trackWidget->rowCount();++i)
+    {
+        if(trackWidget->item(i,0)->checkState() != Qt::Checked)
+            continue;
+        auto active_tract_model = trackWidget->tract_models[size_t(i)];
+        size_t tracks_count = active_tract_model->get_visible_track_count();
+        for(size_t from = 0;from < tracks_count;from += tract_chunk_size)
+        {
+            size_t to = std::min<size_t>(tracks_count,from+tract_chunk_size);
+            auto iter = cached_chunks.find(std::make_pair(active_tract_model.get(),from));
+            if(iter != cached_chunks.end() && iter->second->to == to &&
+               active_tract_model->is_unchanged(from,to,iter->second->generation))
             {
-                myglColor(cur_color,alpha);
-                glVertex3fv(pos.begin());
+                iter->second->generation = active_tract_model->generation;
+                new_chunks.push_back(iter->second);
+                continue;
             }
+            auto chunk = std::make_shared<tract_chunk>();
+            chunk->model = active_tract_model;
+            chunk->generation = active_tract_model->generation;
+            chunk->from = from;
+            chunk->to = to;
+            new_chunks.push_back(chunk);
+            chunks_to_build.push_back(chunk);
+            chunk_models.push_back(active_tract_model);
         }
-        glEnd();
     }
-    );
-
-    glEndList();
-
-    check_error(__FUNCTION__);
+    tipl::par_for(chunks_to_build.size(),[&](size_t i)
+    {
+        auto& chunk = *chunks_to_build[i];
+        for(size_t data_index = chunk.from;data_index < chunk.to;++data_index)
+        {
+            if(skip_rate < 1.0f && chunk_models[i]->get_tract_rank(uint32_t(data_index)) >= skip_rate)
+                continue;
+            add_tract(chunk,*chunk_models[i],uint32_t(data_index));
+        }
+    });
+    tract_chunks.swap(new_chunks);
 }
 void GLWidget::resizeGL(int width_, int height_)
 {
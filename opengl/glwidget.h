@@ -3,6 +3,7 @@
 #include <QTimer>
 #include <QTime>
 #include <QOpenGLTexture>
+#include <QOpenGLBuffer>
 //#include <QOpenGLShaderProgram>
 #define NOMINMAX
 #include <memory>
@@ -29,6 +30,20 @@ public:
     GLUquadricObj* get(void) {return ptr;}
 };
 
+class TractModel;
+// geometry of a chunk of tracts, drawn as strips with glDrawArrays. The vertices,
+// colors, and normals are uploaded once to a vertex buffer on the first draw.
+struct tract_chunk{
+    std::weak_ptr<TractModel> model;
+    uint64_t generation = 0;
+    size_t from = 0,to = 0;
+    std::vector<float> vertices,normals,colors;
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+    std::shared_ptr<QOpenGLBuffer> buffer;
+    size_t color_offset = 0,normal_offset = 0;
+};
+
 class GLWidget : public QGLWidget
 {
 Q_OBJECT
@@ -132,6 +147,7 @@ public:
      void mouseMoveEvent(QMouseEvent *event);
      void mouseDoubleClickEvent(QMouseEvent *event);
      void wheelEvent ( QWheelEvent * event );
+     float get_tract_lod_tolerance(void) const{return tract_lod_tolerance;}
  private:
      tracking_window& cur_tracking_window;
      RenderingTableWidget* renderWidget;
@@ -176,6 +192,7 @@ public:
      unsigned char tract_variant_color;
      unsigned char tract_shader;
      unsigned char end_point_shift;
+     float tract_lod_tolerance = 0.0f;
      unsigned char odf_position;
      unsigned char odf_skip;
      unsigned char odf_shape = 0;
@@ -185,7 +202,9 @@ public:
      bool keep_slice = false;
      std::vector<tipl::vector<3,float> > keep_slice_points;
 public:
-     GLuint tracts = 0;
+     bool tracts = false;
+     std::vector<std::shared_ptr<tract_chunk> > tract_chunks;
+     std::string tract_chunk_setting;
      std::vector<std::shared_ptr<QOpenGLTexture> > slice_texture;
 
      int slice_pos[3] = {-1,-1,-1};
@@ -2,6 +2,7 @@
 #include <QInputDialog>
 #include <fstream>
 #include <iterator>
+#include <limits>
 #include "Regions.h"
 #include "SliceModel.h"
 #include "libs/gzip_interface.hpp"
@@ -28,23 +29,8 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,float> >& points,bool del,
 void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del,float point_resolution)
 {
     change_resolution(points,point_resolution);
-    if(!region.empty())
-        undo_backup.push_back(region);
-    if(resolution_ratio == 1.0)
-    {
-        for(unsigned int index = 0; index < points.size();)
-            if (!dim.is_valid(points[index][0], points[index][1], points[index][2]))
-            {
-                points[index] = points.back();
-                points.pop_back();
-            }
-            else
-                ++index;
-    }
-    else
-    {
-        tipl::geometry<3> new_geo = get_buffer_dim();
-        for(unsigned int index = 0; index < points.size();)
+    tipl::geometry<3> new_geo = (resolution_ratio == 1.0f ? dim : get_buffer_dim());
+    for(unsigned int index = 0; index < points.size();)
         if (!new_geo.is_valid(points[index][0], points[index][1], points[index][2]))
         {
             points[index] = points.back();
@@ -52,101 +38,159 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del
         }
         else
             ++index;
-    }
     if(points.empty())
         return;
-    if(points.size()+ region.size() > 5000000)
+    std::sort(points.begin(),points.end());
+    points.erase(std::unique(points.begin(),points.end()),points.end());
+    std::vector<tipl::vector<3,short> > new_region(del ? region.size() : region.size()+points.size());
+    auto it = del ? std::set_difference(region.begin(),region.end(),points.begin(),points.end(),new_region.begin()):
+                    std::set_union(region.begin(),region.end(),points.begin(),points.end(),new_region.begin());
+    new_region.resize(size_t(it-new_region.begin()));
+    set_region(std::move(new_region));
+}
+// ---------------------------------------------------------------------------
+void region_runs::encode(const std::vector<tipl::vector<3,short> >& points)
+{
+    start.clear();
+    length.clear();
+    for(size_t i = 0;i < points.size();++i)
     {
-        // for roll back
-        unsigned int region_size = region.size();
-        if(!del)
+        if(!start.empty() && length.back() < std::numeric_limits<unsigned short>::max() &&
+           points[i][1] == start.back()[1] && points[i][2] == start.back()[2] &&
+           points[i][0] == start.back()[0] + short(length.back()))
         {
-            region.insert(region.end(),points.begin(),points.end());
-            points.clear();
-        }
-        tipl::vector<3,short> min_value,max_value,geo_size;
-        tipl::bounding_box_mt(region,max_value,min_value);
-
-        geo_size = max_value-min_value;
-        tipl::geometry<3> mask_geo(geo_size[0]+1,geo_size[1]+1,geo_size[2]+1);
-        tipl::image<unsigned char,3> mask;
-
-        try
-        {
-            mask.resize(mask_geo);
-        }
-        catch(...)
-        {
-            // roll back
-            region.resize(region_size);
-            goto alternative;
+            ++length.back();
+            continue;
         }
-
-        tipl::par_for (region.size(),[&](unsigned int index)
-        {
-            auto p = region[index];
-            p -= min_value;
-            if (mask.geometry().is_valid(p))
-                mask.at(p[0],p[1],p[2]) = 1;
-        });
-
-        if(points.size())
-        tipl::par_for (points.size(),[&](unsigned int index)
-        {
-            auto p = points[index];
-            p -= min_value;
-            if (mask.geometry().is_valid(p))
-                mask.at(p[0],p[1],p[2]) = 0;
-        });
-
-        points.clear();
+        start.push_back(points[i]);
+        length.push_back(1);
+    }
+}
+void region_runs::decode(std::vector<tipl::vector<3,short> >& points) const
+{
+    points.clear();
+    for(size_t i = 0;i < start.size();++i)
+        for(unsigned short j = 0;j < length[i];++j)
+            points.push_back(tipl::vector<3,short>(short(start[i][0]+j),start[i][1],start[i][2]));
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::set_region(std::vector<tipl::vector<3,short> >&& new_region)
+{
+    if(!std::is_sorted(new_region.begin(),new_region.end()))
+        std::sort(new_region.begin(),new_region.end());
+    region_change change;
+    if(std::is_sorted(region.begin(),region.end()))
+    {
+        std::vector<tipl::vector<3,short> > added(new_region.size()),removed(region.size());
+        added.resize(size_t(std::set_difference(new_region.begin(),new_region.end(),
+                                                region.begin(),region.end(),added.begin())-added.begin()));
+        removed.resize(size_t(std::set_difference(region.begin(),region.end(),
+                                                  new_region.begin(),new_region.end(),removed.begin())-removed.begin()));
+        if(added.empty() && removed.empty())
+            return;
+        change.added.encode(added);
+        change.removed.encode(removed);
+    }
+    // store the previous region if the difference takes more space
+    region_runs previous;
+    previous.encode(region);
+    if(change.added.start.size()+change.removed.start.size() >= previous.start.size() ||
+       (change.added.empty() && change.removed.empty()))
+    {
+        change = region_change();
+        change.snapshot = true;
+        change.removed.start.swap(previous.start);
+        change.removed.length.swap(previous.length);
+    }
+    if(!region.empty() || !change.snapshot)
+        undo_backup.push_back(std::move(change));
+    // a new edit invalidates the redo steps, which are deltas from the current region
+    redo_backup.clear();
+    region.swap(new_region);
+    modified = true;
+    region_index_dirty = true;
+}
+// apply the change, and turn it into the change that reverts it
+static void apply_region_change(std::vector<tipl::vector<3,short> >& region,region_change& change,bool reverse)
+{
+    if(change.snapshot)
+    {
+        std::vector<tipl::vector<3,short> > other;
+        change.removed.decode(other);
+        change.removed.encode(region);
+        region.swap(other);
+        return;
+    }
+    std::vector<tipl::vector<3,short> > added,removed;
+    change.added.decode(added);
+    change.removed.decode(removed);
+    if(reverse)
+        std::swap(added,removed);
+    std::vector<tipl::vector<3,short> > remain(region.size()),result(region.size()+added.size());
+    remain.resize(size_t(std::set_difference(region.begin(),region.end(),removed.begin(),removed.end(),remain.begin())-remain.begin()));
+    result.resize(size_t(std::set_union(remain.begin(),remain.end(),added.begin(),added.end(),result.begin())-result.begin()));
+    region.swap(result);
+}
+void ROIRegion::undo(void)
+{
+    if(region.empty() && undo_backup.empty())
+        return;
+    if(undo_backup.empty())
+    {
+        // the initial region can be undone to an empty one
+        region_change change;
+        change.snapshot = true;
+        change.removed.encode(region);
+        redo_backup.push_back(std::move(change));
         region.clear();
-        for(tipl::pixel_index<3> index(mask.geometry());index.is_valid(mask.geometry());++index)
-            if(mask[index.index()])
-                region.push_back(tipl::vector<3,short>(index[0]+min_value[0],
-                                                    index[1]+min_value[1],
-                                                    index[2]+min_value[2]));
     }
     else
     {
-        alternative:
-        std::sort(points.begin(),points.end());
-        if(!del)
-        {
-            if(region.empty())
-                region.swap(points);
-            else
-            {
-                std::vector<tipl::vector<3,short> > union_points(region.size()+points.size());
-                std::vector<tipl::vector<3,short> >::iterator it =
-                    std::set_union(region.begin(),region.end(),
-                                   points.begin(),points.end(),
-                                   union_points.begin());
-                union_points.resize(it-union_points.begin());
-                region.swap(union_points);
-            }
-        }
-        else
+        apply_region_change(region,undo_backup.back(),true);
+        redo_backup.push_back(std::move(undo_backup.back()));
+        undo_backup.pop_back();
+    }
+    modified = true;
+    region_index_dirty = true;
+}
+bool ROIRegion::redo(void)
+{
+    if(redo_backup.empty())
+        return false;
+    apply_region_change(region,redo_backup.back(),false);
+    undo_backup.push_back(std::move(redo_backup.back()));
+    redo_backup.pop_back();
+    modified = true;
+    region_index_dirty = true;
+    return true;
+}
+bool ROIRegion::has_voxel(const tipl::vector<3,short>& p) const
+{
+    auto brick_key = [](const tipl::vector<3,short>& v)
+    {
+        return (uint64_t(uint16_t(v[0] >> 3)) << 32) | (uint64_t(uint16_t(v[1] >> 3)) << 16) | uint64_t(uint16_t(v[2] >> 3));
+    };
+    auto brick_bit = [](const tipl::vector<3,short>& v)
+    {
+        return uint32_t(((v[2] & 7) << 6) | ((v[1] & 7) << 3) | (v[0] & 7));
+    };
+    std::lock_guard<std::mutex> lock(region_index_mutex);
+    if(region_index_dirty)
+    {
+        region_index.clear();
+        for(const auto& each : region)
         {
-            // find interset first
-            std::vector<tipl::vector<3,short> > intersect_points(std::max(region.size(),points.size()));
-            std::vector<tipl::vector<3,short> >::iterator it =
-                std::set_intersection(region.begin(),region.end(),
-                                      points.begin(),points.end(),
-                                      intersect_points.begin());
-            intersect_points.resize(it-intersect_points.begin());
-
-            std::vector<tipl::vector<3,short> > remain_points(region.size());
-            it = std::set_difference(region.begin(),region.end(),
-                                     intersect_points.begin(),intersect_points.end(),
-                                     remain_points.begin());
-            remain_points.resize(it-remain_points.begin());
-            region.swap(remain_points);
+            uint32_t bit = brick_bit(each);
+            auto& brick = region_index[brick_key(each)];
+            brick[bit >> 6] |= uint64_t(1) << (bit & 63);
         }
-        region.erase(std::unique(region.begin(), region.end()), region.end());
+        region_index_dirty = false;
     }
-    modified = true;
-
+    auto iter = region_index.find(brick_key(p));
+    if(iter == region_index.end())
+        return false;
+    uint32_t bit = brick_bit(p);
+    return (iter->second[bit >> 6] >> (bit & 63)) & 1;
 }
 
 // ---------------------------------------------------------------------------
@@ -212,8 +256,12 @@ bool ROIRegion::LoadFromFile(const char* FileName) {
     if(file_name.length() > 4)
         ext = std::string(file_name.end()-4,file_name.end());
 
+    // a loaded region starts a new edit history
     modified = true;
+    region_index_dirty = true;
     region.clear();
+    undo_backup.clear();
+    redo_backup.clear();
 
     if (ext == std::string(".txt"))
     {
@@ -227,7 +275,7 @@ bool ROIRegion::LoadFromFile(const char* FileName) {
             resolution_ratio = points.back()[0];
             points.pop_back();
         }
-        region.swap(points);
+        set_region(std::move(points));
         return true;
     }
 
@@ -366,41 +414,50 @@ void ROIRegion::perform(const std::string& action)
     if(resolution_ratio > 8)
         return;
     tipl::image<unsigned char, 3>mask;
-    if(action == "smoothing")
-    {
-        SaveToBuffer(mask);
-        tipl::morphology::smoothing(mask);
-        LoadFromBuffer(mask);
-    }
-    if(action == "erosion")
+    if(!region.empty() &&
+       (action == "smoothing" || action == "erosion" || action == "dilation" ||
+        action == "opening" || action == "closing" || action == "defragment"))
     {
-        SaveToBuffer(mask);
-        tipl::morphology::erosion(mask);
-        LoadFromBuffer(mask);
-    }
-    if(action == "dilation")
-    {
-        SaveToBuffer(mask);
-        tipl::morphology::dilation(mask);
-        LoadFromBuffer(mask);
-    }
-    if(action == "opening")
-    {
-        SaveToBuffer(mask);
-        tipl::morphology::opening(mask);
-        LoadFromBuffer(mask);
-    }
-    if(action == "closing")
-    {
-        SaveToBuffer(mask);
-        tipl::morphology::closing(mask);
-        LoadFromBuffer(mask);
-    }
-    if(action == "defragment")
-    {
-        SaveToBuffer(mask);
-        tipl::morphology::defragment(mask);
-        LoadFromBuffer(mask);
+        // only the bounding box of the region, with a margin for dilation, is rasterized
+        const short margin = 2;
+        tipl::geometry<3> buffer_geo = get_buffer_dim();
+        tipl::vector<3,short> min_value(region[0]),max_value(region[0]);
+        for(const auto& p : region)
+            for(unsigned int d = 0;d < 3;++d)
+            {
+                min_value[d] = std::min(min_value[d],p[d]);
+                max_value[d] = std::max(max_value[d],p[d]);
+            }
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            min_value[d] = short(std::max<int>(0,min_value[d]-margin));
+            max_value[d] = short(std::min<int>(int(buffer_geo[d])-1,max_value[d]+margin));
+        }
+        mask.resize(tipl::geometry<3>(max_value[0]-min_value[0]+1,max_value[1]-min_value[1]+1,max_value[2]-min_value[2]+1));
+        for(const auto& p : region)
+        {
+            auto q = p;
+            q -= min_value;
+            if(mask.geometry().is_valid(q))
+                mask.at(q[0],q[1],q[2]) = 1;
+        }
+        if(action == "smoothing")
+            tipl::morphology::smoothing(mask);
+        if(action == "erosion")
+            tipl::morphology::erosion(mask);
+        if(action == "dilation")
+            tipl::morphology::dilation(mask);
+        if(action == "opening")
+            tipl::morphology::opening(mask);
+        if(action == "closing")
+            tipl::morphology::closing(mask);
+        if(action == "defragment")
+            tipl::morphology::defragment(mask);
+        std::vector<tipl::vector<3,short> > points;
+        for (tipl::pixel_index<3> index(mask.geometry());index < mask.size();++index)
+            if (mask[index.index()])
+                points.push_back(tipl::vector<3,short>(index.x()+min_value[0],index.y()+min_value[1],index.z()+min_value[2]));
+        set_region(std::move(points));
     }
     if(action == "negate")
     {
@@ -413,12 +470,11 @@ void ROIRegion::perform(const std::string& action)
 
 // ---------------------------------------------------------------------------
 void ROIRegion::Flip(unsigned int dimension) {
-    modified = true;
-    if(!region.empty())
-        undo_backup.push_back(region);
-    for (unsigned int index = 0; index < region.size(); ++index)
-        region[index][dimension] = (float)dim[dimension]*resolution_ratio -
-                                   region[index][dimension] - 1;
+    std::vector<tipl::vector<3,short> > new_region(region);
+    for (unsigned int index = 0; index < new_region.size(); ++index)
+        new_region[index][dimension] = (float)dim[dimension]*resolution_ratio -
+                                   new_region[index][dimension] - 1;
+    set_region(std::move(new_region));
 }
 
 // ---------------------------------------------------------------------------
@@ -429,10 +485,15 @@ bool ROIRegion::shift(tipl::vector<3,float> dx) {
     if(dx[0] == 0.0f && dx[1] == 0.0f && dx[2] == 0.0f)
         return false;
     show_region.move_object(dx/resolution_ratio);
-    tipl::par_for(region.size(),[&](unsigned int index)
+    std::vector<tipl::vector<3,short> > new_region(region);
+    tipl::par_for(new_region.size(),[&](unsigned int index)
     {
-        region[index] += dx;
+        new_region[index] += dx;
     });
+    // the mesh has been moved, no need to rebuild it
+    bool was_modified = modified;
+    set_region(std::move(new_region));
+    modified = was_modified;
     return true;
 }
 // ---------------------------------------------------------------------------
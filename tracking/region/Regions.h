@@ -3,6 +3,9 @@
 #define RegionsH
 #include <vector>
 #include <map>
+#include <array>
+#include <mutex>
+#include <unordered_map>
 
 #include "tipl/tipl.hpp"
 #include "RegionModel.h"
@@ -17,6 +20,20 @@ const unsigned char seed_id = 3;
 const unsigned char terminate_id = 4;
 const unsigned char not_ending_id = 5;
 void initial_LPS_nifti_srow(tipl::matrix<4,4,float>& T,const tipl::geometry<3>& geo,const tipl::vector<3>& vs);
+// a sorted point list stored as runs of consecutive x
+struct region_runs{
+    std::vector<tipl::vector<3,short> > start;
+    std::vector<unsigned short> length;
+    void encode(const std::vector<tipl::vector<3,short> >& points);
+    void decode(std::vector<tipl::vector<3,short> >& points) const;
+    bool empty(void) const{return start.empty();}
+};
+// an undo/redo step: either the voxels added and removed by an edit,
+// or, when that is larger, the whole region on the other side of the edit
+struct region_change{
+    bool snapshot = false;
+    region_runs added,removed;
+};
 class ROIRegion {
 public:
         tipl::geometry<3> dim;
@@ -24,8 +41,14 @@ public:
         tipl::matrix<4,4,float> trans_to_mni;
 public:
         std::vector<tipl::vector<3,short> > region;
-        std::vector<std::vector<tipl::vector<3,short> > > undo_backup;
-        std::vector<std::vector<tipl::vector<3,short> > > redo_backup;
+        std::vector<region_change> undo_backup;
+        std::vector<region_change> redo_backup;
+        void set_region(std::vector<tipl::vector<3,short> >&& new_region);
+private: // 8x8x8 voxel bricks for constant time has_point
+        mutable std::mutex region_index_mutex;
+        mutable std::unordered_map<uint64_t,std::array<uint64_t,8> > region_index;
+        mutable bool region_index_dirty = true;
+        bool has_voxel(const tipl::vector<3,short>& p) const;
 public:
         bool super_resolution = false;
         float resolution_ratio = 1.0;
@@ -60,6 +83,7 @@ public: // rendering options
             regions_feature = rhs.regions_feature;
             show_region = rhs.show_region;
             modified = true;
+            region_index_dirty = true;
             super_resolution = rhs.super_resolution;
             resolution_ratio = rhs.resolution_ratio;
             return *this;
@@ -75,6 +99,7 @@ public: // rendering options
             std::swap(regions_feature,rhs.regions_feature);
             show_region.swap(rhs.show_region);
             std::swap(modified,rhs.modified);
+            region_index_dirty = rhs.region_index_dirty = true;
             std::swap(super_resolution,rhs.super_resolution);
             std::swap(resolution_ratio,rhs.resolution_ratio);
         }
@@ -117,25 +142,22 @@ public: // rendering options
         const std::vector<tipl::vector<3,short> >& get_region_voxels_raw(void) const {return region;}
         void assign(const std::vector<tipl::vector<3,short> >& region_,float r)
         {
-            if(!region.empty())
-                undo_backup.push_back(region);
-            region = region_;
+            set_region(std::vector<tipl::vector<3,short> >(region_));
             resolution_ratio = r;
-            modified = true;
         }
 
         bool empty(void) const {return region.empty();}
 
         void clear(void)
         {
-            modified = true;
-            region.clear();
+            set_region(std::vector<tipl::vector<3,short> >());
         }
 
         void erase(unsigned int index)
         {
-            modified = true;
-            region.erase(region.begin()+index);
+            std::vector<tipl::vector<3,short> > new_region(region);
+            new_region.erase(new_region.begin()+index);
+            set_region(std::move(new_region));
         }
 
         unsigned int size(void) const {return (unsigned int)region.size();}
@@ -184,30 +206,8 @@ public:
         }
         void add_points(std::vector<tipl::vector<3,float> >& points,bool del,float point_resolution = 1.0);
         void add_points(std::vector<tipl::vector<3,short> >& points,bool del,float point_resolution = 1.0);
-        void undo(void)
-        {
-            if(region.empty() && undo_backup.empty())
-                return;
-            redo_backup.push_back(std::move(region));
-            if(!undo_backup.empty())
-            {
-                region = std::move(undo_backup.back());
-                undo_backup.pop_back();
-            }
-            modified = true;
-
-        }
-        bool redo(void)
-        {
-            if(redo_backup.empty())
-                return false;
-            undo_backup.push_back(std::vector<tipl::vector<3,short> >());
-            undo_backup.back().swap(region);
-            region.swap(redo_backup.back());
-            redo_backup.pop_back();
-            modified = true;
-            return true;
-        }
+        void undo(void);
+        bool redo(void);
         void SaveToFile(const char* FileName);
         bool LoadFromFile(const char* FileName);
         void Flip(unsigned int dimension);
@@ -234,9 +234,6 @@ public:
         template<class image_type>
         void LoadFromBuffer(const image_type& mask)
         {
-            modified = true;
-            if(!region.empty())
-                undo_backup.push_back(std::move(region));
             std::vector<tipl::vector<3,short> > points;
             if(mask.width() != dim[0])
                 resolution_ratio = float(mask.width())/float(dim[0]);
@@ -258,7 +255,7 @@ public:
                     if (mask[index.index()] != 0)
                         points.push_back(tipl::vector<3,short>(index.x(), index.y(),index.z()));
             }
-            region.swap(points);
+            set_region(std::move(points));
         }
         void SaveToBuffer(tipl::image<unsigned char, 3>& mask,float target_resolution);
         void SaveToBuffer(tipl::image<unsigned char, 3>& mask){SaveToBuffer(mask,resolution_ratio);}
@@ -272,12 +269,12 @@ public:
                 tipl::vector<3,short> p(std::round(point[0]*resolution_ratio),
                                          std::round(point[1]*resolution_ratio),
                                          std::round(point[2]*resolution_ratio));
-                return std::binary_search(region.begin(),region.end(),p);
+                return has_voxel(p);
             }
             tipl::vector<3,short> p(std::round(point[0]),
                                      std::round(point[1]),
                                      std::round(point[2]));
-            return std::binary_search(region.begin(),region.end(),p);
+            return has_voxel(p);
         }
         template<typename value_type>
         bool has_points(const std::vector<tipl::vector<3,value_type> >& points) const
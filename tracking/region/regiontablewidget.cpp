@@ -1311,9 +1311,8 @@ void RegionTableWidget::setROIs(ThreadData* data)
     for (unsigned int index = 0;index < regions.size();++index)
         if (!regions[index]->empty() && item(int(index),0)->checkState() == Qt::Checked
                 && !(regions[index]->regions_feature == 0 && roi_count > 5))
-            data->roi_mgr->setRegions(regions[index]->get_region_voxels_raw(),
-                                     regions[index]->resolution_ratio,
-                             regions[index]->regions_feature,item(int(index),0)->text().toLocal8Bit().begin());
+            data->roi_mgr->setRegions(*regions[index],regions[index]->regions_feature,
+                                      item(int(index),0)->text().toLocal8Bit().begin());
     // auto track
     if(cur_tracking_window.ui->target->currentIndex() > 0 &&
        cur_tracking_window.handle->track_atlas.get())
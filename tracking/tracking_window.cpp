@@ -408,6 +408,7 @@ tracking_window::tracking_window(QWidget *parent,std::shared_ptr<fib_data> new_h
         connect(ui->actionK_means_Clustering,SIGNAL(triggered()),tractWidget,SLOT(clustering_kmeans()));
         connect(ui->actionEM_Clustering,SIGNAL(triggered()),tractWidget,SLOT(clustering_EM()));
         connect(ui->actionHierarchical,SIGNAL(triggered()),tractWidget,SLOT(clustering_hie()));
+        connect(ui->actionQuickBundles_Clustering,SIGNAL(triggered()),tractWidget,SLOT(clustering_qb()));
         connect(ui->actionOpen_Cluster_Labels,SIGNAL(triggered()),tractWidget,SLOT(open_cluster_label()));
         connect(ui->actionRecognize_Clustering,SIGNAL(triggered()),tractWidget,SLOT(auto_recognition()));
         connect(ui->actionRecognize_and_Rename,SIGNAL(triggered()),tractWidget,SLOT(recognize_rename()));
@@ -2804,8 +2805,8 @@ void tracking_window::on_actionAdjust_Atlas_Mapping_triggered()
     handle->manual_template_T = manual->iT;
     handle->has_manual_atlas = true;
     handle->need_normalization = true;
-    handle->mni_position.clear();
-    handle->inv_mni_position.clear();
+    handle->clear_normalization();
+    handle->atlas_label_cache.clear();
     handle->run_normalization(true,true);
     handle->run_normalization(true,false);
 }
@@ -586,8 +586,9 @@ void TractTableWidget::clustering(int method_id)
     if(!ok)
         return;
     ok = true;
-    double detail = method_id ? 0.0 : QInputDialog::getDouble(this,
-            "DSI Studio","Clustering detail (mm):",cur_tracking_window.handle->vs[0],0.2,50.0,2,&ok);
+    double detail = (method_id == 1 || method_id == 2) ? 0.0 : QInputDialog::getDouble(this,
+            "DSI Studio",method_id == 3 ? "Distance threshold (voxels):" : "Clustering detail (mm):",
+            method_id == 3 ? 10.0 : double(cur_tracking_window.handle->vs[0]),0.2,50.0,2,&ok);
     if(!ok)
         return;
     tract_models[uint32_t(currentRow())]->run_clustering(method_id,n,detail);
@@ -671,7 +672,9 @@ void TractTableWidget::save_vrml_as(void)
                                                 cur_tracking_window["tract_style"].toInt(),
                                                 cur_tracking_window["tract_color_style"].toInt(),
                                                 cur_tracking_window["tube_diameter"].toFloat(),
-                                                cur_tracking_window["tract_tube_detail"].toInt(),surface_text);
+                                                cur_tracking_window["tract_tube_detail"].toInt(),surface_text,
+                                                // export at the simplification shown when it is turned on
+                                                cur_tracking_window["tract_lod"].toInt() ? cur_tracking_window.glWidget->get_tract_lod_tolerance() : 0.0f);
 }
 void TractTableWidget::save_all_tracts_end_point_as(void)
 {
@@ -1217,7 +1220,9 @@ void TractTableWidget::separate_deleted_track(void)
     if(currentRow() >= int(tract_models.size()) || currentRow() == -1)
         return;
     std::vector<std::vector<float> > new_tracks;
+    std::vector<float> new_weights;
     new_tracks.swap(tract_models[uint32_t(currentRow())]->get_deleted_tracts());
+    new_weights.swap(tract_models[uint32_t(currentRow())]->get_deleted_tract_weight());
     if(new_tracks.empty())
         return;
     // clean the deleted tracks
@@ -1226,7 +1231,7 @@ void TractTableWidget::separate_deleted_track(void)
     item(currentRow(),2)->setText(QString::number(tract_models[uint32_t(currentRow())]->get_deleted_track_count()));
     // add deleted tracks to a new entry
     addNewTracts(item(currentRow(),0)->text(),false);
-    tract_models.back()->add_tracts(new_tracks);
+    tract_models.back()->add_tracts(new_tracks,new_weights);
     tract_models.back()->report = tract_models[uint32_t(currentRow())]->report;
     item(rowCount()-1,1)->setText(QString::number(tract_models.back()->get_visible_track_count()));
     item(rowCount()-1,2)->setText(QString::number(tract_models.back()->get_deleted_track_count()));